@@ -0,0 +1,285 @@
+/// Validates and benchmarks the BGRA to YUV420P kernels against swscale.
+/// Each source frame is converted at the same and at the halved size by every kernel supported by the CPU and by
+/// sws_scale, with the scaling flags the swscale ring would use. The kernels outputs must be bit-identical, and their
+/// PSNR against swscale must be above a threshold. The time per frame is reported for each converter.
+/// Usage: bgra_to_yuv_benchmark [--size WIDTHxHEIGHT] [FRAME.bgra ...]
+/// Besides a random frame and a synthetic desktop, raw BGRA captures of the passed size (1920x1080 by default) are
+/// converted, e.g. dumped with: ffmpeg -f x11grab -video_size 1920x1080 -i :0 -frames:v 1 -f rawvideo -pix_fmt bgra
+/// frame.bgra
+
+#include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include "../src/recording_service/error.h"
+#include "../src/recording_service/process_chain/bgra_to_yuv_filter_ring.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+
+const int ITERATIONS = 50;
+
+// Random pixels have no spatial correlation, so the different filters of the kernels and swscale give a lower PSNR
+const double MIN_RANDOM_PSNR = 15;
+const double MIN_PSNR = 28;
+
+struct SourceFrame {
+    std::string name;
+    std::unique_ptr<AVFrame, FFMpegObjectsDeleter> frame;
+    double minPSNR;
+};
+
+/// Holds the last frame passed by the converter
+class FrameCollector : public FilterChainRing {
+public:
+    std::unique_ptr<AVFrame, FFMpegObjectsDeleter> frame;
+
+    void execute(ProcessContext *processContext, AVFrame *inputFrame) override {
+        frame.reset(av_frame_clone(inputFrame));
+    }
+};
+
+static std::unique_ptr<AVFrame, FFMpegObjectsDeleter> allocate_frame(AVPixelFormat pixelFormat, int width,
+                                                                     int height) {
+    std::unique_ptr<AVFrame, FFMpegObjectsDeleter> frame(av_frame_alloc());
+    if (!frame) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, "error allocating a new frame"));
+    }
+    frame->format = pixelFormat;
+    frame->width = width;
+    frame->height = height;
+    int ret = av_frame_get_buffer(frame.get(), 0);
+    if (ret < 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {}, fmt::format("error allocating the frame buffer ({})",
+                                                                         Error::unpackAVError(ret))));
+    }
+    return frame;
+}
+
+static std::unique_ptr<AVFrame, FFMpegObjectsDeleter> make_random_frame(int width, int height) {
+    auto frame = allocate_frame(AV_PIX_FMT_BGRA, width, height);
+    std::mt19937 generator(1);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width * 4; x++) {
+            frame->data[0][y * frame->linesize[0] + x] = (uint8_t) generator();
+        }
+    }
+    return frame;
+}
+
+/// Draws a desktop-like frame: a gradient background, flat windows with title bars, and rows of text-like strokes
+static std::unique_ptr<AVFrame, FFMpegObjectsDeleter> make_desktop_frame(int width, int height) {
+    auto frame = allocate_frame(AV_PIX_FMT_BGRA, width, height);
+    auto fill = [&frame](int left, int top, int right, int bottom, uint8_t b, uint8_t g, uint8_t r) {
+        for (int y = std::max(top, 0); y < std::min(bottom, frame->height); y++) {
+            for (int x = std::max(left, 0); x < std::min(right, frame->width); x++) {
+                uint8_t *pixel = frame->data[0] + y * frame->linesize[0] + x * 4;
+                pixel[0] = b;
+                pixel[1] = g;
+                pixel[2] = r;
+                pixel[3] = 255;
+            }
+        }
+    };
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            fill(x, y, x + 1, y + 1, 160 - y * 96 / height, 80 + x * 64 / width, 40 + y * 48 / height);
+        }
+    }
+    for (int window = 0; window < 3; window++) {
+        int left = width / 10 + window * width / 4;
+        int top = height / 8 + window * height / 6;
+        int right = left + width * 2 / 5;
+        int bottom = top + height / 2;
+        fill(left, top, right, top + 24, 60, 60, 60);
+        fill(left, top + 24, right, bottom, 245, 245, 245);
+        for (int line = top + 36; line + 10 < bottom; line += 18) {
+            for (int word = left + 12; word + 40 < right; word += 48) {
+                for (int stroke = word; stroke < word + 40; stroke += 3) {
+                    fill(stroke, line, stroke + 1, line + 10, 30, 30, 30);
+                }
+            }
+        }
+    }
+    return frame;
+}
+
+static std::unique_ptr<AVFrame, FFMpegObjectsDeleter> read_raw_frame(const std::string &path, int width,
+                                                                     int height) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!file.is_open() || data.size() != (size_t) width * height * 4) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {}, fmt::format("{} is not a raw {}x{} BGRA frame", path,
+                                                                         width, height)));
+    }
+    auto frame = allocate_frame(AV_PIX_FMT_BGRA, width, height);
+    av_image_copy_plane(frame->data[0], frame->linesize[0], data.data(), width * 4, width * 4, height);
+    return frame;
+}
+
+/// Returns the PSNR of the YUV420P frames, over the samples of all the planes
+static double compute_psnr(const AVFrame *frame, const AVFrame *reference) {
+    double squaredErrors = 0;
+    int64_t samples = 0;
+    for (int plane = 0; plane < 3; plane++) {
+        int width = plane ? frame->width / 2 : frame->width;
+        int height = plane ? frame->height / 2 : frame->height;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int error = frame->data[plane][y * frame->linesize[plane] + x] -
+                            reference->data[plane][y * reference->linesize[plane] + x];
+                squaredErrors += error * error;
+            }
+        }
+        samples += (int64_t) width * height;
+    }
+    if (squaredErrors == 0)
+        return INFINITY;
+    return 10 * std::log10(255.0 * 255.0 * (double) samples / squaredErrors);
+}
+
+static bool is_identical(const AVFrame *frame, const AVFrame *reference) {
+    for (int plane = 0; plane < 3; plane++) {
+        int width = plane ? frame->width / 2 : frame->width;
+        int height = plane ? frame->height / 2 : frame->height;
+        for (int y = 0; y < height; y++) {
+            if (std::memcmp(frame->data[plane] + y * frame->linesize[plane],
+                            reference->data[plane] + y * reference->linesize[plane], width) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+/// Converts the input frame with sws_scale, as the swscale ring would, returning the time per frame in ms
+static double convert_swscale(const SWScaleConfig &config, AVFrame *inputFrame, AVFrame *outputFrame) {
+    std::unique_ptr<SwsContext, FFMpegObjectsDeleter> context(
+            sws_getContext(config.cropWidth, config.cropHeight, config.inputPixelFormat, config.outputWidth,
+                           config.outputHeight, config.outputPixelFormat,
+                           SWScaleFilterRing::get_scaling_flags(config), nullptr, nullptr, nullptr));
+    if (!context) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, "error allocating the converter"));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sws_scale(context.get(), inputFrame->data, inputFrame->linesize, 0, config.cropHeight, outputFrame->data,
+                  outputFrame->linesize);
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / ITERATIONS;
+}
+
+/// Converts the input frame through the ring with the passed kernels, returning the time per frame in ms
+static double convert_kernels(const SWScaleConfig &config, const std::string &kernelName, AVFrame *inputFrame,
+                              std::unique_ptr<AVFrame, FFMpegObjectsDeleter> &outputFrame) {
+    auto framePool = std::make_shared<FramePool>();
+    auto ring = std::make_shared<BGRAToYUVFilterRing>(config, framePool, kernelName);
+    auto collector = std::make_shared<FrameCollector>();
+    ring->setNext(collector);
+
+    // Without damage, the whole frame is converted each time
+    ProcessContext context(nullptr, FrameDamage(), 0);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        ring->execute(&context, inputFrame);
+    }
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    outputFrame = std::move(collector->frame);
+    return elapsed / ITERATIONS;
+}
+
+/// Converts the source frame at the same size (factor 1) or at the halved size (factor 2), returning false if a check
+/// failed. The output size must be even: the last input column and row are cropped away if needed.
+static bool run_case(const SourceFrame &source, int factor) {
+    int outputWidth = source.frame->width / factor & ~1;
+    int outputHeight = source.frame->height / factor & ~1;
+    SWScaleConfig config = {
+            .inputWidth = source.frame->width,
+            .inputHeight = source.frame->height,
+            .inputPixelFormat = AV_PIX_FMT_BGRA,
+            .cropX = 0,
+            .cropY = 0,
+            .cropWidth = factor == 1 ? outputWidth : source.frame->width,
+            .cropHeight = factor == 1 ? outputHeight : source.frame->height,
+            .outputWidth = outputWidth,
+            .outputHeight = outputHeight,
+            .outputPixelFormat = AV_PIX_FMT_YUV420P,
+            .sliceCount = 1,
+            .scalingAlgorithm = SCALING_BILINEAR,
+    };
+    std::string caseName = fmt::format("{} {}x{} -> {}x{}", source.name, config.cropWidth, config.cropHeight,
+                                       outputWidth, outputHeight);
+    if (!BGRAToYUVFilterRing::is_supported(config)) {
+        fmt::print("{}: FAILED, conversion not supported\n", caseName);
+        return false;
+    }
+
+    auto reference = allocate_frame(AV_PIX_FMT_YUV420P, outputWidth, outputHeight);
+    double swscaleTime = convert_swscale(config, source.frame.get(), reference.get());
+    fmt::print("{}: swscale {:.3f} ms/frame\n", caseName, swscaleTime);
+
+    bool isPassed = true;
+    std::unique_ptr<AVFrame, FFMpegObjectsDeleter> firstOutput;
+    for (const auto &kernels: BGRAToYUVFilterRing::get_supported_kernels()) {
+        std::unique_ptr<AVFrame, FFMpegObjectsDeleter> output;
+        double time = convert_kernels(config, kernels.name, source.frame.get(), output);
+        double psnr = compute_psnr(output.get(), reference.get());
+
+        bool isIdentical = !firstOutput || is_identical(output.get(), firstOutput.get());
+        bool isAccurate = psnr >= source.minPSNR;
+        isPassed = isPassed && isIdentical && isAccurate;
+        fmt::print("{}: {} {:.3f} ms/frame, PSNR {:.2f} dB{}{}\n", caseName, kernels.name, time, psnr,
+                   isIdentical ? "" : ", FAILED: different from the scalar kernels",
+                   isAccurate ? "" : fmt::format(", FAILED: below {} dB", source.minPSNR));
+        if (!firstOutput)
+            firstOutput = std::move(output);
+    }
+    return isPassed;
+}
+
+int main(int argc, char *argv[]) {
+    int width = 1920;
+    int height = 1080;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                fmt::print(stderr, "Invalid size {}\n", argv[i]);
+                return 2;
+            }
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    try {
+        std::vector<SourceFrame> sources;
+        // A width which is not a multiple of the SIMD vectors, so that the kernels tails are converted too
+        sources.push_back({"random", make_random_frame(1366, 768), MIN_RANDOM_PSNR});
+        sources.push_back({"desktop", make_desktop_frame(width, height), MIN_PSNR});
+        for (const auto &path: paths) {
+            sources.push_back({path, read_raw_frame(path, width, height), MIN_PSNR});
+        }
+
+        bool isPassed = true;
+        for (const auto &source: sources) {
+            isPassed = run_case(source, 1) && isPassed;
+            isPassed = run_case(source, 2) && isPassed;
+        }
+        return isPassed ? 0 : 1;
+    } catch (const std::exception &e) {
+        fmt::print(stderr, "{}\n", e.what());
+        return 1;
+    }
+}
@@ -18,7 +18,11 @@ public:
 
     void wait_recording() { return impl->wait_recording(); };
 
+    void wait_encoding() { return impl->wait_encoding(); };
+
     RecordingStats get_recording_stats() { return impl->get_recording_stats(); };
+
+    EncodingProgress get_encoding_progress() { return impl->get_encoding_progress(); };
 };
 
 #endif //SCREEN_RECORDER_RECORDING_SERVICE_H
@@ -1,6 +1,9 @@
 #include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
 #include <X11/extensions/Xrandr.h>
 #include <dirent.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <vector>
 #include "../../../include/device_service.h"
 
@@ -10,8 +13,51 @@ extern "C" {
 }
 
 static const std::string DEVICE_ID_X11GRAB = "x11grab";
+static const std::string DEVICE_ID_X11SHM = "x11shm";
 static const std::string DEVICE_ID_PULSE = "pulse";
 
+static bool isShmAttachFailed;
+
+static int handle_shm_attach_error(Display* display, XErrorEvent* event) {
+  isShmAttachFailed = true;
+  return 0;
+}
+
+/// Returns true if the X server can attach the shared memory segments of this
+/// process. The MIT-SHM extension can be available while the server can't
+/// access the process memory, e.g. on a remote display forwarded by ssh.
+static bool is_shm_attachable(Display* display) {
+  if (!XShmQueryExtension(display))
+    return false;
+
+  XShmSegmentInfo info = {};
+  info.shmid = shmget(IPC_PRIVATE, 4096, IPC_CREAT | 0600);
+  if (info.shmid < 0)
+    return false;
+  info.shmaddr = (char*)shmat(info.shmid, nullptr, 0);
+  shmctl(info.shmid, IPC_RMID, nullptr);
+  if (info.shmaddr == (char*)-1)
+    return false;
+  info.readOnly = False;
+
+  // Attach errors are reported asynchronously: wait for them with a temporary
+  // error handler, so that they don't exit the process
+  XSync(display, False);
+  isShmAttachFailed = false;
+  XErrorHandler previousHandler = XSetErrorHandler(handle_shm_attach_error);
+  bool isAttached = XShmAttach(display, &info);
+  XSync(display, False);
+  isAttached = isAttached && !isShmAttachFailed;
+  if (isAttached) {
+    XShmDetach(display, &info);
+    XSync(display, False);
+  }
+  XSetErrorHandler(previousHandler);
+
+  shmdt(info.shmaddr);
+  return isAttached;
+}
+
 std::vector<InputDeviceVideo> DeviceService::get_input_video_devices() {
   std::vector<InputDeviceVideo> devices;
   Display* display;
@@ -29,6 +75,11 @@ std::vector<InputDeviceVideo> DeviceService::get_input_video_devices() {
   }
   std::string screenName = "Monitor";
 
+  // Prefer the native MIT-SHM grabber, falling back to x11grab if the X server
+  // can't share memory with this process
+  const std::string& deviceID =
+      is_shm_attachable(display) ? DEVICE_ID_X11SHM : DEVICE_ID_X11GRAB;
+
   for (int monitorIdx = 0; monitorIdx < monitorCnt; monitorIdx++) {
     std::string name = screenName + std::to_string(monitorIdx + 1);
     int x = xMonitors[monitorIdx].x;
@@ -39,7 +90,7 @@ std::vector<InputDeviceVideo> DeviceService::get_input_video_devices() {
     int primary = xMonitors[monitorIdx].primary;
     char* port = XGetAtomName(display, xMonitors[monitorIdx].name);
     InputDeviceVideo deviceVideo(
-        id, DEVICE_ID_X11GRAB, name, static_cast<float>(x),
+        id, deviceID, name, static_cast<float>(x),
         static_cast<float>(y), static_cast<float>(width),
         static_cast<float>(height), primary, std::string(port));
     devices.push_back(deviceVideo);
@@ -0,0 +1,35 @@
+#ifndef PDS_SCREEN_RECORDING_CAPTURER_H
+#define PDS_SCREEN_RECORDING_CAPTURER_H
+
+#include <memory>
+#include "packet_capturer/capture_scheduler.h"
+
+/// A capturer reads the next packets (or frames) from an input source and hands them over to the process chains.
+/// Captures are paced by a CaptureScheduler and their PTS are normalized by the total duration of the pauses.
+class Capturer {
+protected:
+    int64_t totalPauseDuration = 0;
+
+    std::unique_ptr<CaptureScheduler> scheduler;
+
+public:
+    virtual void capture_next() = 0;
+
+    /// Waits until the next capture is due.
+    virtual void wait_next_capture() { scheduler->wait_next_tick(); };
+
+    /// Adds the duration of a resumed pause in order to normalize the captured PTS.
+    /// The capture deadlines are realigned, so the pause is not accounted as missed ticks.
+    void add_pause_duration(int64_t pauseDuration) {
+        totalPauseDuration += pauseDuration;
+        scheduler->resync();
+    };
+
+    [[nodiscard]] int64_t get_pause_duration() const { return totalPauseDuration; };
+
+    [[nodiscard]] CaptureSchedulerStats get_scheduler_stats() const { return scheduler->get_stats(); };
+
+    virtual ~Capturer() = default;
+};
+
+#endif  // PDS_SCREEN_RECORDING_CAPTURER_H
@@ -0,0 +1,24 @@
+#include "frame_capturer.h"
+
+FrameCapturer::FrameCapturer(std::shared_ptr<FrameGrabber> grabber,
+                             int framerate,
+                             CapturedFrameHandler onVideoFrameCapture)
+    : grabber(std::move(grabber)),
+      startTimestamp(AV_NOPTS_VALUE),
+      onVideoFrameCapture(std::move(onVideoFrameCapture)) {
+  scheduler = std::make_unique<CaptureScheduler>(
+      std::chrono::nanoseconds(1000000000 / framerate));
+}
+
+/// Grabs a new frame from the grabber.
+/// The frame PTS is normalized against the first grabbed frame and the total
+/// pause duration.
+void FrameCapturer::capture_next() {
+  auto [frame, damage] = grabber->grab_next();
+
+  if (startTimestamp == AV_NOPTS_VALUE)
+    startTimestamp = frame->pts;
+
+  int64_t framePts = frame->pts - startTimestamp - totalPauseDuration;
+  onVideoFrameCapture(std::move(frame), std::move(damage), framePts);
+}
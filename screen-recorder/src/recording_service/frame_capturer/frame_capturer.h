@@ -0,0 +1,33 @@
+#ifndef PDS_SCREEN_RECORDING_FRAME_CAPTURER_H
+#define PDS_SCREEN_RECORDING_FRAME_CAPTURER_H
+
+#include <functional>
+
+#include "../capturer.h"
+#include "../ffmpeg_objects_deleter.h"
+#include "frame_grabber.h"
+
+typedef std::function<void(std::unique_ptr<AVFrame, FFMpegObjectsDeleter> frame, FrameDamage damage,
+                           int64_t relativePts)>
+CapturedFrameHandler;
+
+/// Captures raw video frames from a native FrameGrabber.
+/// Frames are handed over to the process chain as they are, skipping the demuxing and decoding steps.
+class FrameCapturer : public Capturer {
+    std::shared_ptr<FrameGrabber> grabber;
+
+    int64_t startTimestamp; // microseconds
+
+    CapturedFrameHandler onVideoFrameCapture;
+
+public:
+    FrameCapturer(std::shared_ptr<FrameGrabber> grabber,
+                  int framerate,
+                  CapturedFrameHandler onVideoFrameCapture);
+
+    void capture_next() override;
+
+    ~FrameCapturer() override = default;
+};
+
+#endif  // PDS_SCREEN_RECORDING_FRAME_CAPTURER_H
@@ -0,0 +1,32 @@
+#include "frame_grabber.h"
+#include "../error.h"
+
+#ifdef SCREEN_RECORDER_X11SHM
+#include "x11_shm_grabber.h"
+#endif
+
+/// Returns true if the deviceID identifies a native frame grabber, available on
+/// the current platform.
+bool FrameGrabber::is_native_device(const std::string& deviceID) {
+#ifdef SCREEN_RECORDER_X11SHM
+  if (deviceID == "x11shm")
+    return true;
+#endif
+  return false;
+}
+
+/// Initializes the native frame grabber identified by the passed deviceID.
+/// Grabber options can be set by populating the options map.
+std::unique_ptr<FrameGrabber> FrameGrabber::init_grabber(
+    const std::string& deviceID,
+    const std::string& url,
+    const std::map<std::string, std::string>& optionsMap) {
+#ifdef SCREEN_RECORDER_X11SHM
+  if (deviceID == "x11shm")
+    return std::make_unique<X11ShmGrabber>(url, optionsMap);
+#endif
+
+  throw std::runtime_error(Error::build_error_message(
+      __FUNCTION__, {{"deviceID", deviceID}, {"url", url}},
+      "no native frame grabber found for deviceID"));
+}
@@ -0,0 +1,37 @@
+#ifndef PDS_SCREEN_RECORDING_FRAME_GRABBER_H
+#define PDS_SCREEN_RECORDING_FRAME_GRABBER_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include "../ffmpeg_objects_deleter.h"
+#include "../process_chain/process_context.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+/// A frame grabber is a native capture source which produces raw video frames, without passing through a libavdevice
+/// demuxer and a decoder.
+/// Grabbed frames PTS are expressed in microseconds. Each frame comes with its damage: grabbers able to track screen
+/// changes report which areas changed since the previous frame, or that the frame is just a repetition of it.
+class FrameGrabber {
+public:
+    static bool is_native_device(const std::string &deviceID);
+
+    static std::unique_ptr<FrameGrabber> init_grabber(const std::string &deviceID, const std::string &url,
+                                                      const std::map<std::string, std::string> &optionsMap);
+
+    virtual std::tuple<std::unique_ptr<AVFrame, FFMpegObjectsDeleter>, FrameDamage> grab_next() = 0;
+
+    [[nodiscard]] virtual int getWidth() const = 0;
+
+    [[nodiscard]] virtual int getHeight() const = 0;
+
+    [[nodiscard]] virtual AVPixelFormat getPixelFormat() const = 0;
+
+    virtual ~FrameGrabber() = default;
+};
+
+#endif  // PDS_SCREEN_RECORDING_FRAME_GRABBER_H
@@ -0,0 +1,583 @@
+#include "x11_shm_grabber.h"
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xrandr.h>
+#include <fmt/core.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "../error.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+}
+
+// Upper bound of the memory taken by the segments of a pool. When all the
+// segments are lent, the grabbed frames are copied out of a scratch segment.
+static constexpr int64_t MAX_SEGMENTS_SIZE = 1024 * 1024 * 1024;
+static constexpr int MIN_SEGMENTS = 4;
+
+// Xlib exits the process on X protocol errors by default. The errors raised on
+// the grabber displays are recorded instead, and reported as exceptions.
+static std::mutex xErrorsMutex;
+static std::map<Display*, int> xErrors;
+static XErrorHandler defaultXErrorHandler;
+
+static int handle_x_error(Display* display, XErrorEvent* event) {
+  {
+    std::lock_guard<std::mutex> lk(xErrorsMutex);
+    auto error = xErrors.find(display);
+    if (error != xErrors.end()) {
+      if (!error->second)
+        error->second = event->error_code;
+      return 0;
+    }
+  }
+
+  return defaultXErrorHandler ? defaultXErrorHandler(display, event) : 0;
+}
+
+/// Routes the X errors raised on the display to the grabber error handler.
+static void register_display(Display* display) {
+  static std::once_flag handlerFlag;
+  std::call_once(handlerFlag, [] {
+    defaultXErrorHandler = XSetErrorHandler(handle_x_error);
+  });
+
+  std::lock_guard<std::mutex> lk(xErrorsMutex);
+  xErrors[display] = 0;
+}
+
+static void unregister_display(Display* display) {
+  std::lock_guard<std::mutex> lk(xErrorsMutex);
+  xErrors.erase(display);
+}
+
+/// Returns and clears the first X error raised on the display since the last
+/// call, 0 if none.
+static int take_x_error(Display* display) {
+  std::lock_guard<std::mutex> lk(xErrorsMutex);
+  return std::exchange(xErrors[display], 0);
+}
+
+static std::string describe_x_error(Display* display, int errorCode) {
+  char errorText[256];
+  XGetErrorText(display, errorCode, errorText, sizeof(errorText));
+  return errorText;
+}
+
+/// A shared memory segment, attached to the X server, and its XImage.
+struct X11ShmSegment {
+  XShmSegmentInfo info;
+  XImage* image;
+
+  // Keeps the pool alive while the segment is lent to a frame
+  std::shared_ptr<X11ShmSegmentPool> owner;
+};
+
+/// Pool of shared memory segments, all sized as the grabbed area.
+/// The pool owns the X display connection, so that segments released after the
+/// grabber destruction can still be detached.
+class X11ShmSegmentPool {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<X11ShmSegment>> segments;
+  std::vector<X11ShmSegment*> freeSegments;
+  // Never lent: it receives the grabs while all the other segments are lent
+  X11ShmSegment* scratchSegment;
+
+  std::unique_ptr<X11ShmSegment> create_segment();
+
+ public:
+  Display* display;
+  int width;
+  int height;
+  int maxSegments;
+
+  /// Takes the ownership of the display. The segments size must be set before
+  /// the first acquire.
+  explicit X11ShmSegmentPool(Display* display)
+      : scratchSegment(nullptr),
+        display(display),
+        width(0),
+        height(0),
+        maxSegments(MIN_SEGMENTS) {
+    register_display(display);
+  };
+
+  void set_size(int segmentWidth, int segmentHeight, int segmentCount);
+
+  X11ShmSegment* acquire();
+
+  X11ShmSegment* get_scratch();
+
+  void release(X11ShmSegment* segment);
+
+  ~X11ShmSegmentPool();
+};
+
+/// Allocates a new shared memory segment and attaches it to the X server.
+std::unique_ptr<X11ShmSegment> X11ShmSegmentPool::create_segment() {
+  auto segment = std::make_unique<X11ShmSegment>();
+  int screen = DefaultScreen(display);
+
+  segment->image = XShmCreateImage(
+      display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+      ZPixmap, nullptr, &segment->info, width, height);
+  if (!segment->image) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {}, "error creating the shared memory image"));
+  }
+
+  segment->info.shmid =
+      shmget(IPC_PRIVATE, segment->image->bytes_per_line * segment->image->height,
+             IPC_CREAT | 0600);
+  if (segment->info.shmid < 0) {
+    XDestroyImage(segment->image);
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {}, "error allocating the shared memory segment"));
+  }
+
+  segment->info.shmaddr = (char*)shmat(segment->info.shmid, nullptr, 0);
+  segment->image->data = segment->info.shmaddr;
+  segment->info.readOnly = False;
+
+  // Mark the segment for destruction: it will be released as soon as both the
+  // process and the X server detach from it
+  bool attached = segment->info.shmaddr != (char*)-1 &&
+                  XShmAttach(display, &segment->info);
+  XSync(display, False);
+  attached = !take_x_error(display) && attached;
+  shmctl(segment->info.shmid, IPC_RMID, nullptr);
+
+  if (!attached) {
+    if (segment->info.shmaddr != (char*)-1)
+      shmdt(segment->info.shmaddr);
+    XDestroyImage(segment->image);
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {}, "error attaching the shared memory segment"));
+  }
+
+  return segment;
+}
+
+/// Sets the segments size, and how many segments can be lent at once, within
+/// the memory budget.
+void X11ShmSegmentPool::set_size(int segmentWidth,
+                                 int segmentHeight,
+                                 int segmentCount) {
+  width = segmentWidth;
+  height = segmentHeight;
+
+  // Segments are 32 bits per pixel
+  int64_t segmentSize = (int64_t)width * height * 4;
+  maxSegments = (int)std::clamp<int64_t>(
+      segmentCount, MIN_SEGMENTS,
+      std::max<int64_t>(MIN_SEGMENTS, MAX_SEGMENTS_SIZE / segmentSize));
+}
+
+/// Returns a free segment, allocating a new one if all of them are lent.
+/// Returns nullptr if the pool is full and all its segments are lent.
+X11ShmSegment* X11ShmSegmentPool::acquire() {
+  std::lock_guard<std::mutex> lk(mutex);
+  if (freeSegments.empty()) {
+    if ((int)segments.size() >= maxSegments)
+      return nullptr;
+
+    segments.push_back(create_segment());
+    return segments.back().get();
+  }
+
+  auto segment = freeSegments.back();
+  freeSegments.pop_back();
+  return segment;
+}
+
+void X11ShmSegmentPool::release(X11ShmSegment* segment) {
+  std::lock_guard<std::mutex> lk(mutex);
+  freeSegments.push_back(segment);
+}
+
+/// Returns the scratch segment, allocating it on first use. It is only used by
+/// the grabbing thread.
+X11ShmSegment* X11ShmSegmentPool::get_scratch() {
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!scratchSegment) {
+    segments.push_back(create_segment());
+    scratchSegment = segments.back().get();
+  }
+  return scratchSegment;
+}
+
+X11ShmSegmentPool::~X11ShmSegmentPool() {
+  for (auto& segment : segments) {
+    XShmDetach(display, &segment->info);
+    XDestroyImage(segment->image);
+    shmdt(segment->info.shmaddr);
+  }
+  XCloseDisplay(display);
+  unregister_display(display);
+}
+
+/// Returns a segment to its pool when the frame buffer referencing it is freed.
+static void release_segment(void* opaque, uint8_t* data) {
+  auto segment = (X11ShmSegment*)opaque;
+  auto owner = std::move(segment->owner);
+  owner->release(segment);
+}
+
+/// Finds the size of the monitor whose origin is (x,y).
+/// If no monitor is found, the area from (x,y) to the bottom right corner of
+/// the screen is used.
+static std::tuple<int, int> get_monitor_size(Display* display, int x, int y) {
+  int width = DisplayWidth(display, DefaultScreen(display)) - x;
+  int height = DisplayHeight(display, DefaultScreen(display)) - y;
+
+  int monitorCnt;
+  XRRMonitorInfo* xMonitors =
+      XRRGetMonitors(display, DefaultRootWindow(display), false, &monitorCnt);
+  for (int monitorIdx = 0; monitorIdx < monitorCnt; monitorIdx++) {
+    if (xMonitors[monitorIdx].x == x && xMonitors[monitorIdx].y == y) {
+      width = xMonitors[monitorIdx].width;
+      height = xMonitors[monitorIdx].height;
+      break;
+    }
+  }
+  if (xMonitors)
+    XRRFreeMonitors(xMonitors);
+
+  return {width, height};
+}
+
+/// Initializes the grabber for the area identified by the passed url.
+X11ShmGrabber::X11ShmGrabber(const std::string& url,
+                             const std::map<std::string, std::string>& optionsMap)
+    : originX(0),
+      originY(0),
+      drawCursor(true),
+      lastCursorArea(0, 0, 0, 0),
+      lastCursorSerial(0),
+      trackDamage(false),
+      damage(0),
+      damageRegion(0) {
+  // Build method params for error handling purposes
+  std::map<std::string, std::string> methodParams = {{"url", url}};
+
+  // Unpack the url: "{display}+{x},{y}"
+  std::string displayName = url;
+  size_t delimiterIndex = url.find('+');
+  if (delimiterIndex != std::string::npos) {
+    displayName = url.substr(0, delimiterIndex);
+    if (sscanf(url.c_str() + delimiterIndex + 1, "%d,%d", &originX,
+               &originY) != 2) {
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, methodParams, "malformed capture offset"));
+    }
+  }
+
+  Display* display =
+      XOpenDisplay(displayName.empty() ? nullptr : displayName.c_str());
+  if (!display) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, methodParams, "error opening the X display"));
+  }
+
+  segmentPool = std::make_shared<X11ShmSegmentPool>(display);
+
+  if (!XShmQueryExtension(display)) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, methodParams,
+        "the MIT-SHM extension is not available on the X display"));
+  }
+
+  int eventBase, errorBase;
+  bool hasXFixes = XFixesQueryExtension(display, &eventBase, &errorBase);
+  drawCursor = hasXFixes;
+
+  auto videoSizeOption = optionsMap.find("video_size");
+  if (videoSizeOption != optionsMap.end()) {
+    if (sscanf(videoSizeOption->second.c_str(), "%dx%d", &width, &height) !=
+        2) {
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, methodParams, "malformed video_size option"));
+    }
+  } else {
+    std::tie(width, height) = get_monitor_size(display, originX, originY);
+  }
+
+  // The X server rejects grabs exceeding the root window
+  int rootWidth = DisplayWidth(display, DefaultScreen(display));
+  int rootHeight = DisplayHeight(display, DefaultScreen(display));
+  if (originX < 0 || originY < 0 || width <= 0 || height <= 0 ||
+      originX + width > rootWidth || originY + height > rootHeight) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, methodParams,
+        fmt::format("the area {}x{}+{},{} exceeds the {}x{} screen", width,
+                    height, originX, originY, rootWidth, rootHeight)));
+  }
+
+  // The frames held by the chain keep their segments lent
+  int segmentCount = MIN_SEGMENTS;
+  auto segmentsOption = optionsMap.find("segments");
+  if (segmentsOption != optionsMap.end() &&
+      sscanf(segmentsOption->second.c_str(), "%d", &segmentCount) != 1) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, methodParams, "malformed segments option"));
+  }
+  segmentPool->set_size(width, height, segmentCount);
+
+  // Detect the pixel format from the layout of the first segment image
+  auto segment = segmentPool->acquire();
+  XImage* image = segment->image;
+  segmentPool->release(segment);
+
+  if (image->bits_per_pixel == 32 && image->byte_order == LSBFirst &&
+      image->red_mask == 0xff0000 && image->green_mask == 0xff00 &&
+      image->blue_mask == 0xff) {
+    pixelFormat = AV_PIX_FMT_BGR0;
+  } else if (image->bits_per_pixel == 32 && image->byte_order == LSBFirst &&
+             image->red_mask == 0xff && image->green_mask == 0xff00 &&
+             image->blue_mask == 0xff0000) {
+    pixelFormat = AV_PIX_FMT_RGB0;
+  } else {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, methodParams,
+        fmt::format("unsupported X image layout ({} bits per pixel)",
+                    image->bits_per_pixel)));
+  }
+
+  // Subscribe to the screen changes. A single notification is enough to know
+  // that the damage is not empty: the damaged areas are fetched on grab.
+  if (hasXFixes && XDamageQueryExtension(display, &eventBase, &errorBase)) {
+    damage = XDamageCreate(display, DefaultRootWindow(display),
+                           XDamageReportNonEmpty);
+    damageRegion = XFixesCreateRegion(display, nullptr, 0);
+    XSync(display, False);
+    if (int errorCode = take_x_error(display)) {
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, methodParams,
+          fmt::format("error tracking the screen damage: {}",
+                      describe_x_error(display, errorCode))));
+    }
+    trackDamage = true;
+  }
+}
+
+X11ShmGrabber::~X11ShmGrabber() {
+  if (trackDamage) {
+    XDamageDestroy(segmentPool->display, damage);
+    XFixesDestroyRegion(segmentPool->display, damageRegion);
+  }
+}
+
+/// Blends the cursor image over the grabbed frame, at the passed position.
+static void draw_cursor(AVFrame* frame,
+                        XFixesCursorImage* cursor,
+                        int cursorX,
+                        int cursorY) {
+  int startRow = std::max(0, -cursorY);
+  int endRow = std::min((int)cursor->height, frame->height - cursorY);
+  int startCol = std::max(0, -cursorX);
+  int endCol = std::min((int)cursor->width, frame->width - cursorX);
+
+  for (int row = startRow; row < endRow; row++) {
+    uint8_t* dst = frame->data[0] + (cursorY + row) * frame->linesize[0] +
+                   (cursorX + startCol) * 4;
+    for (int col = startCol; col < endCol; col++, dst += 4) {
+      // Cursor pixels are premultiplied ARGB
+      unsigned long pixel = cursor->pixels[row * cursor->width + col];
+      int alpha = (int)((pixel >> 24) & 0xff);
+      if (alpha == 0)
+        continue;
+
+      int r = (int)((pixel >> 16) & 0xff);
+      int g = (int)((pixel >> 8) & 0xff);
+      int b = (int)(pixel & 0xff);
+      if (frame->format == AV_PIX_FMT_RGB0)
+        std::swap(r, b);
+
+      dst[0] = b + dst[0] * (255 - alpha) / 255;
+      dst[1] = g + dst[1] * (255 - alpha) / 255;
+      dst[2] = r + dst[2] * (255 - alpha) / 255;
+    }
+  }
+}
+
+/// Fetches and clears the areas damaged since the last call.
+/// Areas are clipped to the grabbed area and made relative to its origin.
+std::vector<std::tuple<int, int, int, int>>
+X11ShmGrabber::fetch_damaged_regions() {
+  Display* display = segmentPool->display;
+  std::vector<std::tuple<int, int, int, int>> regions;
+
+  // Drop the pending damage notifications: the damage itself is fetched below
+  XEvent event;
+  while (XPending(display))
+    XNextEvent(display, &event);
+
+  XDamageSubtract(display, damage, None, damageRegion);
+
+  int rectanglesCnt;
+  XRectangle* rectangles =
+      XFixesFetchRegion(display, damageRegion, &rectanglesCnt);
+  for (int i = 0; i < rectanglesCnt; i++) {
+    int left = std::max((int)rectangles[i].x - originX, 0);
+    int top = std::max((int)rectangles[i].y - originY, 0);
+    int right = std::min(rectangles[i].x + rectangles[i].width - originX, width);
+    int bottom =
+        std::min(rectangles[i].y + rectangles[i].height - originY, height);
+    if (right > left && bottom > top)
+      regions.emplace_back(left, top, right - left, bottom - top);
+  }
+  if (rectangles)
+    XFree(rectangles);
+
+  return regions;
+}
+
+/// Grabs the next frame into a free shared memory segment.
+/// The returned frame references the segment, whose PTS is the grab time in
+/// microseconds.
+/// If the screen didn't change since the previous grab, no grab happens and the
+/// previous frame is returned again, marked as repeated.
+std::tuple<std::unique_ptr<AVFrame, FFMpegObjectsDeleter>, FrameDamage>
+X11ShmGrabber::grab_next() {
+  Display* display = segmentPool->display;
+  int64_t grabTimestamp = av_gettime_relative();
+
+  // The cursor is not part of the screen damage: its changes are tracked
+  // separately
+  XFixesCursorImage* cursor =
+      drawCursor ? XFixesGetCursorImage(display) : nullptr;
+  std::tuple<int, int, int, int> cursorArea = lastCursorArea;
+  unsigned long cursorSerial = lastCursorSerial;
+  if (cursor) {
+    cursorArea = {cursor->x - cursor->xhot - originX,
+                  cursor->y - cursor->yhot - originY, cursor->width,
+                  cursor->height};
+    cursorSerial = cursor->cursor_serial;
+  }
+  bool isCursorChanged =
+      cursorArea != lastCursorArea || cursorSerial != lastCursorSerial;
+
+  FrameDamage frameDamage;
+  if (drawCursor)
+    frameDamage.cursorArea = cursorArea;
+  if (trackDamage && lastFrame) {
+    frameDamage.regions = fetch_damaged_regions();
+
+    if (frameDamage.regions.empty() && !isCursorChanged) {
+      if (cursor)
+        XFree(cursor);
+
+      auto repeatedFrame = std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(
+          av_frame_clone(lastFrame.get()));
+      if (!repeatedFrame) {
+        throw std::runtime_error(Error::build_error_message(
+            __FUNCTION__, {}, "error referencing the previous frame"));
+      }
+      repeatedFrame->pts = grabTimestamp;
+      frameDamage.isRepeated = true;
+      return {std::move(repeatedFrame), std::move(frameDamage)};
+    }
+
+    if (isCursorChanged) {
+      frameDamage.regions.push_back(lastCursorArea);
+      frameDamage.regions.push_back(cursorArea);
+    }
+  } else if (trackDamage) {
+    // First grab: the whole frame is new, just reset the damage
+    fetch_damaged_regions();
+  }
+  lastCursorArea = cursorArea;
+  lastCursorSerial = cursorSerial;
+
+  auto frame = std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(av_frame_alloc());
+  if (!frame) {
+    if (cursor)
+      XFree(cursor);
+    throw std::runtime_error(
+        Error::build_error_message(__FUNCTION__, {}, "error allocating frame"));
+  }
+
+  // While the pool is exhausted (e.g. the chain is falling behind), the frame is
+  // grabbed in the scratch segment and copied out of it
+  X11ShmSegment* segment = segmentPool->acquire();
+  bool isCopied = !segment;
+  if (isCopied)
+    segment = segmentPool->get_scratch();
+  XImage* image = segment->image;
+
+  // The root window may have shrunk since the grabber initialization: the grab
+  // then fails with an X error
+  bool isGrabbed = XShmGetImage(display, DefaultRootWindow(display), image,
+                                originX, originY, AllPlanes);
+  int errorCode = take_x_error(display);
+  if (!isGrabbed || errorCode) {
+    if (!isCopied)
+      segmentPool->release(segment);
+    if (cursor)
+      XFree(cursor);
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {},
+        fmt::format("error grabbing the screen image: {}",
+                    errorCode ? describe_x_error(display, errorCode)
+                              : "unknown error")));
+  }
+
+  frame->width = width;
+  frame->height = height;
+  frame->format = pixelFormat;
+  frame->pts = grabTimestamp;
+
+  if (isCopied) {
+    if (av_frame_get_buffer(frame.get(), 0) < 0) {
+      if (cursor)
+        XFree(cursor);
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, {}, "error allocating the frame buffer"));
+    }
+    av_image_copy_plane(frame->data[0], frame->linesize[0],
+                        (const uint8_t*)image->data, image->bytes_per_line,
+                        width * 4, height);
+  } else {
+    // Lend the segment to the frame
+    segment->owner = segmentPool;
+    frame->buf[0] = av_buffer_create((uint8_t*)image->data,
+                                     image->bytes_per_line * image->height,
+                                     release_segment, segment, 0);
+    if (!frame->buf[0]) {
+      segment->owner.reset();
+      segmentPool->release(segment);
+      if (cursor)
+        XFree(cursor);
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, {}, "error allocating the frame buffer"));
+    }
+
+    frame->data[0] = frame->buf[0]->data;
+    frame->linesize[0] = image->bytes_per_line;
+  }
+
+  if (cursor) {
+    draw_cursor(frame.get(), cursor, std::get<0>(cursorArea),
+                std::get<1>(cursorArea));
+    XFree(cursor);
+  }
+
+  // Keep a reference to the frame, in order to repeat it if nothing changes
+  if (trackDamage) {
+    lastFrame = std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(
+        av_frame_clone(frame.get()));
+  }
+
+  return {std::move(frame), std::move(frameDamage)};
+}
@@ -0,0 +1,57 @@
+#ifndef PDS_SCREEN_RECORDING_X11_SHM_GRABBER_H
+#define PDS_SCREEN_RECORDING_X11_SHM_GRABBER_H
+
+#include "frame_grabber.h"
+
+class X11ShmSegmentPool;
+
+/// Native Linux screen grabber based on the MIT-SHM X11 extension.
+/// The screen is copied by the X server straight into shared memory segments, which are lent to the grabbed frames as
+/// refcounted buffers: no copy happens between the X server and the process chain. A segment returns to the pool as
+/// soon as the last reference to its frame is released.
+/// When the XDamage extension is available, the grabber tracks the screen changes: if nothing changed since the
+/// previous grab, the screen is not grabbed again and the previous frame is repeated. Otherwise, the damaged areas are
+/// reported along with the frame.
+/// The accepted url format is the same used by x11grab: "{display}+{x},{y}". The grabbed area is the monitor whose
+/// origin is (x,y), unless its size is set by the "video_size" option (format: "{width}x{height}").
+/// The "segments" option sets how many frames can reference their segments at once, e.g. the ones waiting in the
+/// process chain: within a memory budget, a segment is allocated for each of them. Beyond that, the frames are copied
+/// out of a scratch segment instead.
+/// X protocol errors, e.g. a grab exceeding a shrunk screen, are reported as exceptions instead of exiting the process.
+class X11ShmGrabber : public FrameGrabber {
+    std::shared_ptr<X11ShmSegmentPool> segmentPool;
+
+    int originX;
+    int originY;
+    int width;
+    int height;
+    AVPixelFormat pixelFormat;
+
+    bool drawCursor;
+    std::tuple<int, int, int, int> lastCursorArea;
+    unsigned long lastCursorSerial;
+
+    // XDamage handles. They are XIDs, kept as integers in order not to leak the X11 headers.
+    bool trackDamage;
+    unsigned long damage;
+    unsigned long damageRegion;
+
+    std::unique_ptr<AVFrame, FFMpegObjectsDeleter> lastFrame;
+
+    std::vector<std::tuple<int, int, int, int>> fetch_damaged_regions();
+
+public:
+    X11ShmGrabber(const std::string &url, const std::map<std::string, std::string> &optionsMap);
+
+    std::tuple<std::unique_ptr<AVFrame, FFMpegObjectsDeleter>, FrameDamage> grab_next() override;
+
+    [[nodiscard]] int getWidth() const override { return width; };
+
+    [[nodiscard]] int getHeight() const override { return height; };
+
+    [[nodiscard]] AVPixelFormat getPixelFormat() const override { return pixelFormat; };
+
+    ~X11ShmGrabber() override;
+};
+
+#endif  // PDS_SCREEN_RECORDING_X11_SHM_GRABBER_H
@@ -0,0 +1,71 @@
+#include "capture_scheduler.h"
+#include <thread>
+
+using namespace std::chrono;
+
+CaptureScheduler::CaptureScheduler(nanoseconds period)
+    : period(duration_cast<steady_clock::duration>(period)),
+      anchor(steady_clock::now()),
+      tickIndex(0),
+      resyncRequested(false),
+      ticks(0),
+      lateTicks(0),
+      missedTicks(0),
+      maxLateness(0),
+      totalJitter(0) {}
+
+/// Blocks until the next capture deadline.
+/// If the deadline has already passed, it returns immediately and accounts the
+/// tick as late. Whole periods elapsed past the deadline are accounted as
+/// missed and skipped, so the loop realigns to the deadlines grid.
+/// The delay of the wake up from the deadline is accounted as jitter.
+void CaptureScheduler::wait_next_tick() {
+  if (period == steady_clock::duration::zero())
+    return;
+
+  auto now = steady_clock::now();
+  if (resyncRequested.exchange(false)) {
+    anchor = now;
+    tickIndex = 0;
+  }
+
+  tickIndex++;
+  auto deadline = anchor + tickIndex * period;
+  ticks++;
+
+  if (now < deadline) {
+    std::this_thread::sleep_until(deadline);
+    totalJitter +=
+        duration_cast<microseconds>(steady_clock::now() - deadline).count();
+    return;
+  }
+
+  auto lateness = now - deadline;
+  lateTicks++;
+
+  int64_t latenessUs = duration_cast<microseconds>(lateness).count();
+  totalJitter += latenessUs;
+  if (latenessUs > maxLateness)
+    maxLateness = latenessUs;
+
+  int64_t missed = lateness / period;
+  if (missed > 0) {
+    tickIndex += missed;
+    missedTicks += missed;
+  }
+}
+
+/// Restarts the deadlines grid from the next tick.
+/// It must be called after the capture loop has been suspended (e.g. paused),
+/// otherwise the suspension would be accounted as missed ticks.
+void CaptureScheduler::resync() {
+  resyncRequested = true;
+}
+
+CaptureSchedulerStats CaptureScheduler::get_stats() const {
+  return {.ticks = ticks,
+          .lateTicks = lateTicks,
+          .missedTicks = missedTicks,
+          .maxLateness = maxLateness,
+          .averageJitter = ticks > 0 ? totalJitter / (int64_t)ticks : 0};
+}
@@ -0,0 +1,48 @@
+#ifndef PDS_SCREEN_RECORDING_CAPTURE_SCHEDULER_H
+#define PDS_SCREEN_RECORDING_CAPTURE_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+struct CaptureSchedulerStats {
+    uint64_t ticks;        // Deadlines reached by the capture loop
+    uint64_t lateTicks;    // Captures which completed after their deadline
+    uint64_t missedTicks;  // Deadlines skipped because the capture fell behind by one or more whole periods
+    int64_t maxLateness;   // microseconds
+    int64_t averageJitter; // Average delay of the captures start from their deadline, in microseconds
+};
+
+/// Paces a capture loop on absolute monotonic deadlines.
+/// Deadlines are computed as anchor + n * period, so the time spent capturing and the scheduler jitter never
+/// accumulate: a late tick is compensated by a shorter wait on the next one. When the loop falls behind by whole
+/// periods, the missed deadlines are skipped instead of being captured in a burst.
+/// A zero period disables pacing (e.g. audio devices, whose reads already block until data is available).
+class CaptureScheduler {
+    std::chrono::steady_clock::duration period;
+
+    std::chrono::steady_clock::time_point anchor;
+    int64_t tickIndex;
+
+    // Set by other threads (e.g. on resume) to restart the deadlines grid from the next tick
+    std::atomic<bool> resyncRequested;
+
+    std::atomic<uint64_t> ticks;
+    std::atomic<uint64_t> lateTicks;
+    std::atomic<uint64_t> missedTicks;
+    std::atomic<int64_t> maxLateness;
+    std::atomic<int64_t> totalJitter;
+
+public:
+    explicit CaptureScheduler(std::chrono::nanoseconds period);
+
+    void wait_next_tick();
+
+    void resync();
+
+    [[nodiscard]] CaptureSchedulerStats get_stats() const;
+
+    ~CaptureScheduler() = default;
+};
+
+#endif  // PDS_SCREEN_RECORDING_CAPTURE_SCHEDULER_H
@@ -4,25 +4,26 @@
 #include "../error.h"
 
 PacketCapturer::PacketCapturer(std::shared_ptr<DeviceContext> inputDevice,
+                               std::shared_ptr<FramePool> packetPool,
                                CapturedPacketHandler onVideoPacketCapture,
                                CapturedPacketHandler onAudioPacketCapture)
     : inputDevice(std::move(inputDevice)),
+      packetPool(std::move(packetPool)),
+      lastCapturedType(AVMEDIA_TYPE_UNKNOWN),
       onVideoPacketCapture(std::move(onVideoPacketCapture)),
-      onAudioPacketCapture(std::move(onAudioPacketCapture)),
-      totalPauseDuration(0) {
-  int videoFramePeriod = std::numeric_limits<int>::max(),
-      audioFramePeriod = std::numeric_limits<int>::max();
+      onAudioPacketCapture(std::move(onAudioPacketCapture)) {
   AVStream* videoStream = this->inputDevice->getVideoStream();
-  AVStream* audioStream = this->inputDevice->getAudioStream();
 
-  if (videoStream)
-    videoFramePeriod =
-        (int)(videoStream->time_base.den / av_q2d(videoStream->r_frame_rate));
-  if (audioStream)
-    audioFramePeriod =
-        (int)(audioStream->time_base.den / audioStream->codecpar->sample_rate);
+  // Captures are paced on the video framerate. Audio-only devices are not
+  // paced, as reading from them already blocks until new samples are
+  // available.
+  std::chrono::nanoseconds capturePeriod(0);
+  if (videoStream && videoStream->r_frame_rate.num > 0)
+    capturePeriod = std::chrono::nanoseconds(
+        av_rescale(1000000000, videoStream->r_frame_rate.den,
+                   videoStream->r_frame_rate.num));
 
-  minFramePeriod = std::min(videoFramePeriod, audioFramePeriod);
+  scheduler = std::make_unique<CaptureScheduler>(capturePeriod);
 }
 
 /// Calculates the normalized PTS of a packet.
@@ -54,10 +55,11 @@ void PacketCapturer::handle_captured_audio_packet(AVPacket* inputAudioPacket) {
   // onAudioPacketCapture(audioPacket, packetPts);
 }
 
-// Captures a new packet from the input device
+// Captures a new packet from the input device.
+// The packet is recycled from the ones released by the process chains, so
+// that the capture thread doesn't allocate it.
 void PacketCapturer::capture_next() {
-  auto inputPacket =
-      std::unique_ptr<AVPacket, FFMpegObjectsDeleter>(av_packet_alloc());
+  auto inputPacket = packetPool->get_packet();
 
   int ret;
   do {
@@ -74,6 +76,7 @@ void PacketCapturer::capture_next() {
   AVMediaType packetType = inputDevice->getContext()
                                ->streams[inputPacket->stream_index]
                                ->codecpar->codec_type;
+  lastCapturedType = packetType;
 
   int64_t packetPts;
   switch (packetType) {
@@ -100,17 +103,14 @@ void PacketCapturer::capture_next() {
   }
 }
 
-// Adds the duration of a resumed pause in order to normalize the packets PTS.
-void PacketCapturer::add_pause_duration(int64_t pauseDuration) {
-  totalPauseDuration += pauseDuration;
-}
-
-int64_t PacketCapturer::get_pause_duration() const {
-  return totalPauseDuration;
-}
+/// Waits until the next packet to capture will be available.
+/// Video packets consume a tick of the capture scheduler, which waits for the
+/// next absolute deadline. Audio packets, coming from devices which also hold a
+/// video stream, are read again immediately, so that they don't delay the next
+/// video frame.
+void PacketCapturer::wait_next_capture() {
+  if (lastCapturedType == AVMEDIA_TYPE_AUDIO && inputDevice->getVideoStream())
+    return;
 
-/// Sleeps until the next packet to capture will be available.
-/// The sleep duration is obtained by the input stream framerate.
-void PacketCapturer::sleep() {
-  std::this_thread::sleep_for(std::chrono::microseconds(minFramePeriod));
+  scheduler->wait_next_tick();
 }
@@ -3,23 +3,25 @@
 
 #include <functional>
 
+#include "../capturer.h"
 #include "../device_context.h"
 #include "../ffmpeg_objects_deleter.h"
+#include "../process_chain/frame_pool.h"
 
 extern "C" {
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 }
 
-typedef std::function<void(std::unique_ptr<AVPacket, FFMpegObjectsDeleter> packet, int64_t relativePts)>
-CapturedPacketHandler;
+typedef std::function<void(PooledPacket packet, int64_t relativePts)> CapturedPacketHandler;
 
-class PacketCapturer {
+class PacketCapturer : public Capturer {
     std::shared_ptr<DeviceContext> inputDevice;
 
-    int64_t totalPauseDuration = 0;
+    // Captured packets are taken from the pool, and the process chains return them once processed
+    std::shared_ptr<FramePool> packetPool;
 
-    int minFramePeriod; // Interval in milliseconds between two packets in the stream with the highest framerate (samplerate)
+    AVMediaType lastCapturedType;
 
     CapturedPacketHandler onVideoPacketCapture;
     CapturedPacketHandler onAudioPacketCapture;
@@ -30,18 +32,15 @@ class PacketCapturer {
 
 public:
     PacketCapturer(std::shared_ptr<DeviceContext> inputDevice,
+                   std::shared_ptr<FramePool> packetPool,
                    CapturedPacketHandler onVideoPacketCapture,
                    CapturedPacketHandler onAudioPacketCapture);
 
-    void capture_next();
+    void capture_next() override;
 
-    void add_pause_duration(int64_t pauseDuration);
+    void wait_next_capture() override;
 
-    [[nodiscard]] int64_t get_pause_duration() const;
-
-    void sleep();
-
-    ~PacketCapturer() = default;
+    ~PacketCapturer() override = default;
 };
 
 #endif  // PDS_SCREEN_RECORDING_PACKET_CAPTURER_H
@@ -0,0 +1,405 @@
+#include "bgra_to_yuv_filter_ring.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <cstring>
+#include "../error.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BGRA_TO_YUV_X86
+#include <immintrin.h>
+#endif
+
+// Input size differences (in pixels) tolerated when halving: the last input columns and rows are discarded, so that
+// the output size can be made even
+const int MAX_DISCARDED_PIXELS = 3;
+
+// BT.601 limited range coefficients, with 8 fractional bits, for B, G, R and A
+const int16_t Y_COEFFICIENTS[4] = {25, 129, 66, 0};
+const int16_t U_COEFFICIENTS[4] = {112, -74, -38, 0};
+const int16_t V_COEFFICIENTS[4] = {-18, -94, 112, 0};
+
+// ---------------
+// Scalar kernels
+// ---------------
+
+// The SIMD kernels round the same way, so all the kernels give the same output
+
+static inline uint8_t average(uint8_t a, uint8_t b) {
+    return (a + b + 1) >> 1;
+}
+
+static inline uint8_t to_luma(const uint8_t *pixel) {
+    return ((Y_COEFFICIENTS[0] * pixel[0] + Y_COEFFICIENTS[1] * pixel[1] + Y_COEFFICIENTS[2] * pixel[2] + 128) >> 8)
+           + 16;
+}
+
+static inline uint8_t to_chroma(const uint8_t *pixel, const int16_t coefficients[4]) {
+    return ((coefficients[0] * pixel[0] + coefficients[1] * pixel[1] + coefficients[2] * pixel[2] + 128) >> 8) + 128;
+}
+
+/// Converts the columns [start, width) of a rows pair. Start and width must be even.
+static void convert_rows_scalar_from(const uint8_t *top, const uint8_t *bottom, uint8_t *yTop, uint8_t *yBottom,
+                                     uint8_t *u, uint8_t *v, int start, int width) {
+    for (int x = start; x < width; x += 2) {
+        const uint8_t *topPixels = top + x * 4;
+        const uint8_t *bottomPixels = bottom + x * 4;
+        yTop[x] = to_luma(topPixels);
+        yTop[x + 1] = to_luma(topPixels + 4);
+        yBottom[x] = to_luma(bottomPixels);
+        yBottom[x + 1] = to_luma(bottomPixels + 4);
+
+        // Rows are averaged first, then columns
+        uint8_t block[4];
+        for (int c = 0; c < 4; c++) {
+            block[c] = average(average(topPixels[c], bottomPixels[c]), average(topPixels[c + 4], bottomPixels[c + 4]));
+        }
+        u[x / 2] = to_chroma(block, U_COEFFICIENTS);
+        v[x / 2] = to_chroma(block, V_COEFFICIENTS);
+    }
+}
+
+static void convert_rows_scalar(const uint8_t *top, const uint8_t *bottom, uint8_t *yTop, uint8_t *yBottom,
+                                uint8_t *u, uint8_t *v, int width) {
+    convert_rows_scalar_from(top, bottom, yTop, yBottom, u, v, 0, width);
+}
+
+/// Halves the output columns [start, width) of a rows pair
+static void downscale_row_scalar_from(const uint8_t *top, const uint8_t *bottom, uint8_t *output, int start,
+                                      int width) {
+    for (int x = start; x < width; x++) {
+        for (int c = 0; c < 4; c++) {
+            output[x * 4 + c] = average(average(top[x * 8 + c], bottom[x * 8 + c]),
+                                        average(top[x * 8 + 4 + c], bottom[x * 8 + 4 + c]));
+        }
+    }
+}
+
+static void downscale_row_scalar(const uint8_t *top, const uint8_t *bottom, uint8_t *output, int width) {
+    downscale_row_scalar_from(top, bottom, output, 0, width);
+}
+
+#ifdef BGRA_TO_YUV_X86
+
+// ---------------
+// SSE4.1 kernels
+// ---------------
+
+/// Returns the weighted sums of the channels of 4 pixels, before rounding, as 32 bits integers
+__attribute__((target("sse4.1")))
+static inline __m128i weighted_sums_sse(__m128i pixels, __m128i coefficients) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefficients);
+    __m128i high = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefficients);
+    return _mm_hadd_epi32(low, high);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i round_sums_sse(__m128i sums, int offset) {
+    return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(128)), 8), _mm_set1_epi32(offset));
+}
+
+/// Converts 8 pixels to luma
+__attribute__((target("sse4.1")))
+static inline void store_luma_sse(__m128i first, __m128i second, __m128i coefficients, uint8_t *y) {
+    __m128i luma = _mm_packs_epi32(round_sums_sse(weighted_sums_sse(first, coefficients), 16),
+                                   round_sums_sse(weighted_sums_sse(second, coefficients), 16));
+    _mm_storel_epi64((__m128i *) y, _mm_packus_epi16(luma, luma));
+}
+
+/// Averages the even and the odd pixels of two vectors of 4 pixels
+__attribute__((target("sse4.1")))
+static inline __m128i average_columns_sse(__m128i first, __m128i second) {
+    __m128i even = _mm_castps_si128(
+            _mm_shuffle_ps(_mm_castsi128_ps(first), _mm_castsi128_ps(second), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(
+            _mm_shuffle_ps(_mm_castsi128_ps(first), _mm_castsi128_ps(second), _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_avg_epu8(even, odd);
+}
+
+__attribute__((target("sse4.1")))
+static void convert_rows_sse41(const uint8_t *top, const uint8_t *bottom, uint8_t *yTop, uint8_t *yBottom,
+                               uint8_t *u, uint8_t *v, int width) {
+    const __m128i yCoefficients = _mm_loadl_epi64((const __m128i *) Y_COEFFICIENTS);
+    const __m128i uCoefficients = _mm_loadl_epi64((const __m128i *) U_COEFFICIENTS);
+    const __m128i vCoefficients = _mm_loadl_epi64((const __m128i *) V_COEFFICIENTS);
+    const __m128i yWeights = _mm_unpacklo_epi64(yCoefficients, yCoefficients);
+    const __m128i uWeights = _mm_unpacklo_epi64(uCoefficients, uCoefficients);
+    const __m128i vWeights = _mm_unpacklo_epi64(vCoefficients, vCoefficients);
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i topFirst = _mm_loadu_si128((const __m128i *) (top + x * 4));
+        __m128i topSecond = _mm_loadu_si128((const __m128i *) (top + x * 4 + 16));
+        __m128i bottomFirst = _mm_loadu_si128((const __m128i *) (bottom + x * 4));
+        __m128i bottomSecond = _mm_loadu_si128((const __m128i *) (bottom + x * 4 + 16));
+
+        store_luma_sse(topFirst, topSecond, yWeights, yTop + x);
+        store_luma_sse(bottomFirst, bottomSecond, yWeights, yBottom + x);
+
+        __m128i block = average_columns_sse(_mm_avg_epu8(topFirst, bottomFirst),
+                                            _mm_avg_epu8(topSecond, bottomSecond));
+        __m128i chroma = _mm_packs_epi32(round_sums_sse(weighted_sums_sse(block, uWeights), 128),
+                                         round_sums_sse(weighted_sums_sse(block, vWeights), 128));
+        chroma = _mm_packus_epi16(chroma, chroma);
+        int uSamples = _mm_cvtsi128_si32(chroma);
+        int vSamples = _mm_cvtsi128_si32(_mm_srli_si128(chroma, 4));
+        std::memcpy(u + x / 2, &uSamples, 4);
+        std::memcpy(v + x / 2, &vSamples, 4);
+    }
+    convert_rows_scalar_from(top, bottom, yTop, yBottom, u, v, x, width);
+}
+
+__attribute__((target("sse4.1")))
+static void downscale_row_sse41(const uint8_t *top, const uint8_t *bottom, uint8_t *output, int width) {
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i first = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) (top + x * 8)),
+                                     _mm_loadu_si128((const __m128i *) (bottom + x * 8)));
+        __m128i second = _mm_avg_epu8(_mm_loadu_si128((const __m128i *) (top + x * 8 + 16)),
+                                      _mm_loadu_si128((const __m128i *) (bottom + x * 8 + 16)));
+        _mm_storeu_si128((__m128i *) (output + x * 4), average_columns_sse(first, second));
+    }
+    downscale_row_scalar_from(top, bottom, output, x, width);
+}
+
+// -------------
+// AVX2 kernels
+// -------------
+
+// AVX2 instructions work on two 128 bits lanes: results are reordered across the lanes where needed
+
+__attribute__((target("avx2")))
+static inline __m256i weighted_sums_avx2(__m256i pixels, __m256i coefficients) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i low = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coefficients);
+    __m256i high = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coefficients);
+    return _mm256_hadd_epi32(low, high);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i round_sums_avx2(__m256i sums, int offset) {
+    return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(128)), 8),
+                            _mm256_set1_epi32(offset));
+}
+
+/// Converts 16 pixels to luma
+__attribute__((target("avx2")))
+static inline void store_luma_avx2(__m256i first, __m256i second, __m256i coefficients, uint8_t *y) {
+    __m256i luma = _mm256_packs_epi32(round_sums_avx2(weighted_sums_avx2(first, coefficients), 16),
+                                      round_sums_avx2(weighted_sums_avx2(second, coefficients), 16));
+    luma = _mm256_permute4x64_epi64(luma, _MM_SHUFFLE(3, 1, 2, 0));
+    luma = _mm256_permute4x64_epi64(_mm256_packus_epi16(luma, luma), _MM_SHUFFLE(0, 0, 2, 0));
+    _mm_storeu_si128((__m128i *) y, _mm256_castsi256_si128(luma));
+}
+
+/// Averages the even and the odd pixels of two vectors of 8 pixels. The result pixels are ordered by lane:
+/// 0, 1, 4, 5, 2, 3, 6, 7.
+__attribute__((target("avx2")))
+static inline __m256i average_columns_avx2(__m256i first, __m256i second) {
+    __m256i even = _mm256_castps_si256(
+            _mm256_shuffle_ps(_mm256_castsi256_ps(first), _mm256_castsi256_ps(second), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m256i odd = _mm256_castps_si256(
+            _mm256_shuffle_ps(_mm256_castsi256_ps(first), _mm256_castsi256_ps(second), _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm256_avg_epu8(even, odd);
+}
+
+__attribute__((target("avx2")))
+static void convert_rows_avx2(const uint8_t *top, const uint8_t *bottom, uint8_t *yTop, uint8_t *yBottom,
+                              uint8_t *u, uint8_t *v, int width) {
+    const __m256i yWeights = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *) Y_COEFFICIENTS));
+    const __m256i uWeights = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *) U_COEFFICIENTS));
+    const __m256i vWeights = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *) V_COEFFICIENTS));
+    // Restores the chroma samples order, which is 0, 1, 4, 5, 2, 3, 6, 7 after the columns average and the sums
+    const __m256i chromaOrder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i topFirst = _mm256_loadu_si256((const __m256i *) (top + x * 4));
+        __m256i topSecond = _mm256_loadu_si256((const __m256i *) (top + x * 4 + 32));
+        __m256i bottomFirst = _mm256_loadu_si256((const __m256i *) (bottom + x * 4));
+        __m256i bottomSecond = _mm256_loadu_si256((const __m256i *) (bottom + x * 4 + 32));
+
+        store_luma_avx2(topFirst, topSecond, yWeights, yTop + x);
+        store_luma_avx2(bottomFirst, bottomSecond, yWeights, yBottom + x);
+
+        __m256i block = average_columns_avx2(_mm256_avg_epu8(topFirst, bottomFirst),
+                                             _mm256_avg_epu8(topSecond, bottomSecond));
+        __m256i uSamples = _mm256_permutevar8x32_epi32(
+                round_sums_avx2(weighted_sums_avx2(block, uWeights), 128), chromaOrder);
+        __m256i vSamples = _mm256_permutevar8x32_epi32(
+                round_sums_avx2(weighted_sums_avx2(block, vWeights), 128), chromaOrder);
+
+        // Each lane holds 4 U samples followed by 4 V samples
+        __m256i chroma = _mm256_packs_epi32(uSamples, vSamples);
+        chroma = _mm256_packus_epi16(chroma, chroma);
+        __m128i samples = _mm_unpacklo_epi32(_mm256_castsi256_si128(chroma), _mm256_extracti128_si256(chroma, 1));
+        _mm_storel_epi64((__m128i *) (u + x / 2), samples);
+        _mm_storel_epi64((__m128i *) (v + x / 2), _mm_srli_si128(samples, 8));
+    }
+    convert_rows_sse41(top + x * 4, bottom + x * 4, yTop + x, yBottom + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void downscale_row_avx2(const uint8_t *top, const uint8_t *bottom, uint8_t *output, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i first = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *) (top + x * 8)),
+                                        _mm256_loadu_si256((const __m256i *) (bottom + x * 8)));
+        __m256i second = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *) (top + x * 8 + 32)),
+                                         _mm256_loadu_si256((const __m256i *) (bottom + x * 8 + 32)));
+        __m256i pixels = _mm256_permute4x64_epi64(average_columns_avx2(first, second), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *) (output + x * 4), pixels);
+    }
+    downscale_row_sse41(top + x * 8, bottom + x * 8, output + x * 4, width - x);
+}
+
+#endif
+
+/// Returns true if the hand-written kernels can be used for the passed conversion: BGRA or BGR0 input, YUV420P
+/// output, even output size, and the same crop area size or a halved one. Halving averages 2x2 blocks, so it is
+/// used only if the configured scaling algorithm is not sharper than bilinear.
+bool BGRAToYUVFilterRing::is_supported(const SWScaleConfig &config) {
+    if (config.inputPixelFormat != AV_PIX_FMT_BGRA && config.inputPixelFormat != AV_PIX_FMT_BGR0)
+        return false;
+    if (config.outputPixelFormat != AV_PIX_FMT_YUV420P)
+        return false;
+    if (config.outputWidth <= 0 || config.outputHeight <= 0 || config.outputWidth % 2 || config.outputHeight % 2)
+        return false;
+
+    if (config.cropX < 0 || config.cropY < 0 || config.cropX + config.cropWidth > config.inputWidth ||
+        config.cropY + config.cropHeight > config.inputHeight)
+        return false;
+
+    bool isSameSize = config.cropWidth == config.outputWidth && config.cropHeight == config.outputHeight;
+    int discardedColumns = config.cropWidth - config.outputWidth * 2;
+    int discardedRows = config.cropHeight - config.outputHeight * 2;
+    bool isHalved = discardedColumns >= 0 && discardedColumns <= MAX_DISCARDED_PIXELS &&
+                    discardedRows >= 0 && discardedRows <= MAX_DISCARDED_PIXELS &&
+                    config.scalingAlgorithm <= SCALING_BILINEAR;
+    return isSameSize || isHalved;
+}
+
+/// Returns the kernels supported by the CPU, from the slowest to the fastest
+std::vector<BGRAToYUVKernels> BGRAToYUVFilterRing::get_supported_kernels() {
+    std::vector<BGRAToYUVKernels> supportedKernels = {{"scalar", convert_rows_scalar, downscale_row_scalar}};
+#ifdef BGRA_TO_YUV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        supportedKernels.push_back({"sse4.1", convert_rows_sse41, downscale_row_sse41});
+    if (__builtin_cpu_supports("avx2"))
+        supportedKernels.push_back({"avx2", convert_rows_avx2, downscale_row_avx2});
+#endif
+    return supportedKernels;
+}
+
+/// Initializes the converter, with the kernels of the passed name or, if empty, the fastest kernels supported by the
+/// CPU
+BGRAToYUVFilterRing::BGRAToYUVFilterRing(SWScaleConfig swScaleConfig, std::shared_ptr<FramePool> framePool,
+                                         const std::string &kernelName)
+        : config(swScaleConfig), framePool(std::move(framePool)) {
+    if (!is_supported(config)) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("unsupported conversion from {}x{} to {}x{}",
+                                                       config.cropWidth, config.cropHeight,
+                                                       config.outputWidth, config.outputHeight)));
+    }
+    factor = config.cropWidth == config.outputWidth ? 1 : 2;
+    if (factor == 2) {
+        downscaledRows.resize(2 * config.outputWidth * 4);
+    }
+
+    auto supportedKernels = get_supported_kernels();
+    if (kernelName.empty()) {
+        kernels = supportedKernels.back();
+        return;
+    }
+    auto it = std::find_if(supportedKernels.begin(), supportedKernels.end(),
+                           [&kernelName](const BGRAToYUVKernels &supported) { return supported.name == kernelName; });
+    if (it == supportedKernels.end()) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("unsupported conversion kernels {}", kernelName)));
+    }
+    kernels = *it;
+}
+
+/// Converts the output rows [top, bottom) of the input frame crop area into the output frame. Top and bottom must be
+/// even.
+void BGRAToYUVFilterRing::convert_rows(AVFrame *inputFrame, AVFrame *outputFrame, int top, int bottom) {
+    uint8_t *downscaledTop = downscaledRows.data();
+    uint8_t *downscaledBottom = downscaledRows.data() + config.outputWidth * 4;
+
+    for (int row = top; row < bottom; row += 2) {
+        const uint8_t *inputTop = inputFrame->data[0] + (config.cropY + row * factor) * inputFrame->linesize[0] +
+                                  config.cropX * 4;
+        const uint8_t *inputBottom = inputTop + factor * inputFrame->linesize[0];
+        if (factor == 2) {
+            kernels.downscaleRow(inputTop, inputTop + inputFrame->linesize[0], downscaledTop, config.outputWidth);
+            kernels.downscaleRow(inputBottom, inputBottom + inputFrame->linesize[0], downscaledBottom,
+                                 config.outputWidth);
+            inputTop = downscaledTop;
+            inputBottom = downscaledBottom;
+        }
+
+        kernels.convertRows(inputTop, inputBottom,
+                            outputFrame->data[0] + row * outputFrame->linesize[0],
+                            outputFrame->data[0] + (row + 1) * outputFrame->linesize[0],
+                            outputFrame->data[1] + row / 2 * outputFrame->linesize[1],
+                            outputFrame->data[2] + row / 2 * outputFrame->linesize[2],
+                            config.outputWidth);
+    }
+}
+
+/// Converts only the output rows pairs including damaged input rows, updating the last converted frame
+void BGRAToYUVFilterRing::convert_damaged_rows(AVFrame *inputFrame,
+                                               const std::vector<std::tuple<int, int, int, int>> &regions) {
+    // The last converted frame could still be referenced by the next rings: in that case it is copied
+    if (!av_frame_is_writable(lastConvertedFrame.get())) {
+        auto frame = framePool->get_video_frame(config.outputPixelFormat, config.outputWidth, config.outputHeight);
+        int ret = av_frame_copy(frame.get(), lastConvertedFrame.get());
+        if (ret < 0) {
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {},
+                                               fmt::format("error copying the converted frame ({})",
+                                                           Error::unpackAVError(ret))));
+        }
+        lastConvertedFrame = std::move(frame);
+    }
+
+    // Damaged rows are converted by rows pairs: overlapping regions can convert some rows twice, with no effects
+    int rowsPairHeight = 2 * factor;
+    for (const auto &[x, y, width, height]: regions) {
+        int top = std::max(y - config.cropY, 0) / rowsPairHeight * 2;
+        int bottom = std::min((y + height - config.cropY + rowsPairHeight - 1) / rowsPairHeight * 2,
+                              config.outputHeight);
+        bool isCropped = x + width <= config.cropX || x >= config.cropX + config.cropWidth;
+        if (width > 0 && top < bottom && !isCropped)
+            convert_rows(inputFrame, lastConvertedFrame.get(), top, bottom);
+    }
+}
+
+/// Processes an input frame and passes it to the next ring
+void BGRAToYUVFilterRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    const FrameDamage &damage = processContext->sourceFrameDamage;
+
+    if (lastConvertedFrame && damage.isRepeated) {
+        // Nothing changed: the last converted frame is passed again
+    } else if (lastConvertedFrame && !damage.regions.empty()) {
+        convert_damaged_rows(inputFrame, damage.regions);
+    } else {
+        lastConvertedFrame = framePool->get_video_frame(config.outputPixelFormat, config.outputWidth,
+                                                        config.outputHeight);
+        convert_rows(inputFrame, lastConvertedFrame.get(), 0, config.outputHeight);
+    }
+    auto convertedFrame = framePool->clone_frame(lastConvertedFrame.get());
+
+    // Pass the converted frame to the next ring
+    if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(getNext())) {
+        std::get<std::shared_ptr<FilterChainRing>>(getNext())->execute(processContext,
+                                                                       convertedFrame.get());
+    } else {
+        std::get<std::shared_ptr<EncoderChainRing>>(getNext())->execute(processContext,
+                                                                        convertedFrame.get());
+    }
+}
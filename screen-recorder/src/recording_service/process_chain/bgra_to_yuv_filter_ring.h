@@ -0,0 +1,71 @@
+#ifndef PDS_SCREEN_RECORDING_BGRA_TO_YUV_FILTER_RING_H
+#define PDS_SCREEN_RECORDING_BGRA_TO_YUV_FILTER_RING_H
+
+#include <string>
+#include <vector>
+#include "filter_ring.h"
+#include "frame_pool.h"
+#include "swscale_filter_ring.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+/// Converts a pair of BGRA rows into two luma rows and one row of each chroma plane
+using BGRAConvertRowsKernel = void (*)(const uint8_t *top, const uint8_t *bottom, uint8_t *yTop, uint8_t *yBottom,
+                                       uint8_t *u, uint8_t *v, int width);
+/// Halves a pair of BGRA rows into a single BGRA row, averaging each 2x2 pixels block
+using BGRADownscaleRowKernel = void (*)(const uint8_t *top, const uint8_t *bottom, uint8_t *output, int width);
+
+/// Kernels for an instruction set. All of them give the same output.
+struct BGRAToYUVKernels {
+    std::string name;
+    BGRAConvertRowsKernel convertRows;
+    BGRADownscaleRowKernel downscaleRow;
+};
+
+/// Converts BGRA (or BGR0) frames to YUV420P with hand-written kernels, in place of the general-purpose swscale
+/// converter. Only same size and halved size outputs of the crop area are supported: see is_supported.
+/// As in the swscale ring, the crop area is selected by offsetting the input rows pointers.
+/// Each pair of output rows is converted in a single pass: luma is computed for both rows, while the chroma is computed
+/// from the 2x2 averaged pixels, using the BT.601 limited range coefficients as swscale. When halving, each input rows
+/// quadruple is first averaged into a rows pair held in a scratch buffer.
+/// The kernels are selected at run time among AVX2, SSE4.1 and plain C, depending on the CPU. They can be forced by
+/// name, e.g. to compare them.
+/// As in the swscale ring, repeated frames reuse the last converted frame and partially changed frames only convert
+/// the damaged rows.
+class BGRAToYUVFilterRing : public FilterChainRing {
+    SWScaleConfig config;
+
+    std::shared_ptr<FramePool> framePool;
+
+    // Input pixels for each output pixel, on both axes: 1 or 2
+    int factor;
+
+    BGRAToYUVKernels kernels;
+
+    // Halved input rows pair, converted in place of the input rows when halving
+    std::vector<uint8_t> downscaledRows;
+
+    PooledFrame lastConvertedFrame;
+
+    void convert_rows(AVFrame *inputFrame, AVFrame *outputFrame, int top, int bottom);
+
+    void convert_damaged_rows(AVFrame *inputFrame, const std::vector<std::tuple<int, int, int, int>> &regions);
+
+public:
+    BGRAToYUVFilterRing(SWScaleConfig config, std::shared_ptr<FramePool> framePool,
+                        const std::string &kernelName = "");
+
+    ~BGRAToYUVFilterRing() override = default;
+
+    static bool is_supported(const SWScaleConfig &config);
+
+    static std::vector<BGRAToYUVKernels> get_supported_kernels();
+
+    [[nodiscard]] const std::string &getKernelName() const { return kernels.name; };
+
+    void execute(ProcessContext *processContext, AVFrame *inputFrame) override;
+};
+
+#endif //PDS_SCREEN_RECORDING_BGRA_TO_YUV_FILTER_RING_H
@@ -0,0 +1,208 @@
+#include "chunked_encoder_ring.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include "../error.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+/// Initializes the encoder setting the output stream parameters, and a stage for each executor worker, as long as
+/// their frames fit the memory budget
+ChunkedEncoderRing::ChunkedEncoderRing(AVRational inputTimeBase, AVStream *outputStream, const EncoderConfig &config,
+                                       std::shared_ptr<FramePool> framePool, std::shared_ptr<TaskExecutor> executor,
+                                       int chunkFrames)
+        : EncoderChainRing(inputTimeBase, outputStream, config, framePool, false),
+          inputTimeBase(inputTimeBase),
+          chunkConfig(config),
+          framePool(std::move(framePool)),
+          chunkFrames(chunkFrames),
+          currentChunkFrames(0),
+          nextChunkIndex(0),
+          nextMuxedChunkIndex(0),
+          lastMuxedDTS(-1),
+          chunksEncodedFrames(0),
+          chunksTotalLatency(0),
+          chunksMaxLatency(0) {
+    if (chunkFrames <= 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {}, fmt::format("invalid chunk length {}", chunkFrames)));
+    }
+
+    // Chunks run in parallel instead of their encoders threads
+    chunkConfig.threading = ENCODER_THREADING_NONE;
+    chunkConfig.threadCount = 1;
+    chunkConfig.isStreamParametersShared = true;
+
+    // Each stage holds the frames of a chunk, and the task flushing its encoder
+    int64_t chunkSize = (int64_t) (chunkFrames + 1) *
+                        std::max(av_image_get_buffer_size(config.pixelFormat, config.width, config.height, 1), 0);
+    if (chunkSize > CHUNKED_ENCODING_MEMORY_BUDGET) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                "a chunk of {} {}x{} frames takes {} MiB, over the {} MiB budget", chunkFrames, config.width,
+                config.height, chunkSize >> 20, CHUNKED_ENCODING_MEMORY_BUDGET >> 20)));
+    }
+    int stageCount = (int) std::clamp<int64_t>(CHUNKED_ENCODING_MEMORY_BUDGET / std::max<int64_t>(chunkSize, 1), 1,
+                                               std::max(executor->get_worker_count(), 1));
+    stages.reserve(stageCount);
+    for (int i = 0; i < stageCount; i++) {
+        stages.push_back(std::make_shared<PipelineStage>(executor, chunkFrames + 1));
+    }
+
+    // The output header is written before the first frame: the first chunk encoder sets the stream parameters
+    EncoderConfig firstChunkConfig = chunkConfig;
+    firstChunkConfig.isStreamParametersShared = false;
+    start_chunk(firstChunkConfig);
+}
+
+/// Creates the chunk receiving the next input frames, with its own encoder
+void ChunkedEncoderRing::start_chunk(const EncoderConfig &config) {
+    currentChunk = std::make_shared<Chunk>();
+    currentChunk->index = nextChunkIndex++;
+    currentChunk->encoder = std::make_unique<EncoderChainRing>(inputTimeBase, getOutputStream(), config, framePool);
+
+    std::lock_guard<std::mutex> lock(chunksMutex);
+    pendingChunks[currentChunk->index] = currentChunk;
+}
+
+/// Sends the input frame to the encoder of the current chunk, on its stage.
+/// Flushing is done by setting null parameters.
+void ChunkedEncoderRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    if (!processContext || !inputFrame) {
+        flush();
+        return;
+    }
+
+    rethrow_chunks_error();
+
+    if (!currentChunk) {
+        start_chunk(chunkConfig);
+    }
+
+    std::shared_ptr<AVFrame> frame = framePool->clone_frame(inputFrame);
+    std::shared_ptr<ProcessContext> context = processContext->clone_properties();
+    auto &stage = stages[currentChunk->index % stages.size()];
+    stage->submit([this, chunk = currentChunk, context, frame]() {
+        run_chunk_task([this, &chunk, &context, &frame]() {
+            chunk->encoder->encode(context.get(), frame.get(), [this, &chunk](AVPacket *packet) {
+                store_packet(*chunk, packet);
+            });
+        });
+    });
+
+    if (++currentChunkFrames == chunkFrames) {
+        finish_chunk();
+    }
+}
+
+/// Holds an encoded packet of a chunk, until the chunk is muxed
+void ChunkedEncoderRing::store_packet(Chunk &chunk, AVPacket *packet) {
+    auto encodedPacket = framePool->get_packet();
+    av_packet_move_ref(encodedPacket.get(), packet);
+    chunk.packets.push_back(std::move(encodedPacket));
+}
+
+/// Flushes the encoder of the current chunk, on its stage, then muxes the chunk if the previous ones have been muxed.
+/// The following frames start a new chunk.
+void ChunkedEncoderRing::finish_chunk() {
+    auto &stage = stages[currentChunk->index % stages.size()];
+    stage->submit([this, chunk = currentChunk]() {
+        run_chunk_task([this, &chunk]() {
+            chunk->encoder->encode(nullptr, nullptr, [this, &chunk](AVPacket *packet) {
+                store_packet(*chunk, packet);
+            });
+            EncoderStats stats = chunk->encoder->get_stats();
+            chunk->encoder.reset();
+            {
+                std::lock_guard<std::mutex> lock(chunksMutex);
+                chunksEncodedFrames += stats.encodedFrames;
+                chunksTotalLatency += stats.averageLatency * (int64_t) stats.encodedFrames;
+                chunksMaxLatency = std::max(chunksMaxLatency, stats.maxLatency);
+            }
+            mux_encoded_chunks(chunk);
+        });
+    });
+
+    currentChunk.reset();
+    currentChunkFrames = 0;
+}
+
+/// Marks the passed chunk as encoded, and passes to the muxer the packets of the encoded chunks which follow the last
+/// muxed one.
+/// The muxer is fed with the chunks mutex held, so the chunks completed meanwhile on the other stages wait their turn.
+void ChunkedEncoderRing::mux_encoded_chunks(const std::shared_ptr<Chunk> &encodedChunk) {
+    std::lock_guard<std::mutex> lock(chunksMutex);
+    encodedChunk->isEncoded = true;
+
+    decltype(pendingChunks)::iterator it;
+    while ((it = pendingChunks.find(nextMuxedChunkIndex)) != pendingChunks.end() && it->second->isEncoded) {
+        for (auto &packet: it->second->packets) {
+            // The chunks encoders have the same reordering delay, so the DTS usually continue across the chunks
+            // boundaries. Otherwise (e.g. non-uniform PTS), the DTS are moved right after the previous chunk ones,
+            // which is only possible while they don't exceed the PTS: packets are never dropped, as they could be the
+            // key frame of the chunk.
+            if (packet->dts <= lastMuxedDTS) {
+                if (packet->pts != AV_NOPTS_VALUE && lastMuxedDTS + 1 > packet->pts) {
+                    throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                            "chunk {} packet DTS {} can't follow the previous chunk DTS {} (PTS {})",
+                            it->first, packet->dts, lastMuxedDTS, packet->pts)));
+                }
+                packet->dts = lastMuxedDTS + 1;
+            }
+            lastMuxedDTS = packet->dts;
+            getNext()->execute(nullptr, packet.get());
+        }
+
+        pendingChunks.erase(it);
+        nextMuxedChunkIndex++;
+    }
+}
+
+/// Runs a task of a chunk stage, unless a previous task failed. Its error is recorded, so that the chain stops
+/// feeding new chunks.
+void ChunkedEncoderRing::run_chunk_task(const std::function<void()> &task) {
+    {
+        std::lock_guard<std::mutex> lock(chunksMutex);
+        if (chunksError)
+            return;
+    }
+
+    try {
+        task();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(chunksMutex);
+        if (!chunksError)
+            chunksError = std::current_exception();
+        throw;
+    }
+}
+
+/// Rethrows the error of a failed chunk task, if any
+void ChunkedEncoderRing::rethrow_chunks_error() {
+    std::lock_guard<std::mutex> lock(chunksMutex);
+    if (chunksError)
+        std::rethrow_exception(chunksError);
+}
+
+/// Encodes the last, partial, chunk and waits until all the chunks have been muxed
+void ChunkedEncoderRing::flush() {
+    rethrow_chunks_error();
+
+    if (currentChunk) {
+        finish_chunk();
+    }
+    for (auto &stage: stages) {
+        stage->drain();
+    }
+    rethrow_chunks_error();
+}
+
+/// Returns the threading and the latency of the chunks encoders, once their chunk has been encoded
+EncoderStats ChunkedEncoderRing::get_stats() {
+    std::lock_guard<std::mutex> lock(chunksMutex);
+    return {.threading = ENCODER_THREADING_NONE,
+            .threadCount = 1,
+            .encodedFrames = chunksEncodedFrames,
+            .averageLatency = chunksEncodedFrames > 0 ? chunksTotalLatency / (int64_t) chunksEncodedFrames : 0,
+            .maxLatency = chunksMaxLatency};
+}
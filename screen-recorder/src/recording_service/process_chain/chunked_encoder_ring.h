@@ -0,0 +1,95 @@
+#ifndef PDS_SCREEN_RECORDING_CHUNKED_ENCODER_RING_H
+#define PDS_SCREEN_RECORDING_CHUNKED_ENCODER_RING_H
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "encoder_ring.h"
+#include "pipeline_stage.h"
+
+// Upper bound of the memory taken by the frames held in the chunks stages, in bytes
+const int64_t CHUNKED_ENCODING_MEMORY_BUDGET = 4LL * 1024 * 1024 * 1024;
+
+/// Encodes the video in chunks of consecutive frames, each one by an independent single-threaded encoder, so that
+/// up to a chunk per executor worker is encoded in parallel. It is meant for offline encoding with slow encoder
+/// presets, which a single encoder can't run fast enough.
+/// Chunks are assigned in turn to a set of pipeline stages, which hold the frames of a whole chunk: the chain runs
+/// ahead of the encoders until every stage has a chunk to encode. The stages are bounded by the memory budget, so
+/// long chunks of large frames are encoded by fewer encoders in parallel.
+/// Every chunk starts with a key frame, as its encoder starts from scratch: chunks as long as the codec key frames
+/// interval (or a multiple of it) keep the same GOP structure. The encoded packets of each chunk are held until the
+/// previous chunks have been passed to the muxer, so that they are muxed in order.
+/// If a chunk fails, the following chunks would never be muxed: the error is rethrown by the next input frame, and the
+/// tasks still queued on the other stages are skipped.
+/// The encoder of the base ring is only configured, never opened. The output stream parameters are set by the
+/// encoder of the first chunk, opened upfront, and they are the same for all the chunks encoders since they have the
+/// same configuration.
+class ChunkedEncoderRing : public EncoderChainRing {
+    struct Chunk {
+        uint64_t index;
+        std::unique_ptr<EncoderChainRing> encoder;
+        // Encoded packets, in order
+        std::vector<PooledPacket> packets;
+        bool isEncoded = false;
+    };
+
+    AVRational inputTimeBase;
+
+    EncoderConfig chunkConfig;
+
+    std::shared_ptr<FramePool> framePool;
+
+    int chunkFrames;
+
+    // Chunk receiving the input frames, and how many frames it received
+    std::shared_ptr<Chunk> currentChunk;
+    int currentChunkFrames;
+    uint64_t nextChunkIndex;
+
+    // Chunks which have not been muxed yet, by index
+    std::mutex chunksMutex;
+    std::map<uint64_t, std::shared_ptr<Chunk>> pendingChunks;
+    uint64_t nextMuxedChunkIndex;
+    int64_t lastMuxedDTS;
+    // First error of the stages tasks: once set, no more chunks are encoded
+    std::exception_ptr chunksError;
+
+    // Stats of the chunks encoders, once completed
+    uint64_t chunksEncodedFrames;
+    int64_t chunksTotalLatency;
+    int64_t chunksMaxLatency;
+
+    // Stages encoding the chunks in parallel, in turn. They are destroyed first, as their tasks use the other members.
+    std::vector<std::shared_ptr<PipelineStage>> stages;
+
+    void start_chunk(const EncoderConfig &config);
+
+    void store_packet(Chunk &chunk, AVPacket *packet);
+
+    void finish_chunk();
+
+    void mux_encoded_chunks(const std::shared_ptr<Chunk> &encodedChunk);
+
+    void run_chunk_task(const std::function<void()> &task);
+
+    void rethrow_chunks_error();
+
+public:
+    ChunkedEncoderRing(AVRational inputTimeBase,
+                       AVStream *outputStream,
+                       const EncoderConfig &config,
+                       std::shared_ptr<FramePool> framePool,
+                       std::shared_ptr<TaskExecutor> executor,
+                       int chunkFrames);
+
+    void execute(ProcessContext *processContext, AVFrame *inputFrame) override;
+
+    void flush() override;
+
+    EncoderStats get_stats() override;
+
+    ~ChunkedEncoderRing() override = default;
+};
+
+#endif //PDS_SCREEN_RECORDING_CHUNKED_ENCODER_RING_H
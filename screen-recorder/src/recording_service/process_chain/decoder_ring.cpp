@@ -2,8 +2,17 @@
 #include <fmt/core.h>
 #include "../error.h"
 
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
 /// Initializes the decoder for the current stream.
-DecoderChainRing::DecoderChainRing(AVStream* inputStream) {
+DecoderChainRing::DecoderChainRing(AVStream* inputStream,
+                                   std::shared_ptr<FramePool> framePool)
+    : framePool(std::move(framePool)),
+      isRawVideoPassthrough(false),
+      rawVideoFrameSize(0) {
   auto streamCodec = avcodec_find_decoder(inputStream->codecpar->codec_id);
   if (!streamCodec) {
     throw std::runtime_error(Error::build_error_message(
@@ -33,16 +42,82 @@ DecoderChainRing::DecoderChainRing(AVStream* inputStream) {
         __FUNCTION__, {},
         fmt::format("error opening decoder ({})", Error::unpackAVError(ret))));
   }
+
+  // Raw video packets holding a tightly packed image can be used as frames as
+  // they are. Paletted formats still need the decoder.
+  auto pixelFormatDescriptor = av_pix_fmt_desc_get(decoderContext->pix_fmt);
+  if (decoderContext->codec_id == AV_CODEC_ID_RAWVIDEO &&
+      pixelFormatDescriptor &&
+      !(pixelFormatDescriptor->flags & AV_PIX_FMT_FLAG_PAL)) {
+    isRawVideoPassthrough = true;
+    rawVideoFrameSize =
+        av_image_get_buffer_size(decoderContext->pix_fmt, decoderContext->width,
+                                 decoderContext->height, 1);
+  }
+}
+
+/// Passes a frame to the next ring.
+void DecoderChainRing::pass_to_next(ProcessContext* processContext,
+                                    AVFrame* frame) {
+  if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(next)) {
+    std::get<std::shared_ptr<FilterChainRing>>(next)->execute(processContext,
+                                                              frame);
+  } else {
+    std::get<std::shared_ptr<EncoderChainRing>>(next)->execute(processContext,
+                                                               frame);
+  }
+}
+
+/// Wraps a raw video packet buffer as a frame and passes it to the next ring.
+/// Returns false if the packet doesn't hold a tightly packed image, which must
+/// be decoded instead.
+bool DecoderChainRing::wrap_raw_packet(ProcessContext* processContext) {
+  AVPacket* packet = processContext->sourcePacket.get();
+  if (packet->size != rawVideoFrameSize)
+    return false;
+
+  // The frame will share the packet buffer
+  int ret = av_packet_make_refcounted(packet);
+  if (ret < 0) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {},
+        fmt::format("error referencing the packet buffer ({})",
+                    Error::unpackAVError(ret))));
+  }
+
+  auto rawFrame = framePool->get_frame();
+
+  rawFrame->buf[0] = av_buffer_ref(packet->buf);
+  if (!rawFrame->buf[0]) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {}, "error referencing the packet buffer"));
+  }
+
+  ret = av_image_fill_arrays(rawFrame->data, rawFrame->linesize, packet->data,
+                             decoderContext->pix_fmt, decoderContext->width,
+                             decoderContext->height, 1);
+  if (ret < 0) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {},
+        fmt::format("error wrapping the packet as a frame ({})",
+                    Error::unpackAVError(ret))));
+  }
+
+  rawFrame->format = decoderContext->pix_fmt;
+  rawFrame->width = decoderContext->width;
+  rawFrame->height = decoderContext->height;
+  rawFrame->pts = packet->pts;
+
+  pass_to_next(processContext, rawFrame.get());
+  return true;
 }
 
 /// Processes an input packet and passes the decoded frame to the next ring.
 void DecoderChainRing::execute(ProcessContext* processContext) {
-  auto decodedFrame =
-      std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(av_frame_alloc());
-  if (decodedFrame == nullptr) {
-    throw std::runtime_error(
-        Error::build_error_message(__FUNCTION__, {}, "error allocating frame"));
-  }
+  if (isRawVideoPassthrough && wrap_raw_packet(processContext))
+    return;
+
+  auto decodedFrame = framePool->get_frame();
 
   int response = avcodec_send_packet(decoderContext.get(),
                                      processContext->sourcePacket.get());
@@ -66,13 +141,7 @@ void DecoderChainRing::execute(ProcessContext* processContext) {
 
     // Pass the decoded frame to the next ring
     if (response >= 0) {
-      if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(next)) {
-        std::get<std::shared_ptr<FilterChainRing>>(next)->execute(
-            processContext, decodedFrame.get());
-      } else {
-        std::get<std::shared_ptr<EncoderChainRing>>(next)->execute(
-            processContext, decodedFrame.get());
-      }
+      pass_to_next(processContext, decodedFrame.get());
     }
   }
 }
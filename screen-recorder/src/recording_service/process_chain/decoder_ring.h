@@ -4,6 +4,7 @@
 #include "encoder_ring.h"
 #include "filter_ring.h"
 #include "process_context.h"
+#include "frame_pool.h"
 #include "../ffmpeg_objects_deleter.h"
 #include <variant>
 
@@ -12,13 +13,25 @@ extern "C" {
 #include "libavcodec/avcodec.h"
 }
 
+/// Decodes the input packets into frames.
+/// Raw video packets (e.g. produced by screen grabbers) are not decoded: their refcounted buffer is wrapped as a frame,
+/// without copying it.
 class DecoderChainRing {
     std::unique_ptr<AVCodecContext, FFMpegObjectsDeleter> decoderContext;
 
+    std::shared_ptr<FramePool> framePool;
+
+    bool isRawVideoPassthrough;
+    int rawVideoFrameSize;
+
     std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> next;
 
+    void pass_to_next(ProcessContext *processContext, AVFrame *frame);
+
+    bool wrap_raw_packet(ProcessContext *processContext);
+
 public:
-    explicit DecoderChainRing(AVStream *inputStream);
+    DecoderChainRing(AVStream *inputStream, std::shared_ptr<FramePool> framePool);
 
     void execute(ProcessContext *processContext);
 
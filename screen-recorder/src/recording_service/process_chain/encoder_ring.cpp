@@ -1,21 +1,42 @@
 #include <fmt/core.h>
+#include <algorithm>
+#include <cstring>
 #include "encoder_ring.h"
 #include "../error.h"
 #include "process_context.h"
 
 extern "C" {
 #include <libavdevice/avdevice.h>
+#include <libavutil/opt.h>
 }
 
 /// Initializes the encoder
-EncoderChainRing::EncoderChainRing(AVStream *inputStream, AVStream *outputStream, const EncoderConfig &config)
-        : inputStream(inputStream), outputStream(outputStream), lastEncodedDTS(-1) {
+EncoderChainRing::EncoderChainRing(AVRational inputTimeBase, AVStream *outputStream, const EncoderConfig &config,
+                                   std::shared_ptr<FramePool> framePool)
+        : EncoderChainRing(inputTimeBase, outputStream, config, std::move(framePool), true) {}
+
+EncoderChainRing::EncoderChainRing(AVRational inputTimeBase, AVStream *outputStream, const EncoderConfig &config,
+                                   std::shared_ptr<FramePool> framePool, bool isOpened)
+        : inputTimeBase(inputTimeBase),
+          outputStream(outputStream),
+          framePool(std::move(framePool)),
+          lastEncodedDTS(-1),
+          requestedBitRate(config.bitRate),
+          rateControl(config.rateControl),
+          threading(ENCODER_THREADING_NONE),
+          threadCount(1),
+          encodedFrames(0),
+          totalLatency(0),
+          maxLatency(0) {
     // Find encoder for output stream
-    auto outputStreamCodec = avcodec_find_encoder(config.codecID);
+    auto outputStreamCodec = config.encoderName.empty() ? avcodec_find_encoder(config.codecID)
+                                                        : avcodec_find_encoder_by_name(config.encoderName.c_str());
     if (!outputStreamCodec) {
         throw std::runtime_error(
                 Error::build_error_message(__FUNCTION__, {},
-                                           fmt::format("error finding encoder '{}'", config.codecID)));
+                                           fmt::format("error finding encoder '{}'",
+                                                       config.encoderName.empty() ? std::to_string(config.codecID)
+                                                                                  : config.encoderName)));
     }
 
     // Allocate context for the encoder
@@ -25,10 +46,12 @@ EncoderChainRing::EncoderChainRing(AVStream *inputStream, AVStream *outputStream
                 Error::build_error_message(__FUNCTION__, {}, "error allocating context for the encoder"));
     }
 
-    // Set encoder options
+    // Set encoder options: private options first, then generic ones (e.g. 'slices')
     int ret;
     for (const auto &option: config.encoderOptions) {
         ret = av_opt_set(encoderContext->priv_data, option.first.c_str(), option.second.c_str(), 0);
+        if (ret == AVERROR_OPTION_NOT_FOUND)
+            ret = av_opt_set(encoderContext.get(), option.first.c_str(), option.second.c_str(), 0);
         if (ret < 0) {
             throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
                     "error setting '{}' encoder option to value '{}' ({})",
@@ -41,9 +64,9 @@ EncoderChainRing::EncoderChainRing(AVStream *inputStream, AVStream *outputStream
             encoderContext->height = config.height;
             encoderContext->width = config.width;
             encoderContext->pix_fmt = config.pixelFormat;
-            encoderContext->bit_rate = config.bitRate;
+            apply_rate_control(outputStreamCodec, config);
             encoderContext->time_base = {1, config.frameRate};
-            encoderContext->sample_aspect_ratio = inputStream->codecpar->sample_aspect_ratio;
+            encoderContext->sample_aspect_ratio = config.sampleAspectRatio;
             encoderContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
             break;
         case AVMEDIA_TYPE_AUDIO:
@@ -58,14 +81,11 @@ EncoderChainRing::EncoderChainRing(AVStream *inputStream, AVStream *outputStream
             break;
     }
 
-    // Set codec to automatically determine how many threads suits best for the decoding job
-    encoderContext->thread_count = 0;
-    if (outputStreamCodec->capabilities | AV_CODEC_CAP_FRAME_THREADS)
-        encoderContext->thread_type = FF_THREAD_FRAME;
-    else if (outputStreamCodec->capabilities | AV_CODEC_CAP_SLICE_THREADS)
-        encoderContext->thread_type = FF_THREAD_SLICE;
-    else
-        encoderContext->thread_count = 1; //don't use multithreading
+    apply_threading(outputStreamCodec, config);
+
+    if (!isOpened) {
+        return;
+    }
 
     // Open encoder
     ret = avcodec_open2(encoderContext.get(), outputStreamCodec, nullptr);
@@ -75,6 +95,10 @@ EncoderChainRing::EncoderChainRing(AVStream *inputStream, AVStream *outputStream
                                            fmt::format("error opening encoder ({})", Error::unpackAVError(ret))));
     }
 
+    if (config.isStreamParametersShared) {
+        return;
+    }
+
     // Copy encoder parameter to stream
     ret = avcodec_parameters_from_context(outputStream->codecpar, encoderContext.get());
     if (ret < 0) {
@@ -85,6 +109,118 @@ EncoderChainRing::EncoderChainRing(AVStream *inputStream, AVStream *outputStream
     }
 }
 
+/// Configures the encoder threads, checking that the requested threading is supported by the encoder.
+/// Among the encoders with their own threads, libx264 supports both the threading modes, selected by the thread type.
+/// The others (e.g. libx265, libvpx, libaom) ignore the thread type: they only accept the automatic threading, which
+/// lets them choose, or a single thread.
+/// The automatic threading uses frame threads for throughput, unless the encoder is tuned for low latency or it only
+/// supports slice threads.
+void EncoderChainRing::apply_threading(const AVCodec *codec, const EncoderConfig &config) {
+    bool hasOwnThreads = codec->capabilities & AV_CODEC_CAP_AUTO_THREADS;
+    bool isThreadTypeHonored = strcmp(codec->name, "libx264") == 0 || strcmp(codec->name, "libx264rgb") == 0;
+    bool isEncoderManaged = hasOwnThreads && !isThreadTypeHonored;
+    bool hasFrameThreads = (hasOwnThreads && !isEncoderManaged) || (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS);
+    bool hasSliceThreads = (hasOwnThreads && !isEncoderManaged) || (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS);
+
+    threading = config.threading;
+    if (threading == ENCODER_THREADING_ENCODER && !isEncoderManaged) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                "encoder '{}' does not manage its own threads", codec->name)));
+    }
+    if (isEncoderManaged && (threading == ENCODER_THREADING_SLICE || threading == ENCODER_THREADING_FRAME)) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                "encoder '{}' manages its own threads: {} threading can't be selected",
+                codec->name, threading == ENCODER_THREADING_SLICE ? "slice" : "frame")));
+    }
+
+    if (threading == ENCODER_THREADING_AUTO && isEncoderManaged) {
+        threading = ENCODER_THREADING_ENCODER;
+    } else if (threading == ENCODER_THREADING_AUTO) {
+        if (hasSliceThreads && (config.isLowLatency || !hasFrameThreads))
+            threading = ENCODER_THREADING_SLICE;
+        else if (hasFrameThreads)
+            threading = ENCODER_THREADING_FRAME;
+        else
+            threading = ENCODER_THREADING_NONE;
+    }
+    if ((threading == ENCODER_THREADING_SLICE && !hasSliceThreads) ||
+        (threading == ENCODER_THREADING_FRAME && !hasFrameThreads)) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                "encoder '{}' does not support {} threading",
+                codec->name, threading == ENCODER_THREADING_SLICE ? "slice" : "frame")));
+    }
+
+    switch (threading) {
+        case ENCODER_THREADING_SLICE:
+            encoderContext->thread_type = FF_THREAD_SLICE;
+            threadCount = config.threadCount;
+            break;
+        case ENCODER_THREADING_FRAME:
+            encoderContext->thread_type = FF_THREAD_FRAME;
+            threadCount = config.threadCount;
+            break;
+        case ENCODER_THREADING_ENCODER:
+            threadCount = config.threadCount;
+            break;
+        case ENCODER_THREADING_NONE:
+        default:
+            encoderContext->thread_type = 0;
+            threadCount = 1;
+            break;
+    }
+    encoderContext->thread_count = threadCount;
+}
+
+/// Sets the constant quality of the encoder: its CRF or QP option if it has one, the generic quantizer otherwise
+void EncoderChainRing::set_quality(int quality) {
+    for (const char *option: {"crf", "qp"}) {
+        if (av_opt_find(encoderContext->priv_data, option, nullptr, 0, 0)) {
+            int ret = av_opt_set_int(encoderContext->priv_data, option, quality, 0);
+            if (ret < 0) {
+                throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                        "error setting '{}' encoder option to value '{}' ({})",
+                        option, quality, Error::unpackAVError(ret))));
+            }
+            return;
+        }
+    }
+    encoderContext->flags |= AV_CODEC_FLAG_QSCALE;
+    encoderContext->global_quality = FF_QP2LAMBDA * quality;
+}
+
+/// Configures the video encoder rate control.
+/// The constant bit rate mode pins the min and max rates to the bit rate: encoders use it to select their CBR mode
+/// (libx264 also needs CBR HRD signaling). In the capped quality mode, encoders without a native cap (libvpx,
+/// libaom) use the max bit rate as their constrained quality target.
+void EncoderChainRing::apply_rate_control(const AVCodec *codec, const EncoderConfig &config) {
+    switch (config.rateControl) {
+        case RATE_CONTROL_CONSTANT:
+            encoderContext->bit_rate = config.bitRate;
+            encoderContext->rc_min_rate = config.bitRate;
+            encoderContext->rc_max_rate = config.bitRate;
+            encoderContext->rc_buffer_size = (int) config.bufferSize;
+            if (av_opt_find(encoderContext->priv_data, "nal-hrd", nullptr, 0, 0))
+                av_opt_set(encoderContext->priv_data, "nal-hrd", "cbr", 0);
+            break;
+        case RATE_CONTROL_CONSTANT_QUALITY:
+            encoderContext->bit_rate = 0;
+            set_quality(config.quality);
+            break;
+        case RATE_CONTROL_CAPPED_QUALITY:
+            encoderContext->bit_rate = codec->id == AV_CODEC_ID_VP9 || codec->id == AV_CODEC_ID_AV1
+                                       ? config.maxBitRate : 0;
+            encoderContext->rc_max_rate = config.maxBitRate;
+            encoderContext->rc_buffer_size = (int) config.bufferSize;
+            set_quality(config.quality);
+            break;
+        case RATE_CONTROL_AVERAGE:
+        default:
+            encoderContext->bit_rate = config.bitRate;
+            break;
+    }
+    requestedBitRate = encoderContext->bit_rate;
+}
+
 /// Flushes the remaining encoder frames
 void EncoderChainRing::flush() {
     execute(nullptr, nullptr);
@@ -93,20 +229,32 @@ void EncoderChainRing::flush() {
 /// Processes an input frame and passes the encoded packet to the next ring.
 /// Flushing is done by setting null parameters.
 void EncoderChainRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    encode(processContext, inputFrame, [this, processContext](AVPacket *packet) {
+        next->execute(processContext, packet);
+    });
+}
+
+/// Encodes an input frame and passes the encoded packets, if any, to the output function, which can take their
+/// references. Flushing is done by setting null parameters.
+void EncoderChainRing::encode(ProcessContext *processContext, AVFrame *inputFrame,
+                              const std::function<void(AVPacket *)> &output) {
     // Null processContext and inputFrame means a flush has been requested. No need to calculate frame stuff.
     if (processContext && inputFrame) {
         // Calculate the encoder frame PTS
         inputFrame->pict_type = AV_PICTURE_TYPE_NONE;
         inputFrame->pts = av_rescale_q(processContext->sourcePacketPts,
-                                       inputStream->time_base,
+                                       inputTimeBase,
                                        encoderContext->time_base);
-    }
 
-    auto encodedPacket = std::unique_ptr<AVPacket, FFMpegObjectsDeleter>(av_packet_alloc());
-    if (!encodedPacket) {
-        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, "error allocating packet"));
+        // Encoders supporting it (e.g. libx264) reconfigure their rate control when the bit rate changes
+        int64_t bitRate = requestedBitRate;
+        if (bitRate != encoderContext->bit_rate) {
+            encoderContext->bit_rate = bitRate;
+        }
     }
 
+    auto encodedPacket = framePool->get_packet();
+
     int response = avcodec_send_frame(encoderContext.get(), inputFrame);
     if (response < 0) {
         throw std::runtime_error(
@@ -114,6 +262,9 @@ void EncoderChainRing::execute(ProcessContext *processContext, AVFrame *inputFra
                                            fmt::format("error sending packet to the encoder ({})",
                                                        Error::unpackAVError(response))));
     }
+    if (inputFrame) {
+        pendingFrameTimes.push_back(std::chrono::steady_clock::now());
+    }
 
     while (response >= 0) {
         response = avcodec_receive_packet(encoderContext.get(), encodedPacket.get());
@@ -126,6 +277,19 @@ void EncoderChainRing::execute(ProcessContext *processContext, AVFrame *inputFra
                                                            Error::unpackAVError(response))));
         }
 
+        // The encoder outputs a packet for each frame: the oldest frame sent is the one whose encoding completed,
+        // including the frames reordering delay
+        if (!pendingFrameTimes.empty()) {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - pendingFrameTimes.front()).count();
+            pendingFrameTimes.pop_front();
+
+            std::lock_guard<std::mutex> lock(statsMutex);
+            encodedFrames++;
+            totalLatency += latency;
+            maxLatency = std::max(maxLatency, latency);
+        }
+
         encodedPacket->stream_index = outputStream->index;
 
         av_packet_rescale_ts(encodedPacket.get(), encoderContext->time_base, outputStream->time_base);
@@ -135,7 +299,16 @@ void EncoderChainRing::execute(ProcessContext *processContext, AVFrame *inputFra
         }
         lastEncodedDTS = encodedPacket->dts;
 
-        // Pass the encoded packet to the next ring
-        next->execute(processContext, encodedPacket.get());
+        output(encodedPacket.get());
     }
 }
+
+/// Returns the encoder threading and its latency
+EncoderStats EncoderChainRing::get_stats() {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return {.threading = threading,
+            .threadCount = threadCount,
+            .encodedFrames = encodedFrames,
+            .averageLatency = encodedFrames > 0 ? totalLatency / (int64_t) encodedFrames : 0,
+            .maxLatency = maxLatency};
+}
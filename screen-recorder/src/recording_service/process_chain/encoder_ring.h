@@ -1,7 +1,13 @@
 #ifndef PDS_SCREEN_RECORDING_ENCODER_RING_H
 #define PDS_SCREEN_RECORDING_ENCODER_RING_H
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include "muxer_ring.h"
+#include "frame_pool.h"
 #include "../ffmpeg_objects_deleter.h"
 
 extern "C" {
@@ -9,17 +15,60 @@ extern "C" {
 #include "libavformat/avformat.h"
 }
 
+/// Video rate control modes
+enum RateControlMode {
+    RATE_CONTROL_AVERAGE,          // Average bit rate
+    RATE_CONTROL_CONSTANT,         // Constant bit rate, enforced by a VBV buffer
+    RATE_CONTROL_CONSTANT_QUALITY, // Constant quality (CRF, or CQP if the encoder has no CRF)
+    RATE_CONTROL_CAPPED_QUALITY    // Constant quality, with the bit rate capped by a VBV buffer
+};
+
+/// How the encoder threads split the encoding work
+enum EncoderThreading {
+    ENCODER_THREADING_AUTO,   // Frame threads, or slice threads if the encoder is tuned for low latency
+    ENCODER_THREADING_SLICE,  // Each frame is split among the threads: no latency is added
+    ENCODER_THREADING_FRAME,  // Consecutive frames are encoded at the same time: a frame of latency per thread
+    ENCODER_THREADING_NONE,   // A single thread
+    ENCODER_THREADING_ENCODER // Chosen by an encoder ignoring the mode (e.g. libx265, libvpx): reported, not requested
+};
+
+struct EncoderStats {
+    EncoderThreading threading; // Threading used by the encoder, never automatic
+    int threadCount;            // 0 if chosen by the encoder
+    uint64_t encodedFrames;
+    int64_t averageLatency;     // microseconds, from a frame sent to the encoder to its encoded packet
+    int64_t maxLatency;         // microseconds
+};
+
 struct EncoderConfig {
     AVCodecID codecID;
+    // If empty, the default encoder of the codec is used
+    std::string encoderName;
     AVMediaType codecType;
     std::map<std::string, std::string> encoderOptions;
-    int bitRate;
+    int64_t bitRate;
+
+    // Video rate control. The bit rate is the target of the average and constant modes, the max bit rate is the cap
+    // of the capped quality mode, and the quality is used by the quality modes (lower is better).
+    RateControlMode rateControl;
+    int quality;
+    int64_t maxBitRate;
+    int64_t bufferSize; // VBV buffer size, in bits
+
+    // Encoder threading, and its threads. If the thread count is 0, the encoder chooses how many threads to use.
+    EncoderThreading threading;
+    int threadCount;
+    // The encoder is tuned for low latency: the automatic threading doesn't add latency
+    bool isLowLatency;
+    // The output stream parameters are set by another encoder with the same configuration, which is already muxing
+    bool isStreamParametersShared;
 
     // Video properties
     int height;
     int width;
     AVPixelFormat pixelFormat;
     int frameRate;
+    AVRational sampleAspectRatio;
 
     // Audio properties
     int channels;
@@ -30,30 +79,79 @@ struct EncoderConfig {
 };
 
 class EncoderChainRing {
-    // These are just convenience pointers to the context main A/V streams. They follow the context lifecycle.
-    AVStream *inputStream;
+    // Time base of the input PTS
+    AVRational inputTimeBase;
+
+    // This is just a convenience pointer to the output context main A/V stream. It follows the context lifecycle.
     AVStream *outputStream;
 
     std::unique_ptr<AVCodecContext, FFMpegObjectsDeleter> encoderContext;
 
+    std::shared_ptr<FramePool> framePool;
+
     int64_t lastEncodedDTS;
 
+    // Bit rate requested while encoding, applied before sending the next frame
+    std::atomic<int64_t> requestedBitRate;
+    RateControlMode rateControl;
+
     std::shared_ptr<MuxerChainRing> next;
 
+    // When the frames waiting to be encoded have been sent to the encoder, in order
+    std::deque<std::chrono::steady_clock::time_point> pendingFrameTimes;
+
+    std::mutex statsMutex;
+    EncoderThreading threading;
+    int threadCount;
+    uint64_t encodedFrames;
+    int64_t totalLatency;
+    int64_t maxLatency;
+
+    void apply_threading(const AVCodec *codec, const EncoderConfig &config);
+
+    void set_quality(int quality);
+
+    void apply_rate_control(const AVCodec *codec, const EncoderConfig &config);
+
+protected:
+    /// Configures the encoder context, without opening it if isOpened is false: rings which encode by other means
+    /// only expose its configuration.
+    EncoderChainRing(AVRational inputTimeBase,
+                     AVStream *outputStream,
+                     const EncoderConfig &config,
+                     std::shared_ptr<FramePool> framePool,
+                     bool isOpened);
+
 public:
-    EncoderChainRing(AVStream *inputStream,
+    EncoderChainRing(AVRational inputTimeBase,
                      AVStream *outputStream,
-                     const EncoderConfig &config);
+                     const EncoderConfig &config,
+                     std::shared_ptr<FramePool> framePool);
+
+    virtual void execute(ProcessContext *processContext, AVFrame *inputFrame);
 
-    void execute(ProcessContext *processContext, AVFrame *inputFrame);
+    void encode(ProcessContext *processContext, AVFrame *inputFrame, const std::function<void(AVPacket *)> &output);
 
     void setNext(std::shared_ptr<MuxerChainRing> ring) { this->next = std::move(ring); };
 
+    std::shared_ptr<MuxerChainRing> getNext() { return this->next; };
+
     AVCodecContext *getEncoderContext() { return this->encoderContext.get(); };
 
-    void flush();
+    AVStream *getOutputStream() { return this->outputStream; };
+
+    void setBitRate(int64_t bitRate) { this->requestedBitRate = bitRate; };
+
+    /// The bit rate is only the rate control target in the average and constant modes
+    [[nodiscard]] bool isBitRateAdjustable() const {
+        return rateControl == RATE_CONTROL_AVERAGE || rateControl == RATE_CONTROL_CONSTANT;
+    };
+
+    virtual EncoderStats get_stats();
+
+    virtual void flush();
 
-    ~EncoderChainRing() = default;
+    virtual ~EncoderChainRing() = default;
 };
 
 #endif  // PDS_SCREEN_RECORDING_ENCODER_RING_H
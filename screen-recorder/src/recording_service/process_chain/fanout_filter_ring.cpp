@@ -0,0 +1,23 @@
+#include "fanout_filter_ring.h"
+
+/// Sends the input frame to a ring
+static void send_frame(const std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> &ring,
+                       ProcessContext *processContext, AVFrame *frame) {
+    if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(ring)) {
+        std::get<std::shared_ptr<FilterChainRing>>(ring)->execute(processContext, frame);
+    } else {
+        std::get<std::shared_ptr<EncoderChainRing>>(ring)->execute(processContext, frame);
+    }
+}
+
+/// Sends the input frame to all the rings, in order
+void FanOutFilterRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    for (size_t i = 0; i + 1 < rings.size(); i++) {
+        PooledFrame frame = framePool->clone_frame(inputFrame);
+        std::unique_ptr<ProcessContext> context = processContext->clone_properties();
+        send_frame(rings[i], context.get(), frame.get());
+    }
+    if (!rings.empty()) {
+        send_frame(rings.back(), processContext, inputFrame);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef PDS_SCREEN_RECORDING_FANOUT_FILTER_RING_H
+#define PDS_SCREEN_RECORDING_FANOUT_FILTER_RING_H
+
+#include <vector>
+#include "filter_ring.h"
+#include "frame_pool.h"
+
+/// Passes the input frames to several rings, e.g. the scale and encode branches of the renditions of a chain, so a
+/// single capture and decoding feeds all of them.
+/// Every ring but the last one receives a new reference to the input frame, sharing its buffers, along with a copy of
+/// the process context properties: the rings can update them (e.g. the PTS) without affecting each other.
+class FanOutFilterRing : public FilterChainRing {
+    std::vector<std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>>> rings;
+
+    std::shared_ptr<FramePool> framePool;
+
+public:
+    FanOutFilterRing(std::vector<std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>>> rings,
+                     std::shared_ptr<FramePool> framePool)
+            : rings(std::move(rings)), framePool(std::move(framePool)) {};
+
+    ~FanOutFilterRing() override = default;
+
+    void execute(ProcessContext *processContext, AVFrame *inputFrame) override;
+};
+
+#endif //PDS_SCREEN_RECORDING_FANOUT_FILTER_RING_H
@@ -0,0 +1,224 @@
+#include "frame_pool.h"
+#include <fmt/core.h>
+#include "../error.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/samplefmt.h>
+}
+
+// Alignment of the video frames line sizes and height, as used by av_frame_get_buffer
+const int FRAME_ALIGNMENT = 32;
+// Padding added to the video frames data, so that SIMD code can read past the last row
+const int FRAME_PADDING = 16 + 64 - 1;
+
+void FramePoolReleaser::operator()(AVFrame *frame) const {
+    if (pool) {
+        pool->release(frame);
+    } else {
+        av_frame_free(&frame);
+    }
+}
+
+void FramePoolReleaser::operator()(AVPacket *packet) const {
+    if (pool) {
+        pool->release(packet);
+    } else {
+        av_packet_free(&packet);
+    }
+}
+
+FramePool::FramePool()
+        : freeFrames(FRAME_POOL_MAX_FREE_OBJECTS),
+          freePackets(FRAME_POOL_MAX_FREE_OBJECTS),
+          frameRequests(0),
+          bufferRequests(0),
+          packetRequests(0),
+          frameAllocations(0),
+          bufferAllocations(0),
+          packetAllocations(0) {}
+
+/// Allocates a new buffer for a buffer pool, counting it.
+/// The buffer size type depends on the FFmpeg version, so it is deduced from the pool callback type.
+template<typename Size>
+AVBufferRef *FramePool::allocate_buffer(void *opaque, Size size) {
+    static_cast<FramePool *>(opaque)->bufferAllocations++;
+    return av_buffer_alloc(size);
+}
+
+/// Returns a buffer of the passed size from the buffer pool of the passed key, creating the pool if needed.
+/// All the buffers requested with the same key must have the same size.
+AVBufferRef *FramePool::get_buffer(const BufferPoolKey &key, int size) {
+    AVBufferPool *bufferPool;
+    {
+        std::lock_guard<std::mutex> lock(bufferPoolsMutex);
+        auto &pool = bufferPools[key];
+        if (!pool) {
+            pool = std::unique_ptr<AVBufferPool, BufferPoolDeleter>(
+                    av_buffer_pool_init2(size, this, allocate_buffer, nullptr));
+            if (!pool) {
+                throw std::runtime_error(
+                        Error::build_error_message(__FUNCTION__, {}, "error allocating the frame buffer pool"));
+            }
+        }
+        bufferPool = pool.get();
+    }
+
+    bufferRequests++;
+    AVBufferRef *buffer = av_buffer_pool_get(bufferPool);
+    if (!buffer) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {}, "error getting a frame buffer from the pool"));
+    }
+    return buffer;
+}
+
+/// Returns an empty frame
+PooledFrame FramePool::get_frame() {
+    frameRequests++;
+
+    AVFrame *frame = freeFrames.pop();
+    if (!frame) {
+        frame = av_frame_alloc();
+        if (!frame) {
+            throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, "error allocating a new frame"));
+        }
+        frameAllocations++;
+    }
+    return PooledFrame(frame, FramePoolReleaser{this});
+}
+
+/// Returns a frame with a writable video buffer of the passed format and size
+PooledFrame FramePool::get_video_frame(AVPixelFormat pixelFormat, int width, int height) {
+    auto frame = get_frame();
+    frame->format = pixelFormat;
+    frame->width = width;
+    frame->height = height;
+
+    int ret = av_image_fill_linesizes(frame->linesize, pixelFormat, FFALIGN(width, FRAME_ALIGNMENT));
+    if (ret < 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error calculating the frame line sizes ({})",
+                                                       Error::unpackAVError(ret))));
+    }
+    for (int plane = 0; plane < 4; plane++) {
+        frame->linesize[plane] = FFALIGN(frame->linesize[plane], FRAME_ALIGNMENT);
+    }
+
+    int paddedHeight = FFALIGN(height, FRAME_ALIGNMENT);
+    int size = av_image_fill_pointers(frame->data, pixelFormat, paddedHeight, nullptr, frame->linesize);
+    if (size < 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error calculating the frame buffer size ({})",
+                                                       Error::unpackAVError(size))));
+    }
+
+    frame->buf[0] = get_buffer({AVMEDIA_TYPE_VIDEO, pixelFormat, width, height}, size + FRAME_PADDING);
+    av_image_fill_pointers(frame->data, pixelFormat, paddedHeight, frame->buf[0]->data, frame->linesize);
+    frame->extended_data = frame->data;
+    return frame;
+}
+
+/// Returns a frame with a writable audio buffer of the passed format and number of samples
+PooledFrame FramePool::get_audio_frame(AVSampleFormat sampleFormat, int channels, uint64_t channelLayout,
+                                       int sampleRate, int samples) {
+    auto frame = get_frame();
+    frame->format = sampleFormat;
+    frame->channels = channels;
+    frame->channel_layout = channelLayout;
+    frame->sample_rate = sampleRate;
+    frame->nb_samples = samples;
+
+    // Planar frames with more planes than the frame data pointers need extended buffers, which are not pooled
+    if (av_sample_fmt_is_planar(sampleFormat) && channels > AV_NUM_DATA_POINTERS) {
+        bufferRequests++;
+        bufferAllocations++;
+        int ret = av_frame_get_buffer(frame.get(), 0);
+        if (ret < 0) {
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {},
+                                               fmt::format("error allocating the frame audio buffer ({})",
+                                                           Error::unpackAVError(ret))));
+        }
+        return frame;
+    }
+
+    int size = av_samples_get_buffer_size(&frame->linesize[0], channels, samples, sampleFormat, 0);
+    if (size < 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error calculating the frame buffer size ({})",
+                                                       Error::unpackAVError(size))));
+    }
+
+    frame->buf[0] = get_buffer({AVMEDIA_TYPE_AUDIO, sampleFormat, samples, channels}, size);
+    frame->extended_data = frame->data;
+    av_samples_fill_arrays(frame->extended_data, &frame->linesize[0], frame->buf[0]->data, channels, samples,
+                           sampleFormat, 0);
+    return frame;
+}
+
+/// Returns a new reference to the passed frame
+PooledFrame FramePool::clone_frame(const AVFrame *source) {
+    auto frame = get_frame();
+    int ret = av_frame_ref(frame.get(), source);
+    if (ret < 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error referencing the frame ({})",
+                                                       Error::unpackAVError(ret))));
+    }
+    return frame;
+}
+
+/// Returns an empty packet
+PooledPacket FramePool::get_packet() {
+    packetRequests++;
+
+    AVPacket *packet = freePackets.pop();
+    if (!packet) {
+        packet = av_packet_alloc();
+        if (!packet) {
+            throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, "error allocating packet"));
+        }
+        packetAllocations++;
+    }
+    return PooledPacket(packet, FramePoolReleaser{this});
+}
+
+/// Unreferences the frame data and keeps the frame for reuse
+void FramePool::release(AVFrame *frame) {
+    av_frame_unref(frame);
+    if (!freeFrames.push(frame)) {
+        av_frame_free(&frame);
+    }
+}
+
+/// Unreferences the packet data and keeps the packet for reuse
+void FramePool::release(AVPacket *packet) {
+    av_packet_unref(packet);
+    if (!freePackets.push(packet)) {
+        av_packet_free(&packet);
+    }
+}
+
+FramePoolStats FramePool::get_stats() const {
+    uint64_t allocations = frameAllocations + bufferAllocations + packetAllocations;
+    uint64_t requests = frameRequests + bufferRequests + packetRequests;
+    return {.frameAllocations = frameAllocations,
+            .bufferAllocations = bufferAllocations,
+            .packetAllocations = packetAllocations,
+            .reusedObjects = requests > allocations ? requests - allocations : 0};
+}
+
+/// Frees the released frames and packets. The buffer pools are freed once their last buffer is released.
+FramePool::~FramePool() {
+    while (AVFrame *frame = freeFrames.pop()) {
+        av_frame_free(&frame);
+    }
+    while (AVPacket *packet = freePackets.pop()) {
+        av_packet_free(&packet);
+    }
+}
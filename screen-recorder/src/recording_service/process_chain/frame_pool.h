@@ -0,0 +1,167 @@
+#ifndef PDS_SCREEN_RECORDING_FRAME_POOL_H
+#define PDS_SCREEN_RECORDING_FRAME_POOL_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <cstdint>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+// Maximum number of released frames and packets kept for reuse, for each type. It must be a power of two.
+const uint64_t FRAME_POOL_MAX_FREE_OBJECTS = 64;
+
+struct FramePoolStats {
+    uint64_t frameAllocations;  // AVFrame objects allocated because no released one was available
+    uint64_t bufferAllocations; // Frame data buffers allocated because no released one was available
+    uint64_t packetAllocations; // AVPacket objects allocated because no released one was available
+    uint64_t reusedObjects;     // Frames, buffers and packets taken from the pool
+};
+
+/// Bounded lock-free list of released objects, which can be pushed and popped by any thread.
+/// As in the source queue, each slot carries a sequence number which tells if it is ready to be written or read;
+/// positions are claimed with a CAS, so there can be many pushers and poppers.
+template<typename T>
+class ObjectFreelist {
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        T *object;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    uint64_t mask;
+
+    alignas(64) std::atomic<uint64_t> pushPosition;
+    alignas(64) std::atomic<uint64_t> popPosition;
+
+public:
+    /// Initializes an empty list. The capacity must be a power of two.
+    explicit ObjectFreelist(uint64_t capacity)
+            : slots(std::make_unique<Slot[]>(capacity)), mask(capacity - 1), pushPosition(0), popPosition(0) {
+        for (uint64_t i = 0; i < capacity; i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /// Adds an object to the list. Returns false if the list is full.
+    bool push(T *object) {
+        uint64_t position = pushPosition.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[position & mask];
+            auto distance = (int64_t) (slot->sequence.load(std::memory_order_acquire) - position);
+            if (distance < 0)
+                return false; // Full
+            if (distance == 0 &&
+                pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+            if (distance > 0)
+                position = pushPosition.load(std::memory_order_relaxed);
+        }
+
+        slot->object = object;
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Takes an object from the list. Returns nullptr if the list is empty.
+    T *pop() {
+        uint64_t position = popPosition.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[position & mask];
+            auto distance = (int64_t) (slot->sequence.load(std::memory_order_acquire) - (position + 1));
+            if (distance < 0)
+                return nullptr; // Empty
+            if (distance == 0 &&
+                popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+            if (distance > 0)
+                position = popPosition.load(std::memory_order_relaxed);
+        }
+
+        T *object = slot->object;
+        slot->sequence.store(position + mask + 1, std::memory_order_release);
+        return object;
+    }
+};
+
+class FramePool;
+
+/// Returns the frames and packets to the pool they have been taken from
+struct FramePoolReleaser {
+    FramePool *pool = nullptr;
+
+    void operator()(AVFrame *frame) const;
+
+    void operator()(AVPacket *packet) const;
+};
+
+using PooledFrame = std::unique_ptr<AVFrame, FramePoolReleaser>;
+using PooledPacket = std::unique_ptr<AVPacket, FramePoolReleaser>;
+
+/// Recycles the frames, frame data buffers and packets used by the process chain rings, so that no allocation
+/// happens in the steady state.
+/// Released frames and packets are unreferenced and kept in a lock-free freelist, so that threads taking them (e.g.
+/// the capture thread) never wait for the threads releasing them. Frame data buffers come from an AVBufferPool
+/// for each format and size: a buffer returns to its pool when the last frame referencing it is released, even if
+/// that happens in another ring or after the frame has been passed to the encoder.
+/// The pool is shared by all the rings of a recording and it is thread safe. It must outlive the frames and packets
+/// taken from it.
+class FramePool {
+    // Buffer pool key: media type, format, width and height for video, samples and channels for audio
+    using BufferPoolKey = std::tuple<int, int, int, int>;
+
+    struct BufferPoolDeleter {
+        void operator()(AVBufferPool *bufferPool) const { av_buffer_pool_uninit(&bufferPool); };
+    };
+
+    ObjectFreelist<AVFrame> freeFrames;
+    ObjectFreelist<AVPacket> freePackets;
+
+    std::mutex bufferPoolsMutex;
+    std::map<BufferPoolKey, std::unique_ptr<AVBufferPool, BufferPoolDeleter>> bufferPools;
+
+    std::atomic<uint64_t> frameRequests;
+    std::atomic<uint64_t> bufferRequests;
+    std::atomic<uint64_t> packetRequests;
+    std::atomic<uint64_t> frameAllocations;
+    std::atomic<uint64_t> bufferAllocations;
+    std::atomic<uint64_t> packetAllocations;
+
+    template<typename Size>
+    static AVBufferRef *allocate_buffer(void *opaque, Size size);
+
+    AVBufferRef *get_buffer(const BufferPoolKey &key, int size);
+
+    friend struct FramePoolReleaser;
+
+    void release(AVFrame *frame);
+
+    void release(AVPacket *packet);
+
+public:
+    FramePool();
+
+    PooledFrame get_frame();
+
+    PooledFrame get_video_frame(AVPixelFormat pixelFormat, int width, int height);
+
+    PooledFrame get_audio_frame(AVSampleFormat sampleFormat, int channels, uint64_t channelLayout, int sampleRate,
+                                int samples);
+
+    PooledFrame clone_frame(const AVFrame *frame);
+
+    PooledPacket get_packet();
+
+    [[nodiscard]] FramePoolStats get_stats() const;
+
+    ~FramePool();
+};
+
+#endif //PDS_SCREEN_RECORDING_FRAME_POOL_H
@@ -1,19 +1,181 @@
 #include "muxer_ring.h"
 #include <fmt/core.h>
 
+#include <algorithm>
 #include <utility>
 #include "../error.h"
 
-/// Initializes the muxer
-MuxerChainRing::MuxerChainRing(std::shared_ptr<DeviceContext> muxerContext) : muxerContext(std::move(muxerContext)) {}
+extern "C" {
+#include <libavutil/mathematics.h>
+}
+
+using namespace std::chrono;
+
+/// Initializes the muxer and starts the mux thread.
+/// A packets queue is created for each stream of the output context.
+MuxerChainRing::MuxerChainRing(std::shared_ptr<DeviceContext> muxerContext, std::shared_ptr<FramePool> framePool,
+                               size_t streamQueueCapacity)
+        : muxerContext(std::move(muxerContext)),
+          framePool(std::move(framePool)),
+          streamQueues(this->muxerContext->getContext()->nb_streams),
+          streamQueueCapacity(streamQueueCapacity),
+          mustStop(false),
+          writtenPackets(0),
+          totalInterleavingDelay(0),
+          maxInterleavingDelay(0) {
+    muxThread = std::thread([this]() { run(); });
+}
+
+/// Returns the index of the stream whose next packet must be written, or -1 if the mux thread must wait.
+/// It must be called with the queues mutex held.
+int MuxerChainRing::select_next_stream() {
+    AVFormatContext *context = muxerContext->getContext();
+
+    int nextStream = -1;
+    bool areAllStreamsReady = true;
+    bool isAnyQueueFull = false;
+    for (int i = 0; i < streamQueues.size(); i++) {
+        const auto &packets = streamQueues[i].packets;
+        if (packets.empty()) {
+            if (!streamQueues[i].isEnded)
+                areAllStreamsReady = false;
+            continue;
+        }
+
+        if (packets.size() >= streamQueueCapacity)
+            isAnyQueueFull = true;
+
+        if (nextStream < 0 ||
+            av_compare_ts(packets.front().packet->dts, context->streams[i]->time_base,
+                          streamQueues[nextStream].packets.front().packet->dts,
+                          context->streams[nextStream]->time_base) < 0)
+            nextStream = i;
+    }
+
+    if (areAllStreamsReady || isAnyQueueFull)
+        return nextStream;
+    return -1;
+}
+
+/// Writes the queued packets, interleaved by DTS, until the muxer is stopped
+void MuxerChainRing::run() {
+    while (true) {
+        QueuedPacket queuedPacket;
+        {
+            std::unique_lock<std::mutex> lock(queuesMutex);
+            int nextStream = -1;
+            queuesCV.wait(lock, [this, &nextStream] {
+                nextStream = select_next_stream();
+                return mustStop || nextStream >= 0;
+            });
+            if (nextStream < 0)
+                break;
+
+            queuedPacket = std::move(streamQueues[nextStream].packets.front());
+            streamQueues[nextStream].packets.pop_front();
+        }
+        queuesCV.notify_all();
+
+        int64_t interleavingDelay = duration_cast<microseconds>(steady_clock::now() - queuedPacket.enqueueTime).count();
+
+        int ret = av_write_frame(muxerContext->getContext(), queuedPacket.packet.get());
+
+        {
+            std::lock_guard<std::mutex> lock(queuesMutex);
+            if (ret < 0) {
+                error = std::make_exception_ptr(std::runtime_error(
+                        Error::build_error_message(__FUNCTION__, {},
+                                                   fmt::format("error muxing the packet ({})",
+                                                               Error::unpackAVError(ret)))));
+                mustStop = true;
+            } else {
+                writtenPackets++;
+                totalInterleavingDelay += interleavingDelay;
+                maxInterleavingDelay = std::max(maxInterleavingDelay, interleavingDelay);
+            }
+        }
+        queuesCV.notify_all();
+
+        if (ret < 0)
+            break;
+    }
+}
 
-/// Processes an input encoded packet and writes it to the output
+/// Enqueues an input encoded packet, to be written to the output by the mux thread.
+/// The input packet data is moved to the queue, leaving the input packet blank.
+/// It waits if the packet stream queue is full.
 void MuxerChainRing::execute(ProcessContext *processContext, AVPacket *inputPacket) {
-    int ret = av_interleaved_write_frame(muxerContext->getContext(), inputPacket);
-    if (ret < 0) {
-        throw std::runtime_error(
-                Error::build_error_message(__FUNCTION__, {},
-                                           fmt::format("error muxing the packet ({})", Error::unpackAVError(ret))));
+    auto packet = framePool->get_packet();
+    av_packet_move_ref(packet.get(), inputPacket);
+
+    {
+        std::unique_lock<std::mutex> lock(queuesMutex);
+        auto &streamQueue = streamQueues[packet->stream_index];
+        queuesCV.wait(lock, [this, &streamQueue] {
+            return error || mustStop || streamQueue.packets.size() < streamQueueCapacity;
+        });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        streamQueue.packets.push_back({std::move(packet), steady_clock::now()});
+    }
+    queuesCV.notify_all();
+}
+
+/// Marks the end of the passed stream: the mux thread doesn't wait for its packets anymore
+void MuxerChainRing::end_stream(int streamIndex) {
+    {
+        std::lock_guard<std::mutex> lock(queuesMutex);
+        streamQueues[streamIndex].isEnded = true;
+    }
+    queuesCV.notify_all();
+}
+
+/// Waits until all the streams have ended and their packets have been written, then stops the mux thread.
+/// Errors raised by the mux thread are rethrown.
+void MuxerChainRing::flush() {
+    {
+        std::unique_lock<std::mutex> lock(queuesMutex);
+        queuesCV.wait(lock, [this] {
+            return error || std::all_of(streamQueues.begin(), streamQueues.end(), [](const StreamQueue &queue) {
+                return queue.isEnded && queue.packets.empty();
+            });
+        });
+        mustStop = true;
+    }
+    queuesCV.notify_all();
+
+    if (muxThread.joinable())
+        muxThread.join();
+
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
+MuxerStats MuxerChainRing::get_stats() {
+    std::lock_guard<std::mutex> lock(queuesMutex);
+
+    uint64_t queuedPackets = 0;
+    for (const auto &streamQueue: streamQueues)
+        queuedPackets += streamQueue.packets.size();
+
+    return {.writtenPackets = writtenPackets,
+            .queuedPackets = queuedPackets,
+            .averageInterleavingDelay = writtenPackets > 0 ? totalInterleavingDelay / (int64_t) writtenPackets : 0,
+            .maxInterleavingDelay = maxInterleavingDelay};
+}
+
+/// Stops the mux thread. If the muxer has not been flushed, the packets still waiting for the other streams are
+/// discarded.
+MuxerChainRing::~MuxerChainRing() {
+    {
+        std::lock_guard<std::mutex> lock(queuesMutex);
+        mustStop = true;
+    }
+    queuesCV.notify_all();
+
+    if (muxThread.joinable())
+        muxThread.join();
+}
@@ -1,22 +1,81 @@
 #ifndef PDS_SCREEN_RECORDING_MUXER_RING_H
 #define PDS_SCREEN_RECORDING_MUXER_RING_H
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include "../device_context.h"
 #include "process_context.h"
+#include "frame_pool.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
 }
 
+struct MuxerStats {
+    uint64_t writtenPackets;
+    uint64_t queuedPackets;           // Packets waiting to be interleaved and written
+    int64_t averageInterleavingDelay; // microseconds
+    int64_t maxInterleavingDelay;     // microseconds
+};
+
+/// Writes the encoded packets of all the process chains to the output, on a dedicated mux thread, so that the
+/// encoders never wait for the file I/O.
+/// Each output stream has its own bounded packets queue. The mux thread writes the queued packet with the lowest DTS
+/// once every stream has a queued packet (or has ended), so the output is interleaved without libavformat buffering.
+/// If a stream stalls and another stream queue is full, the full queue is written anyway, so the memory stays
+/// bounded. The chains only wait when the output can't keep up with the encoders.
 class MuxerChainRing {
+    struct QueuedPacket {
+        PooledPacket packet;
+        std::chrono::steady_clock::time_point enqueueTime;
+    };
+
+    struct StreamQueue {
+        std::deque<QueuedPacket> packets;
+        // No more packets will be enqueued for the stream
+        bool isEnded = false;
+    };
+
     std::shared_ptr<DeviceContext> muxerContext;
 
+    std::shared_ptr<FramePool> framePool;
+
+    std::vector<StreamQueue> streamQueues;
+    size_t streamQueueCapacity;
+
+    std::mutex queuesMutex;
+    std::condition_variable queuesCV;
+    bool mustStop;
+    // Error which stopped the mux thread, rethrown to the chains
+    std::exception_ptr error;
+
+    uint64_t writtenPackets;
+    int64_t totalInterleavingDelay;
+    int64_t maxInterleavingDelay;
+
+    std::thread muxThread;
+
+    int select_next_stream();
+
+    void run();
+
 public:
-    explicit MuxerChainRing(std::shared_ptr<DeviceContext> muxerContext);
+    MuxerChainRing(std::shared_ptr<DeviceContext> muxerContext, std::shared_ptr<FramePool> framePool,
+                   size_t streamQueueCapacity);
 
     void execute(ProcessContext *processContext, AVPacket *inputPacket);
 
-    ~MuxerChainRing() = default;
+    void end_stream(int streamIndex);
+
+    void flush();
+
+    MuxerStats get_stats();
+
+    ~MuxerChainRing();
 };
 
 
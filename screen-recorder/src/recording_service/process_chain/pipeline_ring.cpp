@@ -0,0 +1,15 @@
+#include "pipeline_ring.h"
+
+/// Enqueues the input frame in the stage of the next ring
+void FramePipelineRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    std::shared_ptr<AVFrame> frame = framePool->clone_frame(inputFrame);
+    std::shared_ptr<ProcessContext> context = processContext->clone_properties();
+
+    stage->submit([next = getNext(), context, frame]() {
+        if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(next)) {
+            std::get<std::shared_ptr<FilterChainRing>>(next)->execute(context.get(), frame.get());
+        } else {
+            std::get<std::shared_ptr<EncoderChainRing>>(next)->execute(context.get(), frame.get());
+        }
+    });
+}
@@ -0,0 +1,25 @@
+#ifndef PDS_SCREEN_RECORDING_PIPELINE_RING_H
+#define PDS_SCREEN_RECORDING_PIPELINE_RING_H
+
+#include "filter_ring.h"
+#include "pipeline_stage.h"
+#include "frame_pool.h"
+
+/// Passes the input frames to the next ring, which is executed on a separate pipeline stage.
+/// The frame is referenced and the process context properties are copied, so the caller can release them as soon
+/// as this ring returns.
+class FramePipelineRing : public FilterChainRing {
+    std::shared_ptr<PipelineStage> stage;
+
+    std::shared_ptr<FramePool> framePool;
+
+public:
+    FramePipelineRing(std::shared_ptr<PipelineStage> stage, std::shared_ptr<FramePool> framePool)
+            : stage(std::move(stage)), framePool(std::move(framePool)) {};
+
+    ~FramePipelineRing() override = default;
+
+    void execute(ProcessContext *processContext, AVFrame *inputFrame) override;
+};
+
+#endif //PDS_SCREEN_RECORDING_PIPELINE_RING_H
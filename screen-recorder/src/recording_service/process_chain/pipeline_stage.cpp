@@ -0,0 +1,136 @@
+#include "pipeline_stage.h"
+
+/// Initializes an empty stage
+PipelineStage::PipelineStage(std::shared_ptr<TaskExecutor> executor, size_t capacity)
+        : executor(std::move(executor)),
+          capacity(capacity),
+          pendingTasks(0),
+          isScheduled(false),
+          isRunning(false),
+          isStopped(false) {}
+
+/// Executes the oldest queued task, unless another thread is already running a task of the stage.
+/// Returns false if no task has been executed.
+/// If tasks are left and no executor task is going to run them, a new one is submitted.
+bool PipelineStage::run_next() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        if (isStopped || isRunning || tasks.empty())
+            return false;
+
+        task = std::move(tasks.front());
+        tasks.pop();
+        isRunning = true;
+    }
+    stateCV.notify_all();
+
+    std::exception_ptr taskError;
+    try {
+        task();
+    } catch (...) {
+        taskError = std::current_exception();
+    }
+    task = nullptr;
+
+    bool mustSchedule;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        pendingTasks--;
+        isRunning = false;
+        if (taskError) {
+            error = taskError;
+            isStopped = true;
+        }
+
+        // The scheduled task gave up while this thread was running the task
+        mustSchedule = !isScheduled && !isStopped && !tasks.empty();
+        isScheduled = isScheduled || mustSchedule;
+        stateCV.notify_all();
+    }
+
+    if (mustSchedule)
+        executor->submit([this]() { run(); });
+    return true;
+}
+
+/// Executes the queued tasks, in order.
+/// After a batch as long as the stage capacity, the stage is submitted again to the executor, so that the other
+/// stages are not starved. If a waiting thread is running the stage tasks, it takes over the scheduling.
+void PipelineStage::run() {
+    for (size_t i = 0; i < capacity; i++) {
+        if (!run_next())
+            break;
+    }
+
+    // The executor is kept alive by this task: once unscheduled, the stage can be destroyed as soon as the mutex is
+    // released
+    auto stageExecutor = executor;
+    bool mustReschedule;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        mustReschedule = !isStopped && !isRunning && !tasks.empty();
+        isScheduled = mustReschedule;
+        stateCV.notify_all();
+    }
+
+    if (mustReschedule)
+        stageExecutor->submit([this]() { run(); });
+}
+
+/// Waits until the condition, checked with the tasks mutex held, is true.
+/// In the meantime, the waiting thread runs the stage tasks which no other thread is running.
+void PipelineStage::wait(const std::function<bool()> &condition) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(tasksMutex);
+            stateCV.wait(lock, [this, &condition] {
+                return condition() || (!isStopped && !isRunning && !tasks.empty());
+            });
+            if (condition())
+                return;
+        }
+        run_next();
+    }
+}
+
+/// Rethrows the error which stopped the stage, if any
+void PipelineStage::rethrow_error() {
+    std::lock_guard<std::mutex> lock(tasksMutex);
+    if (error)
+        std::rethrow_exception(error);
+}
+
+/// Enqueues a task, waiting if the stage is full
+void PipelineStage::submit(std::function<void()> task) {
+    wait([this] { return isStopped || tasks.size() < capacity; });
+    rethrow_error();
+
+    bool mustSchedule;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        tasks.push(std::move(task));
+        pendingTasks++;
+
+        mustSchedule = !isScheduled;
+        isScheduled = true;
+    }
+
+    if (mustSchedule)
+        executor->submit([this]() { run(); });
+}
+
+/// Waits until all the submitted tasks have been executed
+void PipelineStage::drain() {
+    wait([this] { return isStopped || pendingTasks == 0; });
+    rethrow_error();
+}
+
+/// Discards the tasks not yet started, and waits for the running one
+PipelineStage::~PipelineStage() {
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        isStopped = true;
+    }
+    wait([this] { return !isScheduled && !isRunning; });
+}
@@ -0,0 +1,57 @@
+#ifndef PDS_SCREEN_RECORDING_PIPELINE_STAGE_H
+#define PDS_SCREEN_RECORDING_PIPELINE_STAGE_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include "../task_executor.h"
+
+// Number of tasks which can wait in a pipeline stage before the previous stage is blocked
+const size_t PIPELINE_STAGE_CAPACITY = 4;
+
+/// Serial queue of tasks of a process chain stage, executed on the shared task executor in the order they are
+/// submitted. At most one task of the stage runs at a time.
+/// The tasks queue is bounded: when it is full, the submitter waits, so a slow stage slows down the previous ones
+/// instead of accumulating frames. A waiting thread only helps the awaited stage: if no other thread is running its
+/// tasks, it runs them itself. Since the stages of a chain only wait for the following ones, a waiting worker never
+/// depends on a task it has suspended, whatever the number of workers.
+/// An exception thrown by a task stops the stage, and it is rethrown to the submitter on the next submit or drain.
+class PipelineStage {
+    std::shared_ptr<TaskExecutor> executor;
+    size_t capacity;
+
+    std::queue<std::function<void()>> tasks;
+    // Number of tasks submitted and not yet completed, including the running one
+    size_t pendingTasks;
+    // A task running the stage tasks has been submitted to the executor
+    bool isScheduled;
+    // A thread (the scheduled task or a waiting one) is running a stage task
+    bool isRunning;
+
+    std::mutex tasksMutex;
+    std::condition_variable stateCV;
+
+    bool isStopped;
+    std::exception_ptr error;
+
+    bool run_next();
+
+    void run();
+
+    void wait(const std::function<bool()> &condition);
+
+    void rethrow_error();
+
+public:
+    PipelineStage(std::shared_ptr<TaskExecutor> executor, size_t capacity);
+
+    void submit(std::function<void()> task);
+
+    void drain();
+
+    ~PipelineStage();
+};
+
+#endif //PDS_SCREEN_RECORDING_PIPELINE_STAGE_H
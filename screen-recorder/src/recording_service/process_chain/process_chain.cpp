@@ -1,48 +1,296 @@
 #include "process_chain.h"
 
+#include <algorithm>
 #include <utility>
+#include "fanout_filter_ring.h"
+#include "pipeline_ring.h"
 
-/// Processes the next packet in the packets queue
-void ProcessChain::processNext() {
-    if (sourceQueue.empty()) {
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+using namespace std::chrono;
+
+// Maximum number of sources processed by a single processing task, before submitting a new one to the executor
+const int PROCESSING_BATCH_SIZE = 8;
+
+/// Returns the memory held by a source
+static uint64_t get_source_size(const ProcessContext *processContext) {
+    if (processContext->sourceFrame) {
+        AVFrame *frame = processContext->sourceFrame.get();
+        return std::max(av_image_get_buffer_size((AVPixelFormat) frame->format, frame->width, frame->height, 1), 0);
+    }
+    if (processContext->sourcePacket) {
+        return processContext->sourcePacket->size;
+    }
+    return 0;
+}
+
+/// Queues a source in memory or, if the memory budget would be exceeded, in the spill buffer.
+/// Once a source has been spilled, the following ones are spilled too until the spill buffer is drained, so the
+/// sources order is preserved: the spill buffer is read only when the memory queue is empty.
+/// Sources pushed after a processing error are discarded.
+void ProcessChain::pushSource(std::unique_ptr<ProcessContext> processContext) {
+    if (sourceQueue.is_closed()) {
         return;
     }
+    if (spillBuffer) {
+        uint64_t queued = sourceQueue.size();
+        bool mustSpill = !spillBuffer->empty() || queued >= sourceQueue.get_capacity() ||
+                         (queued + 1) * get_source_size(processContext.get()) > spillMemoryBudget;
+        if (mustSpill) {
+            spillBuffer->push(std::move(processContext));
+            return;
+        }
+    }
+    sourceQueue.push(std::move(processContext));
+}
+
+/// Processes the next packet in the packets queue, or in the spill buffer once the queue is empty.
+/// Returns false if the queue is empty or the end of stream has been reached.
+bool ProcessChain::processNext() {
+    auto processContext = sourceQueue.pop();
+    if (!processContext && spillBuffer) {
+        processContext = spillBuffer->pop();
+    }
+    if (!processContext) {
+        return false;
+    }
+
+    if (processContext->isEndOfStream) {
+        finish();
+        return false;
+    }
+
+    // Frames dropped to lower the frame rate are handled as the ones dropped by the queue
+    if (qualityController && processContext->isDisposable &&
+        qualityController->must_drop(processContext->sourceIndex)) {
+        return true;
+    }
 
-    auto inputPacket = std::move(sourceQueue.front());
-    sourceQueue.pop();
+    auto processingStart = steady_clock::now();
+    processSource(processContext.get());
 
-    decoderRing->execute(inputPacket.get());
+    if (qualityController) {
+        qualityController->update(
+                (double) (sourceQueue.size() + 1) / (double) sourceQueue.get_capacity(),
+                duration_cast<microseconds>(processingStart - processContext->enqueueTime).count(),
+                duration_cast<microseconds>(steady_clock::now() - processingStart).count());
+    }
+    return true;
 }
 
-/// Initializes the process chain using the rings passed in input
-ProcessChain::ProcessChain(std::shared_ptr<DecoderChainRing> decoderRing,
-                           std::vector<std::shared_ptr<FilterChainRing>> filterRings,
-                           std::shared_ptr<EncoderChainRing> encoderRing, std::shared_ptr<MuxerChainRing> muxerRing)
-        : decoderRing(std::move(decoderRing)),
-          filterRings(std::move(filterRings)),
-          encoderRing(std::move(encoderRing)),
-          muxerRing(std::move(muxerRing)) {
-    if (this->filterRings.empty()) {
-        this->decoderRing->setNext(this->encoderRing);
+/// Sends a source to the first ring of the chain
+void ProcessChain::processSource(ProcessContext *processContext) {
+    // The damage of a frame is relative to the previous one: if that has been dropped, the whole frame is changed
+    if (processContext->sourceIndex != expectedSourceIndex) {
+        processContext->sourceFrameDamage.isRepeated = false;
+        processContext->sourceFrameDamage.regions.clear();
+    }
+    expectedSourceIndex = processContext->sourceIndex + 1;
+
+    if (!processContext->sourceFrame) {
+        decoderRing->execute(processContext);
+        return;
+    }
+
+    // Raw frames skip the decoder ring
+    if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(frameRing)) {
+        std::get<std::shared_ptr<FilterChainRing>>(frameRing)->execute(processContext,
+                                                                       processContext->sourceFrame.get());
     } else {
-        this->decoderRing->setNext(this->filterRings.front());
+        std::get<std::shared_ptr<EncoderChainRing>>(frameRing)->execute(processContext,
+                                                                        processContext->sourceFrame.get());
+    }
+}
+
+/// Processes the queued packets. It is run as an executor task.
+/// After a batch of packets, it submits itself again if more packets are queued, so that other tasks are not starved.
+void ProcessChain::processPending() {
+    try {
+        for (int i = 0; i < PROCESSING_BATCH_SIZE; i++) {
+            if (!processNext())
+                break;
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(processingMutex);
+            processingError = std::current_exception();
+        }
+        // Nothing will pop the queue anymore: the capture thread must not wait for a free slot
+        sourceQueue.close();
+    }
+
+    // Notified with the mutex held: once ended, the chain can be destroyed as soon as the mutex is released
+    bool mustReschedule;
+    {
+        std::lock_guard<std::mutex> lock(processingMutex);
+        isProcessingScheduled = false;
+        mustReschedule = !isEnded && !processingError;
+        processingCV.notify_all();
+    }
+
+    // A packet enqueued after the last processNext didn't schedule a new task, as this one was still scheduled
+    if (mustReschedule && (sourceQueue.size() > 0 || (spillBuffer && !spillBuffer->empty()))) {
+        scheduleProcessing();
+    }
+}
 
-        int i;
-        for (i = 0; i < this->filterRings.size() - 1; i++) {
-            this->filterRings[i]->setNext(this->filterRings[i + 1]);
+/// Submits a processing task to the executor, if there isn't one already
+void ProcessChain::scheduleProcessing() {
+    {
+        std::lock_guard<std::mutex> lock(processingMutex);
+        if (processingError || isEnded || isProcessingHeld || isProcessingScheduled.exchange(true)) {
+            return;
         }
-        this->filterRings.back()->setNext(this->encoderRing);
     }
-    this->encoderRing->setNext(this->muxerRing);
+    executor->submit([this]() { processPending(); });
+}
+
+/// Initializes the process chain using the rings passed in input.
+/// At least a branch is required: if more are passed, the frames are fanned out to all of them.
+ProcessChain::ProcessChain(std::shared_ptr<TaskExecutor> executor,
+                           std::shared_ptr<FramePool> framePool,
+                           std::shared_ptr<DecoderChainRing> decoderRing,
+                           std::vector<ProcessBranch> branches,
+                           uint64_t sourceQueueCapacity, SourceQueueOverflowPolicy sourceQueueOverflowPolicy,
+                           bool isPipelined)
+        : executor(std::move(executor)),
+          framePool(std::move(framePool)),
+          sourceQueue(sourceQueueCapacity, sourceQueueOverflowPolicy),
+          isProcessingScheduled(false),
+          isEnded(false),
+          isProcessingHeld(false),
+          nextSourceIndex(0),
+          expectedSourceIndex(0),
+          areSourcePacketsDisposable(false),
+          spillMemoryBudget(0),
+          decoderRing(std::move(decoderRing)),
+          branches(std::move(branches)) {
+    if (this->branches.size() == 1) {
+        frameRing = linkBranch(this->branches.front(), isPipelined);
+    } else {
+        std::vector<std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>>> branchRings;
+        branchRings.reserve(this->branches.size());
+        for (auto &branch: this->branches) {
+            branchRings.push_back(linkBranch(branch, isPipelined));
+        }
+        frameRing = std::make_shared<FanOutFilterRing>(std::move(branchRings), this->framePool);
+    }
+    if (this->decoderRing) {
+        this->decoderRing->setNext(frameRing);
+
+        // Packets of intra-only video codecs (e.g. raw video) don't depend on each other
+        auto decoderContext = this->decoderRing->getDecoderContext();
+        auto codecDescriptor = avcodec_descriptor_get(decoderContext->codec_id);
+        areSourcePacketsDisposable = decoderContext->codec_type == AVMEDIA_TYPE_VIDEO && codecDescriptor &&
+                                     (codecDescriptor->props & AV_CODEC_PROP_INTRA_ONLY);
+    }
+}
+
+/// Links the rings of a branch, and returns the ring to which its frames must be sent
+std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> ProcessChain::linkBranch(
+        const ProcessBranch &branch, bool isPipelined) {
+    // The inputs are created in the chain order, so the pipeline stages are drained in the same order
+    std::vector<std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>>> ringInputs;
+    for (auto &filterRing: branch.filterRings) {
+        ringInputs.push_back(getRingInput(filterRing, isPipelined));
+    }
+    ringInputs.push_back(getRingInput(branch.encoderRing, isPipelined));
+
+    for (size_t i = 0; i < branch.filterRings.size(); i++) {
+        branch.filterRings[i]->setNext(ringInputs[i + 1]);
+    }
+    branch.encoderRing->setNext(branch.muxerRing);
+    return ringInputs.front();
+}
+
+/// Returns the ring to which the frames for the passed ring must be sent.
+/// In pipelined mode, the passed ring is executed on its own stage, fed by a pipeline ring.
+std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> ProcessChain::getRingInput(
+        std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> ring, bool isPipelined) {
+    if (!isPipelined) {
+        return ring;
+    }
+
+    auto stage = std::make_shared<PipelineStage>(executor, PIPELINE_STAGE_CAPACITY);
+    frameStages.push_back(stage);
+
+    auto pipelineRing = std::make_shared<FramePipelineRing>(stage, framePool);
+    pipelineRing->setNext(std::move(ring));
+    return pipelineRing;
 }
 
 /// Enqueues a packet for processing
-void ProcessChain::enqueueSourcePacket(std::unique_ptr<AVPacket, FFMpegObjectsDeleter> p, int64_t pts) {
-    sourceQueue.emplace(std::make_unique<ProcessContext>(std::move(p), pts));
+void ProcessChain::enqueueSourcePacket(PooledPacket p, int64_t pts) {
+    bool isDisposable = areSourcePacketsDisposable || (p->flags & AV_PKT_FLAG_DISPOSABLE);
+
+    auto processContext = std::make_unique<ProcessContext>(std::move(p), pts);
+    processContext->sourceIndex = nextSourceIndex++;
+    processContext->isDisposable = isDisposable;
+    processContext->enqueueTime = steady_clock::now();
+    pushSource(std::move(processContext));
+    scheduleProcessing();
+}
+
+/// Enqueues a raw frame for processing
+void ProcessChain::enqueueSourceFrame(std::unique_ptr<AVFrame, FFMpegObjectsDeleter> f, FrameDamage damage,
+                                      int64_t pts) {
+    auto processContext = std::make_unique<ProcessContext>(std::move(f), std::move(damage), pts);
+    processContext->sourceIndex = nextSourceIndex++;
+    processContext->isDisposable = true;
+    processContext->enqueueTime = steady_clock::now();
+    pushSource(std::move(processContext));
+    scheduleProcessing();
+}
+
+/// Enqueues the end of stream sentinel: once the packets queued before it have been processed, the chain is flushed.
+/// No packet can be enqueued after it.
+void ProcessChain::enqueueEndOfStream() {
+    pushSource(ProcessContext::end_of_stream());
+    scheduleProcessing();
 }
 
-/// Flushes the whole chain stream
-void ProcessChain::flush() {
-    encoderRing->flush();
+/// Stops submitting processing tasks: the enqueued sources wait in the queue (or in the spill buffer) until the
+/// processing is released. A task already running completes its batch.
+void ProcessChain::holdProcessing() {
+    std::lock_guard<std::mutex> lock(processingMutex);
+    isProcessingHeld = true;
+}
+
+/// Resumes the processing of the enqueued sources
+void ProcessChain::releaseProcessing() {
+    {
+        std::lock_guard<std::mutex> lock(processingMutex);
+        isProcessingHeld = false;
+    }
+    scheduleProcessing();
+}
+
+/// Flushes the whole chain stream, when the end of stream is reached.
+/// In pipelined mode, the frames still in the stages are processed before flushing the encoders. Finally, the chain
+/// stream of each branch is ended in its muxer.
+void ProcessChain::finish() {
+    for (auto &stage: frameStages) {
+        stage->drain();
+    }
+
+    for (auto &branch: branches) {
+        branch.encoderRing->flush();
+        branch.muxerRing->end_stream(branch.encoderRing->getOutputStream()->index);
+    }
+
+    std::lock_guard<std::mutex> lock(processingMutex);
+    isEnded = true;
+}
+
+/// Waits until the end of stream has been processed and the chain has been flushed.
+/// Errors raised while processing the chain are rethrown.
+void ProcessChain::waitEnded() {
+    std::unique_lock<std::mutex> lock(processingMutex);
+    processingCV.wait(lock, [this] { return (processingError || isEnded) && !isProcessingScheduled; });
+    if (processingError) {
+        std::rethrow_exception(processingError);
+    }
 }
 
@@ -1,8 +1,10 @@
 #ifndef PDS_SCREEN_RECORDING_PROCESS_CHAIN_H
 #define PDS_SCREEN_RECORDING_PROCESS_CHAIN_H
 
-#include <queue>
-#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 #include <iostream>
 
 #include "decoder_ring.h"
@@ -10,34 +12,129 @@
 #include "encoder_ring.h"
 #include "muxer_ring.h"
 #include "process_context.h"
+#include "source_queue.h"
+#include "pipeline_stage.h"
+#include "quality_controller.h"
+#include "spill_buffer.h"
+
+/// Rings which take the frames to an output: the filter rings, if any, the encoder and the muxer
+struct ProcessBranch {
+    std::vector<std::shared_ptr<FilterChainRing>> filterRings;
+    std::shared_ptr<EncoderChainRing> encoderRing;
+    std::shared_ptr<MuxerChainRing> muxerRing;
+};
 
 /// A process chain is a sequence of processes which starts from an AVPacket and finishes with a muxing operation into
 /// an output file.
-/// It takes an AVPacket queue in input.
+/// It takes an AVPacket queue in input. Raw frames, produced by native grabbers, can be queued too: they skip the
+/// decoder ring, which can be omitted if the chain is only fed with frames.
+/// The queue is bounded and it must be fed by a single capture thread. Queued sources are processed by a task
+/// submitted to the shared executor: at most one processing task runs at a time, so the sources order is preserved.
+/// Optionally, the sources exceeding a memory budget are kept in a spill buffer on disk, instead of being dropped.
+/// The processing can also be held, so that the sources are only queued (e.g. spooled to disk) and processed later.
+/// In pipelined mode, each ring between the decoder and the muxer runs on its own stage, so the chain throughput is
+/// limited by the slowest ring instead of the sum of all of them. The decoder runs on the processing task, while the
+/// muxer always runs on its own thread.
+/// The frames can be fanned out to several branches, each with its own filter rings, encoder and muxer (e.g. the
+/// renditions of the video at different resolutions): the source is captured and decoded once, and its frames are
+/// shared among the branches. In pipelined mode, the branches run on their own stages.
 class ProcessChain {
 
-    std::queue<std::unique_ptr<ProcessContext>> sourceQueue;
+    std::shared_ptr<TaskExecutor> executor;
+
+    std::shared_ptr<FramePool> framePool;
+
+    SourceQueue sourceQueue;
+
+    // A task processing the queued sources has been submitted to the executor
+    std::atomic<bool> isProcessingScheduled;
+    std::mutex processingMutex;
+    std::condition_variable processingCV;
+    // Error which stopped the processing, rethrown while waiting for the end of stream
+    std::exception_ptr processingError;
+    // The end of stream has been processed
+    bool isEnded;
+    // Sources are only queued: no processing task is submitted until the processing is released
+    bool isProcessingHeld;
+
+    // Producer side: index of the next enqueued source
+    uint64_t nextSourceIndex;
+    // Consumer side: index expected for the next processed source, if no source has been dropped
+    uint64_t expectedSourceIndex;
+
+    // Source packets can be dropped (e.g. intra-only video)
+    bool areSourcePacketsDisposable;
 
     std::shared_ptr<DecoderChainRing> decoderRing;
 
-    std::vector<std::shared_ptr<FilterChainRing>> filterRings;
+    // First ring receiving the decoded (or raw) frames
+    std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> frameRing;
 
-    std::shared_ptr<EncoderChainRing> encoderRing;
+    // The first branch is the main one
+    std::vector<ProcessBranch> branches;
 
-    std::shared_ptr<MuxerChainRing> muxerRing;
+    // Pipelined mode stages, in the chain order
+    std::vector<std::shared_ptr<PipelineStage>> frameStages;
+
+    // Adapts the chain quality to its load, if set
+    std::shared_ptr<QualityController> qualityController;
+
+    // Keeps the sources exceeding the memory budget, if set
+    std::shared_ptr<SpillBuffer> spillBuffer;
+    uint64_t spillMemoryBudget;
+
+    std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> getRingInput(
+            std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> ring, bool isPipelined);
+
+    std::variant<std::shared_ptr<FilterChainRing>, std::shared_ptr<EncoderChainRing>> linkBranch(
+            const ProcessBranch &branch, bool isPipelined);
+
+    void pushSource(std::unique_ptr<ProcessContext> context);
+
+    bool processNext();
+
+    void processSource(ProcessContext *processContext);
+
+    void processPending();
+
+    void scheduleProcessing();
+
+    void finish();
 
 public:
-    ProcessChain(std::shared_ptr<DecoderChainRing> decoderRing,
-                 std::vector<std::shared_ptr<FilterChainRing>> filterRings,
-                 std::shared_ptr<EncoderChainRing> encoderRing, std::shared_ptr<MuxerChainRing> muxerRing);
+    ProcessChain(std::shared_ptr<TaskExecutor> executor,
+                 std::shared_ptr<FramePool> framePool,
+                 std::shared_ptr<DecoderChainRing> decoderRing,
+                 std::vector<ProcessBranch> branches,
+                 uint64_t sourceQueueCapacity, SourceQueueOverflowPolicy sourceQueueOverflowPolicy,
+                 bool isPipelined);
+
+    void setQualityController(std::shared_ptr<QualityController> controller) {
+        this->qualityController = std::move(controller);
+    };
+
+    void setSpillBuffer(std::shared_ptr<SpillBuffer> buffer, uint64_t memoryBudget) {
+        this->spillBuffer = std::move(buffer);
+        this->spillMemoryBudget = memoryBudget;
+    };
+
+    void enqueueSourcePacket(PooledPacket p, int64_t pts);
+
+    void enqueueSourceFrame(std::unique_ptr<AVFrame, FFMpegObjectsDeleter>, FrameDamage damage, int64_t pts);
+
+    [[nodiscard]] SourceQueueStats getSourceQueueStats() const { return this->sourceQueue.get_stats(); };
+
+    [[nodiscard]] SpillBufferStats getSpillStats() const {
+        return this->spillBuffer ? this->spillBuffer->get_stats() : SpillBufferStats{};
+    };
 
-    void processNext();
+    void enqueueEndOfStream();
 
-    void enqueueSourcePacket(std::unique_ptr<AVPacket, FFMpegObjectsDeleter>, int64_t pts);
+    void holdProcessing();
 
-    [[nodiscard]] bool isSourceQueueEmpty() const { return this->sourceQueue.empty(); };
+    void releaseProcessing();
 
-    void flush();
+    void waitEnded();
 
     ~ProcessChain() = default;
 };
@@ -1,20 +1,69 @@
 #ifndef PDS_SCREEN_RECORDING_PROCESS_CONTEXT_H
 #define PDS_SCREEN_RECORDING_PROCESS_CONTEXT_H
 
+#include <chrono>
+#include <optional>
+#include <tuple>
+#include <vector>
 #include "../ffmpeg_objects_deleter.h"
+#include "frame_pool.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
 }
 
+/// Areas of a raw source frame which changed since the previous one.
+/// Rings can use it to avoid processing again the unchanged parts of the frame.
+struct FrameDamage {
+    // The frame is identical to the previous one
+    bool isRepeated = false;
+
+    // Changed areas, in the format: tuple(x,y,width,height) from top left.
+    // If empty, the whole frame must be considered changed.
+    std::vector<std::tuple<int, int, int, int>> regions;
+
+    // Area of the cursor drawn on the frame, in the same format, if known. It is not a changed area: it just marks
+    // where the user is looking.
+    std::optional<std::tuple<int, int, int, int>> cursorArea;
+};
+
 class ProcessContext {
 
 public:
-    std::unique_ptr<AVPacket, FFMpegObjectsDeleter> sourcePacket;
+    // Source packet, returned to its pool when the context is released
+    PooledPacket sourcePacket;
+    // Raw frame produced by a native grabber. When set, the decoding step is skipped.
+    std::unique_ptr<AVFrame, FFMpegObjectsDeleter> sourceFrame;
+    FrameDamage sourceFrameDamage;
     int64_t sourcePacketPts;
+    // Position of the source in the capture order, used to detect dropped sources
+    uint64_t sourceIndex = 0;
+    // The source can be dropped without affecting the processing of the following ones
+    bool isDisposable = false;
+    // Sentinel marking the end of the sources: the chain must be flushed
+    bool isEndOfStream = false;
+    // When the source has been queued for processing
+    std::chrono::steady_clock::time_point enqueueTime;
+
+    ProcessContext(PooledPacket pkt, int64_t pts) : sourcePacket(std::move(pkt)), sourcePacketPts(pts) {};
+
+    ProcessContext(std::unique_ptr<AVFrame, FFMpegObjectsDeleter> frame, FrameDamage damage, int64_t pts)
+            : sourceFrame(std::move(frame)), sourceFrameDamage(std::move(damage)), sourcePacketPts(pts) {};
+
+    /// Returns the sentinel marking the end of the sources
+    static std::unique_ptr<ProcessContext> end_of_stream() {
+        auto context = std::make_unique<ProcessContext>(nullptr, 0);
+        context->isEndOfStream = true;
+        return context;
+    }
 
-    ProcessContext(std::unique_ptr<AVPacket, FFMpegObjectsDeleter> pkt, int64_t pts) : sourcePacket(std::move(pkt)),
-                                                                                       sourcePacketPts(pts) {};
+    /// Copies the source properties, without the source packet and frame
+    [[nodiscard]] std::unique_ptr<ProcessContext> clone_properties() const {
+        auto context = std::make_unique<ProcessContext>(nullptr, sourceFrameDamage, sourcePacketPts);
+        context->sourceIndex = sourceIndex;
+        context->isDisposable = isDisposable;
+        return context;
+    }
 
     ~ProcessContext() = default;
 };
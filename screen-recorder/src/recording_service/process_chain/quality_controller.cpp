@@ -0,0 +1,139 @@
+#include "quality_controller.h"
+
+#include <utility>
+#include <fmt/core.h>
+
+using namespace std::chrono;
+
+/// Initializes the controller at the full quality level.
+/// The scale ring can be null, if the chain has no scaler.
+QualityController::QualityController(std::shared_ptr<SWScaleFilterRing> scaleRing,
+                                     std::shared_ptr<EncoderChainRing> encoderRing, int frameRate)
+        : levels({{"full quality", false, 1, 1}}),
+          scaleRing(std::move(scaleRing)),
+          encoderRing(std::move(encoderRing)),
+          frameInterval(1000000 / std::max(frameRate, 1)),
+          startTime(steady_clock::now()),
+          windowStart(startTime),
+          windowQueueFill(0),
+          windowQueueLatency(0),
+          windowProcessingTime(0),
+          headroomWindows(0),
+          requiredHeadroomWindows(QUALITY_UP_WINDOWS),
+          windowsSinceRaise(QUALITY_MAX_UP_WINDOWS),
+          level(0),
+          decimatedFrames(0),
+          changeCount(0) {
+    baseBitRate = this->encoderRing->getEncoderContext()->bit_rate;
+
+    // Each level keeps the settings of the previous ones
+    bool isFastScaling = false;
+    if (this->scaleRing && this->scaleRing->hasFasterScaling()) {
+        isFastScaling = true;
+        levels.push_back({"fast scaling", isFastScaling, 1, 1});
+    }
+    double bitRateFactor = 1;
+    if (this->encoderRing->isBitRateAdjustable()) {
+        for (double factor: {0.75, 0.5}) {
+            bitRateFactor = factor;
+            levels.push_back({fmt::format("bit rate {}%", (int) (factor * 100)), isFastScaling, bitRateFactor, 1});
+        }
+    }
+    for (int divisor: {2, 3}) {
+        levels.push_back({fmt::format("frame rate 1/{}", divisor), isFastScaling, bitRateFactor, divisor});
+    }
+}
+
+/// Applies the passed level settings to the chain rings and logs the change
+void QualityController::apply_level(int newLevel, double queueFill, int64_t queueLatency, double load) {
+    const QualityLevel &settings = levels[newLevel];
+    if (scaleRing)
+        scaleRing->setFastScaling(settings.isFastScaling);
+    if (encoderRing->isBitRateAdjustable())
+        encoderRing->setBitRate((int64_t) ((double) baseBitRate * settings.bitRateFactor));
+
+    std::lock_guard<std::mutex> lock(changesMutex);
+    if (changes.size() == QUALITY_MAX_KEPT_CHANGES)
+        changes.pop_front();
+    changeCount++;
+    changes.push_back({.time = duration_cast<microseconds>(steady_clock::now() - startTime).count(),
+                       .fromLevel = level,
+                       .toLevel = newLevel,
+                       .queueFill = queueFill,
+                       .queueLatency = queueLatency,
+                       .load = load});
+    level = newLevel;
+}
+
+/// Evaluates the window aggregates, changing the quality level if needed, and starts a new window
+void QualityController::close_window(steady_clock::time_point now) {
+    auto windowDuration = duration_cast<microseconds>(now - windowStart).count();
+    double load = (double) windowProcessingTime / (double) windowDuration;
+    double latency = (double) windowQueueLatency / (double) frameInterval;
+
+    bool isUnderPressure = windowQueueFill >= QUALITY_DOWN_QUEUE_FILL || latency >= QUALITY_DOWN_QUEUE_LATENCY ||
+                           load >= QUALITY_DOWN_LOAD;
+    bool hasHeadroom = windowQueueFill <= QUALITY_UP_QUEUE_FILL && latency <= QUALITY_UP_QUEUE_LATENCY &&
+                       load <= QUALITY_UP_LOAD;
+
+    windowsSinceRaise++;
+    if (isUnderPressure) {
+        headroomWindows = 0;
+        if (level + 1 < (int) levels.size()) {
+            // The last raise didn't hold: wait longer before trying again
+            if (windowsSinceRaise <= QUALITY_UP_WINDOWS)
+                requiredHeadroomWindows = std::min(requiredHeadroomWindows * 2, QUALITY_MAX_UP_WINDOWS);
+            apply_level(level + 1, windowQueueFill, windowQueueLatency, load);
+        }
+    } else if (hasHeadroom && level > 0) {
+        if (++headroomWindows >= requiredHeadroomWindows) {
+            headroomWindows = 0;
+            windowsSinceRaise = 0;
+            apply_level(level - 1, windowQueueFill, windowQueueLatency, load);
+        }
+    } else {
+        headroomWindows = 0;
+    }
+
+    // A raise which held for long enough resets the oscillations backoff
+    if (windowsSinceRaise == QUALITY_MAX_UP_WINDOWS)
+        requiredHeadroomWindows = QUALITY_UP_WINDOWS;
+
+    windowStart = now;
+    windowQueueFill = 0;
+    windowQueueLatency = 0;
+    windowProcessingTime = 0;
+}
+
+/// Adds the load sample of a processed source: the source queue fill ratio and latency (microseconds), and the time
+/// spent processing the source (microseconds).
+/// It must be called only by the chain processing task.
+void QualityController::update(double queueFill, int64_t queueLatency, int64_t processingTime) {
+    windowQueueFill = std::max(windowQueueFill, queueFill);
+    windowQueueLatency = std::max(windowQueueLatency, queueLatency);
+    windowProcessingTime += processingTime;
+
+    auto now = steady_clock::now();
+    if (duration_cast<microseconds>(now - windowStart).count() >= QUALITY_WINDOW_DURATION)
+        close_window(now);
+}
+
+/// Returns true if the source with the passed index must be dropped to lower the effective frame rate.
+/// It must be called only by the chain processing task.
+bool QualityController::must_drop(uint64_t sourceIndex) {
+    int divisor = levels[level].frameRateDivisor;
+    if (divisor <= 1 || sourceIndex % divisor == 0)
+        return false;
+
+    decimatedFrames++;
+    return true;
+}
+
+QualityControllerStats QualityController::get_stats() const {
+    std::lock_guard<std::mutex> lock(changesMutex);
+    return {.level = level,
+            .levelName = levels[level].name,
+            .decimatedFrames = decimatedFrames,
+            .changeCount = changeCount,
+            .changes = std::vector<QualityChange>(changes.begin(), changes.end())};
+}
@@ -0,0 +1,110 @@
+#ifndef PDS_SCREEN_RECORDING_QUALITY_CONTROLLER_H
+#define PDS_SCREEN_RECORDING_QUALITY_CONTROLLER_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "encoder_ring.h"
+#include "swscale_filter_ring.h"
+
+// Duration of the windows in which the chain load is sampled, in microseconds
+const int64_t QUALITY_WINDOW_DURATION = 1000000;
+// The quality is lowered after a window in which any of these thresholds is exceeded: queue fill ratio, queue
+// latency (in frame intervals) and processing load (fraction of the window spent processing)
+const double QUALITY_DOWN_QUEUE_FILL = 0.5;
+const double QUALITY_DOWN_QUEUE_LATENCY = 4;
+const double QUALITY_DOWN_LOAD = 0.9;
+// The quality is raised after QUALITY_UP_WINDOWS consecutive windows below all these thresholds
+const double QUALITY_UP_QUEUE_FILL = 0.125;
+const double QUALITY_UP_QUEUE_LATENCY = 1;
+const double QUALITY_UP_LOAD = 0.6;
+const int QUALITY_UP_WINDOWS = 5;
+// Upper bound of the windows required to raise the quality, after repeated oscillations
+const int QUALITY_MAX_UP_WINDOWS = 60;
+// Number of the latest quality changes kept for the stats
+const size_t QUALITY_MAX_KEPT_CHANGES = 64;
+
+/// Settings applied to the video chain at a quality level
+struct QualityLevel {
+    std::string name;
+    bool isFastScaling;    // Use the fastest scaling algorithm
+    double bitRateFactor;  // Fraction of the configured encoder bit rate
+    int frameRateDivisor;  // Only one frame out of this number is processed
+};
+
+struct QualityChange {
+    int64_t time;         // microseconds since the controller start
+    int fromLevel;
+    int toLevel;
+    double queueFill;     // Highest queue fill ratio in the window which caused the change
+    int64_t queueLatency; // Highest queue latency in the window which caused the change, in microseconds
+    double load;          // Processing load in the window which caused the change
+};
+
+struct QualityControllerStats {
+    int level;
+    std::string levelName;
+    uint64_t decimatedFrames; // Frames dropped to lower the effective frame rate
+    uint64_t changeCount;     // Quality changes since the start
+    std::vector<QualityChange> changes; // The latest changes, at most QUALITY_MAX_KEPT_CHANGES
+};
+
+/// Lowers the video quality in real time when the chain can't keep up with the capture, and raises it back when
+/// there is headroom again.
+/// The chain reports the source queue fill and latency and its processing time for each source. They are aggregated
+/// in fixed windows: the quality is lowered by one level after a window under pressure, and raised by one level
+/// after some consecutive windows with headroom. If the quality is lowered again right after being raised, the
+/// windows required to raise it are doubled, so that the controller doesn't oscillate between two levels.
+/// Levels are applied in the order: scaling algorithm, encoder bit rate, effective frame rate. The levels which can't
+/// take effect on the chain are skipped: the scaling one if the scaler is missing or already as fast (e.g. no resize),
+/// the bit rate ones if the encoder rate control doesn't target a bit rate. The encoder preset and the output size
+/// can't change while recording, as the stream parameters are written in the output header.
+class QualityController {
+    std::vector<QualityLevel> levels;
+
+    std::shared_ptr<SWScaleFilterRing> scaleRing;
+    std::shared_ptr<EncoderChainRing> encoderRing;
+    int64_t baseBitRate;
+    int64_t frameInterval; // microseconds
+
+    std::chrono::steady_clock::time_point startTime;
+
+    // Current window aggregates
+    std::chrono::steady_clock::time_point windowStart;
+    double windowQueueFill;
+    int64_t windowQueueLatency;
+    int64_t windowProcessingTime;
+
+    int headroomWindows;
+    int requiredHeadroomWindows;
+    // Windows elapsed since the last quality raise
+    int windowsSinceRaise;
+
+    std::atomic<int> level;
+    std::atomic<uint64_t> decimatedFrames;
+
+    mutable std::mutex changesMutex;
+    std::deque<QualityChange> changes;
+    uint64_t changeCount;
+
+    void apply_level(int newLevel, double queueFill, int64_t queueLatency, double load);
+
+    void close_window(std::chrono::steady_clock::time_point now);
+
+public:
+    QualityController(std::shared_ptr<SWScaleFilterRing> scaleRing, std::shared_ptr<EncoderChainRing> encoderRing,
+                      int frameRate);
+
+    void update(double queueFill, int64_t queueLatency, int64_t processingTime);
+
+    bool must_drop(uint64_t sourceIndex);
+
+    [[nodiscard]] QualityControllerStats get_stats() const;
+
+    ~QualityController() = default;
+};
+
+#endif //PDS_SCREEN_RECORDING_QUALITY_CONTROLLER_H
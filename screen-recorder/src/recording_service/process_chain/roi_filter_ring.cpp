@@ -0,0 +1,79 @@
+#include "roi_filter_ring.h"
+#include <algorithm>
+#include <fmt/core.h>
+#include "../error.h"
+
+/// Initializes the ring with the regions configuration
+RegionOfInterestFilterRing::RegionOfInterestFilterRing(RegionOfInterestConfig config,
+                                                       std::shared_ptr<FramePool> framePool)
+        : config(std::move(config)), framePool(std::move(framePool)) {
+    if (this->config.cropWidth <= 0 || this->config.cropHeight <= 0 || this->config.outputWidth <= 0 ||
+        this->config.outputHeight <= 0) {
+        throw std::runtime_error(Error::build_error_message(__FUNCTION__, {}, fmt::format(
+                "invalid regions of interest mapping from {}x{} to {}x{}",
+                this->config.cropWidth, this->config.cropHeight, this->config.outputWidth,
+                this->config.outputHeight)));
+    }
+    regions.reserve(this->config.regions.size() + 1);
+}
+
+/// Adds a region, relative to the crop area, mapping it to the output frame.
+/// Regions outside of the frame are skipped.
+void RegionOfInterestFilterRing::add_region(int x, int y, int width, int height) {
+    int left = std::clamp((int) ((int64_t) x * config.outputWidth / config.cropWidth), 0, config.outputWidth);
+    int right = std::clamp((int) ((int64_t) (x + width) * config.outputWidth / config.cropWidth), 0,
+                           config.outputWidth);
+    int top = std::clamp((int) ((int64_t) y * config.outputHeight / config.cropHeight), 0, config.outputHeight);
+    int bottom = std::clamp((int) ((int64_t) (y + height) * config.outputHeight / config.cropHeight), 0,
+                            config.outputHeight);
+    if (right <= left || bottom <= top) {
+        return;
+    }
+
+    regions.push_back({.self_size = sizeof(AVRegionOfInterest),
+                       .top = top,
+                       .bottom = bottom,
+                       .left = left,
+                       .right = right,
+                       .qoffset = config.qualityOffset});
+}
+
+/// Attaches the regions of interest to a new reference of the input frame, and passes it to the next ring.
+/// Frames without any region in view are passed unchanged.
+void RegionOfInterestFilterRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    regions.clear();
+
+    const auto &cursorArea = processContext->sourceFrameDamage.cursorArea;
+    if (cursorArea && config.cursorRegionSize > 0) {
+        auto [x, y, width, height] = *cursorArea;
+        add_region(x + width / 2 - config.cursorRegionSize / 2 - config.cropX,
+                   y + height / 2 - config.cursorRegionSize / 2 - config.cropY,
+                   config.cursorRegionSize, config.cursorRegionSize);
+    }
+    for (const auto &[x, y, width, height]: config.regions) {
+        add_region(x, y, width, height);
+    }
+
+    PooledFrame frame;
+    AVFrame *outputFrame = inputFrame;
+    if (!regions.empty()) {
+        frame = framePool->clone_frame(inputFrame);
+        av_frame_remove_side_data(frame.get(), AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+        AVFrameSideData *sideData = av_frame_new_side_data(frame.get(), AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                           (int) (regions.size() * sizeof(AVRegionOfInterest)));
+        if (!sideData) {
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {}, "error allocating the regions of interest"));
+        }
+        std::copy(regions.begin(), regions.end(), (AVRegionOfInterest *) sideData->data);
+        outputFrame = frame.get();
+    }
+
+    auto next = getNext();
+    if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(next)) {
+        std::get<std::shared_ptr<FilterChainRing>>(next)->execute(processContext, outputFrame);
+    } else {
+        std::get<std::shared_ptr<EncoderChainRing>>(next)->execute(processContext, outputFrame);
+    }
+}
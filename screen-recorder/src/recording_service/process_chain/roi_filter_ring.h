@@ -0,0 +1,55 @@
+#ifndef PDS_SCREEN_RECORDING_ROI_FILTER_RING_H
+#define PDS_SCREEN_RECORDING_ROI_FILTER_RING_H
+
+#include <tuple>
+#include <vector>
+#include "filter_ring.h"
+#include "frame_pool.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+struct RegionOfInterestConfig {
+    // Input area which is encoded, and the encoded size: the regions are mapped from the former to the latter
+    int cropX;
+    int cropY;
+    int cropWidth;
+    int cropHeight;
+    int outputWidth;
+    int outputHeight;
+
+    // Side of the square region centered on the cursor, in input pixels. If 0, the cursor is not a region of interest.
+    int cursorRegionSize;
+
+    // Fixed regions, relative to the crop area, in the format: tuple(x,y,width,height) from top left
+    std::vector<std::tuple<int, int, int, int>> regions;
+
+    // Quantizer offset of the regions, from -1 to 1: negative values raise their quality
+    AVRational qualityOffset;
+};
+
+/// Marks the regions of the frames which must be encoded at a higher quality, attaching them to the frames as regions
+/// of interest side data, which the encoders supporting it (e.g. libx264) honor with a quantizer offset.
+/// The regions are the area around the cursor, if the source frame carries its position, followed by the fixed ones:
+/// where they overlap, the cursor region takes precedence.
+/// The side data is attached to a new reference of the frame, so the frames kept by the previous rings (e.g. the last
+/// converted frame, reused for repeated frames) are not changed.
+class RegionOfInterestFilterRing : public FilterChainRing {
+    RegionOfInterestConfig config;
+
+    std::shared_ptr<FramePool> framePool;
+
+    std::vector<AVRegionOfInterest> regions;
+
+    void add_region(int x, int y, int width, int height);
+
+public:
+    RegionOfInterestFilterRing(RegionOfInterestConfig config, std::shared_ptr<FramePool> framePool);
+
+    ~RegionOfInterestFilterRing() override = default;
+
+    void execute(ProcessContext *processContext, AVFrame *inputFrame) override;
+};
+
+#endif //PDS_SCREEN_RECORDING_ROI_FILTER_RING_H
@@ -0,0 +1,184 @@
+#include "source_queue.h"
+#include <thread>
+
+/// Initializes an empty queue. The capacity is rounded up to the next power of two.
+SourceQueue::SourceQueue(uint64_t requestedCapacity, SourceQueueOverflowPolicy overflowPolicy)
+        : capacity(1),
+          overflowPolicy(overflowPolicy),
+          writePosition(0),
+          readPosition(0),
+          isProducerParked(false),
+          isClosed(false),
+          maxDepth(0),
+          dropped(0),
+          blocked(0) {
+    while (capacity < requestedCapacity)
+        capacity <<= 1;
+    mask = capacity - 1;
+
+    slots = std::make_unique<Slot[]>(capacity);
+    for (uint64_t i = 0; i < capacity; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+/// Writes the context in the next slot, if it is free.
+/// It must be called only by the producer.
+bool SourceQueue::try_push(std::unique_ptr<ProcessContext> &context) {
+    uint64_t position = writePosition.load(std::memory_order_relaxed);
+    Slot &slot = slots[position & mask];
+
+    // The slot is still holding the element written one lap before
+    if (slot.sequence.load(std::memory_order_acquire) != position)
+        return false;
+
+    slot.isDisposable = context->isDisposable;
+    slot.context = std::move(context);
+    slot.sequence.store(position + 1, std::memory_order_release);
+    writePosition.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+/// Reads the oldest element, if any.
+/// It is called by the consumer and, to drop the oldest element, by the producer.
+std::unique_ptr<ProcessContext> SourceQueue::try_pop() {
+    uint64_t position = readPosition.load(std::memory_order_relaxed);
+    while (true) {
+        Slot &slot = slots[position & mask];
+        auto distance = (int64_t) (slot.sequence.load(std::memory_order_acquire) - (position + 1));
+
+        if (distance < 0)
+            return nullptr; // Empty
+
+        if (distance == 0 &&
+            readPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            break;
+
+        // The slot has been claimed by the other reader: retry from the current read position
+        if (distance > 0)
+            position = readPosition.load(std::memory_order_relaxed);
+    }
+
+    Slot &slot = slots[position & mask];
+    auto context = std::move(slot.context);
+    slot.sequence.store(position + capacity, std::memory_order_release);
+    return context;
+}
+
+/// Enqueues a context on a full queue, dropping the oldest element. Returns false, without pushing, if the oldest
+/// element is not disposable.
+/// It must be called only by the producer.
+bool SourceQueue::push_dropping_oldest(std::unique_ptr<ProcessContext> &context) {
+    bool isOldestDropped = false;
+    while (!try_push(context)) {
+        uint64_t position = readPosition.load(std::memory_order_relaxed);
+
+        // The write slot has been claimed by the consumer, which is still releasing it: only wait for it
+        if (isOldestDropped || writePosition.load(std::memory_order_relaxed) - position < capacity) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        Slot &slot = slots[position & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (!slot.isDisposable)
+            return false;
+
+        if (readPosition.compare_exchange_strong(position, position + 1, std::memory_order_relaxed)) {
+            slot.context.reset();
+            slot.sequence.store(position + capacity, std::memory_order_release);
+            dropped++;
+            isOldestDropped = true;
+        }
+    }
+    return true;
+}
+
+/// Wakes the producer, if it is parked on a full queue.
+/// The fence pairs with the one in the parking side, so that either the parked flag is seen here or the slot update
+/// is seen by the producer before it goes to sleep.
+void SourceQueue::wake_producer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (isProducerParked.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(parkingMutex);
+        notFullCV.notify_all();
+    }
+}
+
+/// Enqueues a context. If the queue is full, the overflow policy is applied.
+/// The context is discarded if the queue is closed.
+/// It must be called only by the producer.
+void SourceQueue::push(std::unique_ptr<ProcessContext> context) {
+    if (is_closed())
+        return;
+
+    if (!try_push(context)) {
+        bool isDropAllowed = !context->isEndOfStream &&
+                             (overflowPolicy == OVERFLOW_DROP_NEWEST ||
+                              (overflowPolicy == OVERFLOW_DROP_NON_REFERENCE && context->isDisposable));
+
+        if (isDropAllowed) {
+            dropped++;
+            return;
+        }
+
+        // A non-disposable oldest element is waited for, as with the other policies
+        if (overflowPolicy != OVERFLOW_DROP_OLDEST || !push_dropping_oldest(context)) {
+            blocked++;
+            while (!try_push(context)) {
+                std::unique_lock<std::mutex> lock(parkingMutex);
+                isProducerParked.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                notFullCV.wait(lock, [this] {
+                    uint64_t position = writePosition.load(std::memory_order_relaxed);
+                    return is_closed() || slots[position & mask].sequence.load(std::memory_order_acquire) == position;
+                });
+                isProducerParked.store(false, std::memory_order_relaxed);
+                if (is_closed())
+                    return;
+            }
+        }
+    }
+
+    uint64_t depth = size();
+    if (depth > maxDepth.load(std::memory_order_relaxed))
+        maxDepth.store(depth, std::memory_order_relaxed);
+}
+
+/// Dequeues the oldest context. Returns nullptr if the queue is empty.
+/// It must be called only by the consumer.
+std::unique_ptr<ProcessContext> SourceQueue::pop() {
+    auto context = try_pop();
+    if (context)
+        wake_producer();
+
+    return context;
+}
+
+/// Stops accepting new elements and wakes the producer, if it is waiting for a slot. The queued elements are released.
+/// It must be called only by the consumer.
+void SourceQueue::close() {
+    {
+        std::lock_guard<std::mutex> lock(parkingMutex);
+        isClosed.store(true, std::memory_order_release);
+        notFullCV.notify_all();
+    }
+
+    while (try_pop()) {}
+}
+
+/// Returns the number of queued elements
+uint64_t SourceQueue::size() const {
+    uint64_t read = readPosition.load(std::memory_order_relaxed);
+    uint64_t write = writePosition.load(std::memory_order_relaxed);
+    return write > read ? write - read : 0;
+}
+
+SourceQueueStats SourceQueue::get_stats() const {
+    return {.depth = size(),
+            .maxDepth = maxDepth,
+            .dropped = dropped,
+            .blocked = blocked};
+}
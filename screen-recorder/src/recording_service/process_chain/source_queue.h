@@ -0,0 +1,89 @@
+#ifndef PDS_SCREEN_RECORDING_SOURCE_QUEUE_H
+#define PDS_SCREEN_RECORDING_SOURCE_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "process_context.h"
+
+/// Selects what the producer does when the source queue is full.
+enum SourceQueueOverflowPolicy {
+    OVERFLOW_BLOCK,              // Wait until the consumer frees a slot
+    OVERFLOW_DROP_OLDEST,        // Drop the oldest queued element if it is disposable, otherwise wait
+    OVERFLOW_DROP_NON_REFERENCE, // Drop the new element if it is disposable, otherwise wait
+    OVERFLOW_DROP_NEWEST         // Drop the new element
+};
+
+struct SourceQueueStats {
+    uint64_t depth;    // Elements currently queued
+    uint64_t maxDepth; // Highest number of queued elements
+    uint64_t dropped;  // Elements dropped because the queue was full
+    uint64_t blocked;  // Times the producer waited because the queue was full
+};
+
+/// Bounded single-producer/single-consumer queue of source packets and frames.
+/// Push and pop are lock-free: each slot carries a sequence number which tells if it is ready to be written or read.
+/// The mutex is only used to park the producer on a full queue (OVERFLOW_BLOCK). End of stream sentinels are never
+/// dropped.
+/// When dropping the oldest element, the producer pops it as a second consumer: slots are claimed with a CAS on the
+/// read position, so it never races with the consumer. At most an element is dropped for each pushed one.
+/// Once the consumer stops (e.g. on error), it closes the queue: the producer is woken and the new elements are
+/// discarded, so it never waits for a slot which would not be freed.
+class SourceQueue {
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        std::unique_ptr<ProcessContext> context;
+        // Written and read only by the producer, so it can be checked before claiming the slot
+        bool isDisposable;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    uint64_t capacity;
+    uint64_t mask;
+
+    SourceQueueOverflowPolicy overflowPolicy;
+
+    alignas(64) std::atomic<uint64_t> writePosition;
+    alignas(64) std::atomic<uint64_t> readPosition;
+
+    std::mutex parkingMutex;
+    std::condition_variable notFullCV;
+    std::atomic<bool> isProducerParked;
+    std::atomic<bool> isClosed;
+
+    std::atomic<uint64_t> maxDepth;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> blocked;
+
+    bool try_push(std::unique_ptr<ProcessContext> &context);
+
+    std::unique_ptr<ProcessContext> try_pop();
+
+    bool push_dropping_oldest(std::unique_ptr<ProcessContext> &context);
+
+    void wake_producer();
+
+public:
+    SourceQueue(uint64_t capacity, SourceQueueOverflowPolicy overflowPolicy);
+
+    void push(std::unique_ptr<ProcessContext> context);
+
+    std::unique_ptr<ProcessContext> pop();
+
+    void close();
+
+    [[nodiscard]] bool is_closed() const { return isClosed.load(std::memory_order_acquire); };
+
+    [[nodiscard]] uint64_t size() const;
+
+    [[nodiscard]] uint64_t get_capacity() const { return capacity; };
+
+    [[nodiscard]] SourceQueueStats get_stats() const;
+
+    ~SourceQueue() = default;
+};
+
+#endif //PDS_SCREEN_RECORDING_SOURCE_QUEUE_H
@@ -0,0 +1,356 @@
+#include "spill_buffer.h"
+#include <fmt/core.h>
+#include <cerrno>
+#include <cstring>
+#include "../error.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+enum SpillRecordType : uint32_t {
+    SPILL_RECORD_PACKET,
+    SPILL_RECORD_FRAME,
+    SPILL_RECORD_END_OF_STREAM
+};
+
+/// Record header, followed by the frame damage regions and by the packet data or the tightly packed frame image
+struct SpillRecordHeader {
+    SpillRecordType type;
+    uint32_t regionsCount;
+    uint64_t size; // Whole record size, header included
+    int64_t pts;
+    int64_t enqueueTime; // Steady clock ticks
+    uint64_t sourceIndex;
+    uint8_t isDisposable;
+    uint8_t isRepeated;
+    uint8_t hasCursorArea;
+    int32_t dataSize;
+
+    // Packet properties
+    int64_t packetPts;
+    int64_t packetDts;
+    int64_t packetDuration;
+    int32_t packetFlags;
+    int32_t packetStreamIndex;
+
+    // Frame properties
+    int32_t frameFormat;
+    int32_t frameWidth;
+    int32_t frameHeight;
+    int32_t cursorArea[4];
+};
+
+/// Returns the message of the last system error
+static std::string last_system_error() {
+    return std::strerror(errno);
+}
+
+/// Creates the spill file in the passed directory
+SpillBuffer::SpillBuffer(const std::string &directory, std::shared_ptr<FramePool> framePool)
+        : fileDescriptor(-1),
+          fileSize(0),
+          framePool(std::move(framePool)),
+          writePosition(0),
+          readPosition(0),
+          isWriting(false),
+          spilledSources(0),
+          spilledBytes(0),
+          pendingBytes(0),
+          maxPendingBytes(0) {
+#ifdef _WIN32
+    throw std::runtime_error(
+            Error::build_error_message(__FUNCTION__, {}, "spilling to disk is not supported on this platform"));
+#else
+    std::string path = directory + "/screen-recorder-spill-XXXXXX";
+    fileDescriptor = mkstemp(path.data());
+    if (fileDescriptor < 0) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error creating the spill file in '{}' ({})",
+                                                       directory, last_system_error())));
+    }
+    unlink(path.c_str());
+#endif
+}
+
+/// Maps the passed range of the spill file. The mapping starts from the page including the range start, whose
+/// offset is returned.
+uint8_t *SpillBuffer::map_record(uint64_t position, uint64_t size, uint64_t &mappingOffset) {
+#ifdef _WIN32
+    return nullptr;
+#else
+    auto pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+    mappingOffset = position % pageSize;
+    void *mapping = mmap(nullptr, size + mappingOffset, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor,
+                         (off_t) (position - mappingOffset));
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error mapping the spill file ({})", last_system_error())));
+    }
+    return (uint8_t *) mapping + mappingOffset;
+#endif
+}
+
+void SpillBuffer::unmap_record(uint8_t *mapping, uint64_t size, uint64_t mappingOffset) {
+#ifndef _WIN32
+    munmap(mapping - mappingOffset, size + mappingOffset);
+#endif
+}
+
+/// Releases the record reserved by a failed push, so that the file can be reused from its beginning.
+void SpillBuffer::cancel_write() {
+    std::lock_guard<std::mutex> lock(positionsMutex);
+    isWriting = false;
+    if (readPosition == writePosition) {
+        readPosition = 0;
+        writePosition = 0;
+    }
+}
+
+/// Appends a source to the spill file.
+/// It must be called only by the producer.
+void SpillBuffer::push(std::unique_ptr<ProcessContext> context) {
+    SpillRecordHeader header = {};
+    header.pts = context->sourcePacketPts;
+    header.enqueueTime = context->enqueueTime.time_since_epoch().count();
+    header.sourceIndex = context->sourceIndex;
+    header.isDisposable = context->isDisposable;
+
+    const auto &regions = context->sourceFrameDamage.regions;
+    AVFrame *frame = context->sourceFrame.get();
+    AVPacket *packet = context->sourcePacket.get();
+    if (context->isEndOfStream) {
+        header.type = SPILL_RECORD_END_OF_STREAM;
+    } else if (frame) {
+        header.type = SPILL_RECORD_FRAME;
+        header.regionsCount = regions.size();
+        header.isRepeated = context->sourceFrameDamage.isRepeated;
+        if (context->sourceFrameDamage.cursorArea) {
+            auto [x, y, width, height] = *context->sourceFrameDamage.cursorArea;
+            header.hasCursorArea = true;
+            header.cursorArea[0] = x;
+            header.cursorArea[1] = y;
+            header.cursorArea[2] = width;
+            header.cursorArea[3] = height;
+        }
+        header.frameFormat = frame->format;
+        header.frameWidth = frame->width;
+        header.frameHeight = frame->height;
+        header.dataSize = av_image_get_buffer_size((AVPixelFormat) frame->format, frame->width, frame->height, 1);
+        if (header.dataSize < 0) {
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {},
+                                               fmt::format("error calculating the spilled frame size ({})",
+                                                           Error::unpackAVError(header.dataSize))));
+        }
+    } else {
+        header.type = SPILL_RECORD_PACKET;
+        header.packetPts = packet->pts;
+        header.packetDts = packet->dts;
+        header.packetDuration = packet->duration;
+        header.packetFlags = packet->flags;
+        header.packetStreamIndex = packet->stream_index;
+        header.dataSize = packet->size;
+    }
+
+    uint64_t regionsSize = header.regionsCount * 4 * sizeof(int32_t);
+    header.size = FFALIGN(sizeof(SpillRecordHeader) + regionsSize + header.dataSize, 8);
+
+    // Reserve the record, growing the file if needed
+    uint64_t position;
+    {
+        std::lock_guard<std::mutex> lock(positionsMutex);
+        position = writePosition;
+        isWriting = true;
+    }
+    if (position + header.size > fileSize) {
+        uint64_t newFileSize = FFALIGN(position + header.size, SPILL_FILE_GROWTH);
+#ifndef _WIN32
+        if (ftruncate(fileDescriptor, (off_t) newFileSize) < 0) {
+            cancel_write();
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {},
+                                               fmt::format("error growing the spill file ({})",
+                                                           last_system_error())));
+        }
+#endif
+        fileSize = newFileSize;
+    }
+
+    uint64_t mappingOffset;
+    uint8_t *record;
+    try {
+        record = map_record(position, header.size, mappingOffset);
+    } catch (...) {
+        cancel_write();
+        throw;
+    }
+    std::memcpy(record, &header, sizeof(SpillRecordHeader));
+
+    auto *regionsData = (int32_t *) (record + sizeof(SpillRecordHeader));
+    for (const auto &[x, y, width, height]: regions) {
+        *regionsData++ = x;
+        *regionsData++ = y;
+        *regionsData++ = width;
+        *regionsData++ = height;
+    }
+
+    uint8_t *data = record + sizeof(SpillRecordHeader) + regionsSize;
+    int ret = 0;
+    if (header.type == SPILL_RECORD_FRAME) {
+        ret = av_image_copy_to_buffer(data, header.dataSize, frame->data, frame->linesize,
+                                      (AVPixelFormat) frame->format, frame->width, frame->height, 1);
+    } else if (header.type == SPILL_RECORD_PACKET && header.dataSize > 0) {
+        std::memcpy(data, packet->data, header.dataSize);
+    }
+    unmap_record(record, header.size, mappingOffset);
+    if (ret < 0) {
+        cancel_write();
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("error copying the frame to the spill file ({})",
+                                                       Error::unpackAVError(ret))));
+    }
+
+    // The pending bytes are counted before publishing the record, so the consumer never subtracts them first
+    uint64_t pending;
+    {
+        std::lock_guard<std::mutex> lock(positionsMutex);
+        pending = pendingBytes += header.size;
+        writePosition = position + header.size;
+        isWriting = false;
+    }
+
+    spilledSources++;
+    spilledBytes += header.size;
+    if (pending > maxPendingBytes)
+        maxPendingBytes = pending;
+}
+
+/// Reads back the oldest spilled source. Returns nullptr if no source has been spilled.
+/// It must be called only by the consumer.
+std::unique_ptr<ProcessContext> SpillBuffer::pop() {
+    uint64_t position;
+    {
+        std::lock_guard<std::mutex> lock(positionsMutex);
+        if (readPosition == writePosition)
+            return nullptr;
+        position = readPosition;
+    }
+
+    // The header is read first, to know the size of the record
+    uint64_t mappingOffset;
+    uint8_t *headerMapping = map_record(position, sizeof(SpillRecordHeader), mappingOffset);
+    SpillRecordHeader header;
+    std::memcpy(&header, headerMapping, sizeof(SpillRecordHeader));
+    unmap_record(headerMapping, sizeof(SpillRecordHeader), mappingOffset);
+
+    uint8_t *record = map_record(position, header.size, mappingOffset);
+    uint64_t regionsSize = header.regionsCount * 4 * sizeof(int32_t);
+    uint8_t *data = record + sizeof(SpillRecordHeader) + regionsSize;
+
+    std::unique_ptr<ProcessContext> context;
+    try {
+        if (header.type == SPILL_RECORD_END_OF_STREAM) {
+            context = ProcessContext::end_of_stream();
+        } else if (header.type == SPILL_RECORD_FRAME) {
+            FrameDamage damage;
+            damage.isRepeated = header.isRepeated;
+            if (header.hasCursorArea) {
+                damage.cursorArea = {header.cursorArea[0], header.cursorArea[1], header.cursorArea[2],
+                                     header.cursorArea[3]};
+            }
+            auto *regionsData = (int32_t *) (record + sizeof(SpillRecordHeader));
+            for (uint32_t i = 0; i < header.regionsCount; i++, regionsData += 4) {
+                damage.regions.emplace_back(regionsData[0], regionsData[1], regionsData[2], regionsData[3]);
+            }
+
+            auto frame = std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(av_frame_alloc());
+            if (!frame) {
+                throw std::runtime_error(
+                        Error::build_error_message(__FUNCTION__, {}, "error allocating a new frame"));
+            }
+            frame->format = header.frameFormat;
+            frame->width = header.frameWidth;
+            frame->height = header.frameHeight;
+            int ret = av_frame_get_buffer(frame.get(), 0);
+            if (ret < 0) {
+                throw std::runtime_error(
+                        Error::build_error_message(__FUNCTION__, {},
+                                                   fmt::format("error allocating the spilled frame buffer ({})",
+                                                               Error::unpackAVError(ret))));
+            }
+
+            uint8_t *imageData[4];
+            int imageLinesize[4];
+            av_image_fill_arrays(imageData, imageLinesize, data, (AVPixelFormat) header.frameFormat,
+                                 header.frameWidth, header.frameHeight, 1);
+            av_image_copy(frame->data, frame->linesize, (const uint8_t **) imageData, imageLinesize,
+                          (AVPixelFormat) header.frameFormat, header.frameWidth, header.frameHeight);
+
+            context = std::make_unique<ProcessContext>(std::move(frame), std::move(damage), header.pts);
+        } else {
+            auto packet = framePool->get_packet();
+            int ret = av_new_packet(packet.get(), header.dataSize);
+            if (ret < 0) {
+                throw std::runtime_error(
+                        Error::build_error_message(__FUNCTION__, {},
+                                                   fmt::format("error allocating the spilled packet ({})",
+                                                               Error::unpackAVError(ret))));
+            }
+            if (header.dataSize > 0)
+                std::memcpy(packet->data, data, header.dataSize);
+            packet->pts = header.packetPts;
+            packet->dts = header.packetDts;
+            packet->duration = header.packetDuration;
+            packet->flags = header.packetFlags;
+            packet->stream_index = header.packetStreamIndex;
+
+            context = std::make_unique<ProcessContext>(std::move(packet), header.pts);
+        }
+    } catch (...) {
+        unmap_record(record, header.size, mappingOffset);
+        throw;
+    }
+    unmap_record(record, header.size, mappingOffset);
+
+    context->sourceIndex = header.sourceIndex;
+    context->isDisposable = header.isDisposable;
+    context->enqueueTime = std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(header.enqueueTime));
+
+    // Once all the records have been read, the file is reused from its beginning
+    {
+        std::lock_guard<std::mutex> lock(positionsMutex);
+        readPosition = position + header.size;
+        if (readPosition == writePosition && !isWriting) {
+            readPosition = 0;
+            writePosition = 0;
+        }
+    }
+    pendingBytes -= header.size;
+
+    return context;
+}
+
+SpillBufferStats SpillBuffer::get_stats() const {
+    return {.spilledSources = spilledSources,
+            .spilledBytes = spilledBytes,
+            .pendingBytes = pendingBytes,
+            .maxPendingBytes = maxPendingBytes};
+}
+
+SpillBuffer::~SpillBuffer() {
+#ifndef _WIN32
+    if (fileDescriptor >= 0)
+        close(fileDescriptor);
+#endif
+}
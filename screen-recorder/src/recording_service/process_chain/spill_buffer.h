@@ -0,0 +1,68 @@
+#ifndef PDS_SCREEN_RECORDING_SPILL_BUFFER_H
+#define PDS_SCREEN_RECORDING_SPILL_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "frame_pool.h"
+#include "process_context.h"
+
+// The spill file grows by this number of bytes at a time
+const uint64_t SPILL_FILE_GROWTH = 256 * 1024 * 1024;
+
+struct SpillBufferStats {
+    uint64_t spilledSources;  // Sources written to the spill file
+    uint64_t spilledBytes;    // Bytes written to the spill file
+    uint64_t pendingBytes;    // Bytes written and not yet read back
+    uint64_t maxPendingBytes; // Highest number of pending bytes
+};
+
+/// Overflow buffer which keeps the sources of a process chain in a memory-mapped file, when they exceed the chain
+/// memory budget.
+/// Sources (raw frames, packets and the end of stream sentinel) are serialized as records appended to the file, and
+/// read back in the same order. Each side maps just the record it is copying, so writing and reading never wait for
+/// each other's copy; the mutex only guards the positions. Once all the records have been read back, the file is
+/// reused from its beginning.
+/// It must be used by a single producer and a single consumer. The file is deleted as soon as it is created, so it
+/// doesn't outlive the recording, even on crashes.
+class SpillBuffer {
+    int fileDescriptor;
+    uint64_t fileSize;
+
+    std::shared_ptr<FramePool> framePool;
+
+    std::mutex positionsMutex;
+    // Start of the record being written: records before it have been completely written
+    uint64_t writePosition;
+    uint64_t readPosition;
+    // The producer is writing a record at the write position
+    bool isWriting;
+
+    std::atomic<uint64_t> spilledSources;
+    std::atomic<uint64_t> spilledBytes;
+    std::atomic<uint64_t> pendingBytes;
+    std::atomic<uint64_t> maxPendingBytes;
+
+    uint8_t *map_record(uint64_t position, uint64_t size, uint64_t &mappingOffset);
+
+    static void unmap_record(uint8_t *mapping, uint64_t size, uint64_t mappingOffset);
+
+    void cancel_write();
+
+public:
+    SpillBuffer(const std::string &directory, std::shared_ptr<FramePool> framePool);
+
+    void push(std::unique_ptr<ProcessContext> context);
+
+    std::unique_ptr<ProcessContext> pop();
+
+    [[nodiscard]] bool empty() const { return pendingBytes == 0; };
+
+    [[nodiscard]] SpillBufferStats get_stats() const;
+
+    ~SpillBuffer();
+};
+
+#endif //PDS_SCREEN_RECORDING_SPILL_BUFFER_H
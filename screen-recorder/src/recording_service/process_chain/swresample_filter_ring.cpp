@@ -3,7 +3,8 @@
 #include "../error.h"
 
 /// Initializes a resample filter, used to convert an input audio decoded frame to the output format
-SWResampleFilterRing::SWResampleFilterRing(SWResampleConfig swResampleConfig) : config(swResampleConfig) {
+SWResampleFilterRing::SWResampleFilterRing(SWResampleConfig swResampleConfig, std::shared_ptr<FramePool> framePool)
+        : config(swResampleConfig), framePool(std::move(framePool)) {
     // Allocate audio converter context
     swrContext = std::unique_ptr<SwrContext, FFMpegObjectsDeleter>(swr_alloc_set_opts(nullptr,
                                                                                       config.outputChannelLayout,
@@ -38,22 +39,14 @@ SWResampleFilterRing::SWResampleFilterRing(SWResampleConfig swResampleConfig) :
 
 /// Processes an input frame and passes it to the next ring
 void SWResampleFilterRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    // The converted samples are buffered in a pooled frame
+    auto audioData = framePool->get_audio_frame(config.outputSampleFormat, config.outputChannels,
+                                                config.outputChannelLayout, config.outputSampleRate,
+                                                inputFrame->nb_samples);
 
-    uint8_t **tempBuffer;
-    int ret = av_samples_alloc_array_and_samples(&tempBuffer, nullptr, config.outputChannels,
-                                                 inputFrame->nb_samples, config.outputSampleFormat, 0);
-    if (ret < 0) {
-        throw std::runtime_error(
-                Error::build_error_message(__FUNCTION__, {},
-                                           fmt::format("error allocating input audio buffers ({})",
-                                                       Error::unpackAVError(ret))));
-    }
-
-    auto audioData = std::unique_ptr<uint8_t **, FFMpegObjectsDeleter>(&tempBuffer);
-
-    ret = swr_convert(swrContext.get(), *audioData, inputFrame->nb_samples,
-                      (const uint8_t **) (inputFrame->extended_data),
-                      inputFrame->nb_samples);
+    int ret = swr_convert(swrContext.get(), audioData->extended_data, inputFrame->nb_samples,
+                          (const uint8_t **) (inputFrame->extended_data),
+                          inputFrame->nb_samples);
     if (ret < 0) {
         throw std::runtime_error(
                 Error::build_error_message(__FUNCTION__, {},
@@ -65,7 +58,7 @@ void SWResampleFilterRing::execute(ProcessContext *processContext, AVFrame *inpu
         throw std::runtime_error(
                 Error::build_error_message(__FUNCTION__, {}, "the provided input audio buffer is too small"));
 
-    ret = av_audio_fifo_write(outputBuffer.get(), (void **) *audioData, inputFrame->nb_samples);
+    ret = av_audio_fifo_write(outputBuffer.get(), (void **) audioData->extended_data, inputFrame->nb_samples);
     if (ret < 0) {
         throw std::runtime_error(
                 Error::build_error_message(__FUNCTION__, {},
@@ -76,31 +69,15 @@ void SWResampleFilterRing::execute(ProcessContext *processContext, AVFrame *inpu
     int64_t framePts = processContext->sourcePacketPts;
     int64_t frameOffset = 0;
     while (av_audio_fifo_size(outputBuffer.get()) >= config.outputFrameSize) {
-        auto convertedFrame = std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(av_frame_alloc());
-        if (!convertedFrame) {
-            throw std::runtime_error(
-                    Error::build_error_message(__FUNCTION__, {}, "error allocating a new frame"));
-        }
-
         // Build frame from buffer
-        convertedFrame->nb_samples = config.outputFrameSize;
-        convertedFrame->channels = config.outputChannels;
-        convertedFrame->channel_layout = config.outputChannelLayout;
-        convertedFrame->format = config.outputSampleFormat;
-        convertedFrame->sample_rate = config.outputSampleRate;
+        auto convertedFrame = framePool->get_audio_frame(config.outputSampleFormat, config.outputChannels,
+                                                         config.outputChannelLayout, config.outputSampleRate,
+                                                         config.outputFrameSize);
 
         // Calculate converted frame pts
         processContext->sourcePacketPts = framePts + frameOffset;
         frameOffset += av_rescale_q(config.outputFrameSize, config.outputTimeBase, config.inputTimeBase);
 
-        ret = av_frame_get_buffer(convertedFrame.get(), 0);
-        if (ret < 0) {
-            throw std::runtime_error(
-                    Error::build_error_message(__FUNCTION__, {},
-                                               fmt::format("error allocating the converted frame audio buffer ({})",
-                                                           Error::unpackAVError(ret))));
-        }
-
         ret = av_audio_fifo_read(outputBuffer.get(), (void **) convertedFrame->data, config.outputFrameSize);
         if (ret < 0) {
             throw std::runtime_error(
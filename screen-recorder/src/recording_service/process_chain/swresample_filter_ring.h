@@ -2,6 +2,7 @@
 #define PDS_SCREEN_RECORDING_SWRESAMPLE_FILTER_RING_H
 
 #include "filter_ring.h"
+#include "frame_pool.h"
 #include "../ffmpeg_objects_deleter.h"
 
 extern "C" {
@@ -28,9 +29,11 @@ struct SWResampleConfig {
 class SWResampleFilterRing : public FilterChainRing {
     std::unique_ptr<SwrContext,FFMpegObjectsDeleter> swrContext;
     SWResampleConfig config;
+
+    std::shared_ptr<FramePool> framePool;
     std::unique_ptr<AVAudioFifo,FFMpegObjectsDeleter> outputBuffer;
 public:
-    explicit SWResampleFilterRing(SWResampleConfig config);
+    SWResampleFilterRing(SWResampleConfig config, std::shared_ptr<FramePool> framePool);
 
     ~SWResampleFilterRing() override = default;
 
@@ -1,52 +1,303 @@
 #include "swscale_filter_ring.h"
 #include <fmt/core.h>
+#include <algorithm>
 #include "../error.h"
 
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+// Rows bands (damaged rows or slices) are converted aligned to this number of rows, so that the converter dithering
+// pattern is the same used for the whole frame.
+const int BAND_ALIGNMENT = 32;
+// Rows converted above and below each band and then discarded, so that the vertical filter taps of the band rows see
+// the same input rows as in a whole frame conversion.
+const int BAND_MARGIN = 32;
+
 /// Initializes a scale filter, used to scale an input video decoded frame to the output format
-SWScaleFilterRing::SWScaleFilterRing(SWScaleConfig swScaleConfig)
-        : config(swScaleConfig) {
-    swsContext = std::unique_ptr<SwsContext, FFMpegObjectsDeleter>(sws_getContext(config.inputWidth, config.inputHeight,
+SWScaleFilterRing::SWScaleFilterRing(SWScaleConfig swScaleConfig, std::shared_ptr<TaskExecutor> executor,
+                                     std::shared_ptr<FramePool> framePool)
+        : config(swScaleConfig), framePool(std::move(framePool)), baseScalingFlags(get_scaling_flags(config)),
+          scalingFlags(baseScalingFlags), requestedScalingFlags(baseScalingFlags) {
+    if (config.cropX < 0 || config.cropY < 0 || config.cropWidth <= 0 || config.cropHeight <= 0 ||
+        config.cropX + config.cropWidth > config.inputWidth || config.cropY + config.cropHeight > config.inputHeight) {
+        throw std::runtime_error(
+                Error::build_error_message(__FUNCTION__, {},
+                                           fmt::format("crop area {}x{}+{}+{} is out of the {}x{} input",
+                                                       config.cropWidth, config.cropHeight, config.cropX,
+                                                       config.cropY, config.inputWidth, config.inputHeight)));
+    }
+
+    // Offsets of the crop origin in each plane: chroma planes are subsampled
+    auto pixelFormatDescriptor = av_pix_fmt_desc_get(config.inputPixelFormat);
+    int pixelSteps[4];
+    av_image_fill_max_pixsteps(pixelSteps, nullptr, pixelFormatDescriptor);
+    for (int plane = 0; plane < 4; plane++) {
+        int shift = (plane == 1 || plane == 2) ? pixelFormatDescriptor->log2_chroma_w : 0;
+        cropOffsets[plane] = (config.cropX >> shift) * pixelSteps[plane];
+    }
+
+    // Split the frame in slices, if no resize happens
+    bool isResized = config.cropWidth != config.outputWidth || config.cropHeight != config.outputHeight;
+    if (!isResized && config.sliceCount > 1) {
+        int sliceHeight = FFALIGN((config.cropHeight + config.sliceCount - 1) / config.sliceCount, BAND_ALIGNMENT);
+        for (int top = 0; top < config.cropHeight; top += sliceHeight) {
+            int bottom = std::min(top + sliceHeight, config.cropHeight);
+            int bandHeight = std::min(bottom + BAND_MARGIN, config.cropHeight) - std::max(top - BAND_MARGIN, 0);
+            slices.push_back({top, bottom, nullptr, allocate_frame(bandHeight)});
+        }
+        for (int i = 1; i < slices.size(); i++) {
+            sliceWorkers.push_back(std::make_unique<PipelineStage>(executor, 1));
+        }
+    }
+
+    init_contexts();
+}
+
+/// Initializes the whole frame and the slices converters with the current scaling flags.
+/// Damaged rows converters are initialized on demand.
+void SWScaleFilterRing::init_contexts() {
+    swsContext = std::unique_ptr<SwsContext, FFMpegObjectsDeleter>(sws_getContext(config.cropWidth, config.cropHeight,
                                                                                   config.inputPixelFormat,
                                                                                   config.outputWidth,
                                                                                   config.outputHeight,
                                                                                   config.outputPixelFormat,
-                                                                                  SWS_BICUBIC, nullptr, nullptr,
+                                                                                  scalingFlags, nullptr, nullptr,
                                                                                   nullptr));
     if (!swsContext) {
         throw std::runtime_error(Error::build_error_message(
                 __FUNCTION__, {}, "error initializing video converter"));
     }
+
+    for (auto &slice: slices) {
+        slice.context = init_band_context(slice.frame->height);
+    }
+    bandContexts.clear();
 }
 
-/// Processes an input frame and passes it to the next ring
-void SWScaleFilterRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
-    auto convertedFrame = std::unique_ptr<AVFrame, FFMpegObjectsDeleter>(av_frame_alloc());
-    if (!convertedFrame) {
-        throw std::runtime_error(
-                Error::build_error_message(__FUNCTION__, {}, "error allocating a new frame"));
+/// Returns the swscale flags of the configured scaling algorithm, or of point sampling if no resize happens
+int SWScaleFilterRing::get_scaling_flags(const SWScaleConfig &config) {
+    bool isResized = config.cropWidth != config.outputWidth || config.cropHeight != config.outputHeight;
+    if (!isResized)
+        return SWS_POINT;
+
+    switch (config.scalingAlgorithm) {
+        case SCALING_POINT:
+            return SWS_POINT;
+        case SCALING_FAST_BILINEAR:
+            return SWS_FAST_BILINEAR;
+        case SCALING_BILINEAR:
+            return SWS_BILINEAR;
+        case SCALING_LANCZOS:
+            return SWS_LANCZOS;
+        case SCALING_BICUBIC:
+        default:
+            return SWS_BICUBIC;
     }
+}
 
-    convertedFrame->format = config.outputPixelFormat;
-    convertedFrame->width = config.outputWidth;
-    convertedFrame->height = config.outputHeight;
+/// Selects the fast bilinear scaling algorithm instead of the configured one, if this is more expensive.
+/// The change is applied on the next frame.
+void SWScaleFilterRing::setFastScaling(bool isFastScaling) {
+    requestedScalingFlags = isFastScaling && hasFasterScaling() ? SWS_FAST_BILINEAR : baseScalingFlags;
+}
 
-    int ret = av_frame_get_buffer(convertedFrame.get(), 0);
-    if (ret < 0) {
-        throw std::runtime_error(
-                Error::build_error_message(__FUNCTION__, {},
-                                           fmt::format("error allocating the converted frame video buffer ({})",
-                                                       Error::unpackAVError(ret))));
+/// Returns true if setFastScaling can select a cheaper algorithm than the configured one: it can't if no resize
+/// happens, as point sampling is used.
+bool SWScaleFilterRing::hasFasterScaling() const {
+    return baseScalingFlags != SWS_POINT && baseScalingFlags != SWS_FAST_BILINEAR;
+}
+
+/// Returns a new frame with the output width and pixel format, and the passed height
+PooledFrame SWScaleFilterRing::allocate_frame(int height) {
+    return framePool->get_video_frame(config.outputPixelFormat, config.outputWidth, height);
+}
+
+/// Initializes a converter for a rows band of the passed height
+std::unique_ptr<SwsContext, FFMpegObjectsDeleter> SWScaleFilterRing::init_band_context(int bandHeight) {
+    auto bandContext = std::unique_ptr<SwsContext, FFMpegObjectsDeleter>(
+            sws_getContext(config.cropWidth, bandHeight, config.inputPixelFormat, config.outputWidth, bandHeight,
+                           config.outputPixelFormat, scalingFlags, nullptr, nullptr, nullptr));
+    if (!bandContext) {
+        throw std::runtime_error(Error::build_error_message(
+                __FUNCTION__, {}, "error initializing video band converter"));
+    }
+    return bandContext;
+}
+
+/// Returns the converter for a damaged rows band of the passed height, initializing it if needed
+SwsContext *SWScaleFilterRing::get_band_context(int bandHeight) {
+    auto &bandContext = bandContexts[bandHeight];
+    if (!bandContext) {
+        bandContext = init_band_context(bandHeight);
+    }
+    return bandContext.get();
+}
+
+/// Returns the pointers to the input frame planes, starting from the passed row of the crop area
+void SWScaleFilterRing::get_input_planes(AVFrame *inputFrame, int row, uint8_t *planes[4]) {
+    auto pixelFormatDescriptor = av_pix_fmt_desc_get((AVPixelFormat) inputFrame->format);
+    for (int plane = 0; plane < 4; plane++) {
+        if (!inputFrame->data[plane]) {
+            planes[plane] = nullptr;
+            continue;
+        }
+        int planeRow = config.cropY + row;
+        if (plane == 1 || plane == 2)
+            planeRow >>= pixelFormatDescriptor->log2_chroma_h;
+        planes[plane] = inputFrame->data[plane] + planeRow * inputFrame->linesize[plane] + cropOffsets[plane];
     }
+}
+
+/// Converts the rows [top, bottom) of the input frame into the last converted frame.
+/// The band is converted with its margins into the band frame, starting from its first row, then only the band rows
+/// are copied. The band context must be sized as the band with its margins.
+void SWScaleFilterRing::convert_band(SwsContext *bandContext, AVFrame *inputFrame, int top, int bottom,
+                                     AVFrame *bandFrame) {
+    int bandTop = std::max(top - BAND_MARGIN, 0);
+    int bandBottom = std::min(bottom + BAND_MARGIN, config.cropHeight);
 
-    ret = sws_scale(swsContext.get(), inputFrame->data, inputFrame->linesize, 0,
-                    inputFrame->height, convertedFrame->data, convertedFrame->linesize);
+    uint8_t *inputPlanes[4];
+    get_input_planes(inputFrame, bandTop, inputPlanes);
+
+    int ret = sws_scale(bandContext, inputPlanes, inputFrame->linesize, 0, bandBottom - bandTop, bandFrame->data,
+                        bandFrame->linesize);
     if (ret < 0) {
         throw std::runtime_error(
                 Error::build_error_message(__FUNCTION__, {},
-                                           fmt::format("error converting the input video frame ({})",
+                                           fmt::format("error converting the input video frame band ({})",
                                                        Error::unpackAVError(ret))));
     }
 
+    // Copy the band rows, without the margins, to the converted frame
+    auto pixelFormatDescriptor = av_pix_fmt_desc_get(config.outputPixelFormat);
+    for (int plane = 0; plane < 4 && lastConvertedFrame->data[plane]; plane++) {
+        int shift = (plane == 1 || plane == 2) ? pixelFormatDescriptor->log2_chroma_h : 0;
+        int planeTop = top >> shift;
+        int planeBottom = -((-bottom) >> shift);
+        int bandPlaneTop = bandTop >> shift;
+        av_image_copy_plane(lastConvertedFrame->data[plane] + planeTop * lastConvertedFrame->linesize[plane],
+                            lastConvertedFrame->linesize[plane],
+                            bandFrame->data[plane] + (planeTop - bandPlaneTop) * bandFrame->linesize[plane],
+                            bandFrame->linesize[plane],
+                            av_image_get_linesize(config.outputPixelFormat, config.outputWidth, plane),
+                            planeBottom - planeTop);
+    }
+}
+
+/// Converts only the damaged rows of the input frame, updating the last converted frame.
+/// It must be used only when the crop area and the output frames have the same size.
+void SWScaleFilterRing::convert_damaged_rows(AVFrame *inputFrame,
+                                             const std::vector<std::tuple<int, int, int, int>> &regions) {
+    // Find the damaged rows bands of the crop area, aligned and merged
+    std::vector<std::pair<int, int>> bands;
+    for (const auto &[x, y, width, height]: regions) {
+        int top = std::max(y - config.cropY, 0);
+        int bottom = std::min(y + height - config.cropY, config.cropHeight);
+        bool isCropped = x + width <= config.cropX || x >= config.cropX + config.cropWidth;
+        if (width <= 0 || bottom <= top || isCropped)
+            continue;
+        bands.emplace_back(top - top % BAND_ALIGNMENT,
+                           std::min(FFALIGN(bottom, BAND_ALIGNMENT), config.cropHeight));
+    }
+    std::sort(bands.begin(), bands.end());
+
+    std::vector<std::pair<int, int>> mergedBands;
+    for (const auto &band: bands) {
+        if (!mergedBands.empty() && band.first <= mergedBands.back().second)
+            mergedBands.back().second = std::max(mergedBands.back().second, band.second);
+        else
+            mergedBands.push_back(band);
+    }
+
+    // The last converted frame could still be referenced by the next rings: in that case it is copied
+    if (!av_frame_is_writable(lastConvertedFrame.get())) {
+        auto frame = allocate_frame(config.outputHeight);
+        int ret = av_frame_copy(frame.get(), lastConvertedFrame.get());
+        if (ret < 0) {
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {},
+                                               fmt::format("error copying the converted frame ({})",
+                                                           Error::unpackAVError(ret))));
+        }
+        lastConvertedFrame = std::move(frame);
+    }
+
+    if (!bandsFrame)
+        bandsFrame = allocate_frame(config.outputHeight);
+
+    for (const auto &[top, bottom]: mergedBands) {
+        int bandHeight = std::min(bottom + BAND_MARGIN, config.cropHeight) - std::max(top - BAND_MARGIN, 0);
+        convert_band(get_band_context(bandHeight), inputFrame, top, bottom, bandsFrame.get());
+    }
+}
+
+/// Converts the whole input frame into a new converted frame, one slice per thread.
+/// Slices write disjoint rows of the converted frame, using their own converter and scratch frame.
+void SWScaleFilterRing::convert_slices(AVFrame *inputFrame) {
+    lastConvertedFrame = allocate_frame(config.outputHeight);
+
+    for (int i = 1; i < slices.size(); i++) {
+        sliceWorkers[i - 1]->submit([this, i, inputFrame]() {
+            convert_band(slices[i].context.get(), inputFrame, slices[i].top, slices[i].bottom, slices[i].frame.get());
+        });
+    }
+
+    // The input frame must not be released until all the slices have been converted, even on errors
+    std::exception_ptr error;
+    try {
+        convert_band(slices[0].context.get(), inputFrame, slices[0].top, slices[0].bottom, slices[0].frame.get());
+    } catch (...) {
+        error = std::current_exception();
+    }
+    for (auto &sliceWorker: sliceWorkers) {
+        try {
+            sliceWorker->drain();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+/// Processes an input frame and passes it to the next ring
+void SWScaleFilterRing::execute(ProcessContext *processContext, AVFrame *inputFrame) {
+    const FrameDamage &damage = processContext->sourceFrameDamage;
+    bool isResized = config.cropWidth != config.outputWidth || config.cropHeight != config.outputHeight;
+
+    // The last converted frame is discarded, so that the frame is not mixed from two algorithms
+    if (requestedScalingFlags != scalingFlags) {
+        scalingFlags = requestedScalingFlags;
+        init_contexts();
+        lastConvertedFrame = nullptr;
+    }
+
+    if (lastConvertedFrame && damage.isRepeated) {
+        // Nothing changed: the last converted frame is passed again
+    } else if (lastConvertedFrame && !isResized && !damage.regions.empty()) {
+        convert_damaged_rows(inputFrame, damage.regions);
+    } else if (!slices.empty()) {
+        convert_slices(inputFrame);
+    } else {
+        lastConvertedFrame = allocate_frame(config.outputHeight);
+
+        uint8_t *inputPlanes[4];
+        get_input_planes(inputFrame, 0, inputPlanes);
+        int ret = sws_scale(swsContext.get(), inputPlanes, inputFrame->linesize, 0, config.cropHeight,
+                            lastConvertedFrame->data, lastConvertedFrame->linesize);
+        if (ret < 0) {
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {},
+                                               fmt::format("error converting the input video frame ({})",
+                                                           Error::unpackAVError(ret))));
+        }
+    }
+
+    auto convertedFrame = framePool->clone_frame(lastConvertedFrame.get());
+
     // Pass the converted frame to the next ring
     if (std::holds_alternative<std::shared_ptr<FilterChainRing>>(getNext())) {
         std::get<std::shared_ptr<FilterChainRing>>(getNext())->execute(processContext,
@@ -55,4 +306,4 @@ void SWScaleFilterRing::execute(ProcessContext *processContext, AVFrame *inputFr
         std::get<std::shared_ptr<EncoderChainRing>>(getNext())->execute(processContext,
                                                                         convertedFrame.get());
     }
-}
\ No newline at end of file
+}
@@ -1,31 +1,120 @@
 #ifndef PDS_SCREEN_RECORDING_SWSCALE_FILTER_RING_H
 #define PDS_SCREEN_RECORDING_SWSCALE_FILTER_RING_H
 
+#include <atomic>
+#include <map>
 #include "filter_ring.h"
+#include "pipeline_stage.h"
+#include "frame_pool.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 }
 
+/// Scaling algorithms, from the cheapest to the sharpest
+enum ScalingAlgorithm {
+    SCALING_POINT,         // Nearest neighbour
+    SCALING_FAST_BILINEAR, // Bilinear, with a lower precision
+    SCALING_BILINEAR,
+    SCALING_BICUBIC,
+    SCALING_LANCZOS
+};
+
 struct SWScaleConfig {
     int inputWidth;
     int inputHeight;
     AVPixelFormat inputPixelFormat;
+
+    // Input area which is converted, the rest is cropped away. Its origin must be aligned to the input chroma
+    // subsampling.
+    int cropX;
+    int cropY;
+    int cropWidth;
+    int cropHeight;
+
     int outputWidth;
     int outputHeight;
     AVPixelFormat outputPixelFormat;
+
+    // Number of horizontal slices converted concurrently. Used only when no resize happens.
+    int sliceCount;
+
+    // Used only when the crop area is resized: otherwise no interpolation is needed, and the cheapest exact
+    // algorithm is used
+    ScalingAlgorithm scalingAlgorithm;
 };
 
+/// Converts the input frames crop area to the output size and pixel format.
+/// The crop area is selected by offsetting the input planes pointers, so only its pixels are read and converted.
+/// If the source frames come with their damage, the unchanged parts are not converted again: repeated frames reuse
+/// the last converted frame, while partially changed frames only convert the damaged rows (when no resize happens).
+/// When no resize happens, whole frames can be split in horizontal slices, converted concurrently. Rows bands are
+/// converted with the same alignment and margins used for the damaged rows, so the output is the same of a whole
+/// frame conversion.
+/// The scaling algorithm is selected by the configuration. When no resize happens, point sampling is used whatever
+/// the configuration: luma samples map one to one, so the interpolation filters only cost time.
+/// The scaling algorithm can be switched to a faster one while converting: the next frame is then wholly converted.
 class SWScaleFilterRing : public FilterChainRing {
+    struct Slice {
+        int top;
+        int bottom;
+        std::unique_ptr<SwsContext, FFMpegObjectsDeleter> context;
+        PooledFrame frame;
+    };
+
     std::unique_ptr<SwsContext,FFMpegObjectsDeleter> swsContext;
     SWScaleConfig config;
 
+    std::shared_ptr<FramePool> framePool;
+
+    // Scaling algorithm flags of the converters, and the ones requested while converting
+    int baseScalingFlags;
+    int scalingFlags;
+    std::atomic<int> requestedScalingFlags;
+
+    PooledFrame lastConvertedFrame;
+
+    // Damaged rows conversion: rows bands are converted into a scratch frame, using a converter sized as the band
+    PooledFrame bandsFrame;
+    std::map<int, std::unique_ptr<SwsContext, FFMpegObjectsDeleter>> bandContexts;
+
+    // Offsets of the crop area origin in each input plane
+    int cropOffsets[4];
+
+    // Sliced conversion: each slice has its own converter and scratch frame. The first slice is converted by the
+    // calling thread, the others by the slice workers on the executor.
+    std::vector<Slice> slices;
+    std::vector<std::unique_ptr<PipelineStage>> sliceWorkers;
+
+    PooledFrame allocate_frame(int height);
+
+    void get_input_planes(AVFrame *inputFrame, int row, uint8_t *planes[4]);
+
+    void init_contexts();
+
+    std::unique_ptr<SwsContext, FFMpegObjectsDeleter> init_band_context(int bandHeight);
+
+    SwsContext *get_band_context(int bandHeight);
+
+    void convert_band(SwsContext *bandContext, AVFrame *inputFrame, int top, int bottom, AVFrame *bandFrame);
+
+    void convert_slices(AVFrame *inputFrame);
+
+    void convert_damaged_rows(AVFrame *inputFrame, const std::vector<std::tuple<int, int, int, int>> &regions);
+
 public:
-    explicit SWScaleFilterRing(SWScaleConfig config);
+    static int get_scaling_flags(const SWScaleConfig &config);
+
+    SWScaleFilterRing(SWScaleConfig config, std::shared_ptr<TaskExecutor> executor,
+                      std::shared_ptr<FramePool> framePool);
 
     ~SWScaleFilterRing() override = default;
 
+    void setFastScaling(bool isFastScaling);
+
+    [[nodiscard]] bool hasFasterScaling() const;
+
     void execute(ProcessContext *processContext, AVFrame *inputFrame) override;
 };
 
@@ -40,7 +40,8 @@ std::string RecordingConfig::getOutputPath() const {
     auto tm = *std::localtime(&t);
 
     std::filesystem::path filename(
-            fmt::format("rec_{}-{}-{}T{}-{}.mp4", tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min));
+            fmt::format("rec_{}-{}-{}T{}-{}.{}", tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+                        get_video_codec_profile(videoCodec, videoCodecPreset).containerExtension));
 
     std::string output = (dir / filename).string();
 
@@ -77,6 +78,258 @@ void RecordingConfig::setFramerate(int value) {
     framerate = value;
 }
 
+const std::vector<VideoRendition> &RecordingConfig::getVideoRenditions() const {
+    return videoRenditions;
+}
+
+/// Adds a video rendition, scaled by the passed factor (e.g. one of the getOutputResolutionsChoices ones).
+/// Refer to the class documentation for information about the renditions.
+void RecordingConfig::addVideoRendition(double scalingFactor, int64_t bitRate) {
+    videoRenditions.push_back({scalingFactor, bitRate});
+}
+
+/// Removes all the video renditions
+void RecordingConfig::resetVideoRenditions() {
+    videoRenditions.clear();
+}
+
+uint64_t RecordingConfig::getVideoQueueCapacity() const {
+    return videoQueueCapacity;
+}
+
+/// Sets the maximum number of captured video frames waiting to be encoded.
+/// The capacity is rounded up to the next power of two.
+void RecordingConfig::setVideoQueueCapacity(uint64_t capacity) {
+    videoQueueCapacity = capacity;
+}
+
+SourceQueueOverflowPolicy RecordingConfig::getVideoQueueOverflowPolicy() const {
+    return videoQueueOverflowPolicy;
+}
+
+/// Sets what to do with the captured video frames when the queue is full.
+/// Refer to the SourceQueueOverflowPolicy documentation for information about the allowed policies.
+void RecordingConfig::setVideoQueueOverflowPolicy(SourceQueueOverflowPolicy policy) {
+    videoQueueOverflowPolicy = policy;
+}
+
+bool RecordingConfig::isPipelinedProcessing() const {
+    return pipelinedProcessing;
+}
+
+/// Sets if the video processing steps must run on separate threads.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setPipelinedProcessing(bool enabled) {
+    pipelinedProcessing = enabled;
+}
+
+int RecordingConfig::getVideoConversionSlices() const {
+    return videoConversionSlices;
+}
+
+/// Sets the number of slices converted concurrently.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setVideoConversionSlices(int slices) {
+    videoConversionSlices = slices;
+}
+
+VideoCodec RecordingConfig::getVideoCodec() const {
+    return videoCodec;
+}
+
+/// Sets the codec used to encode the video.
+/// Refer to the VideoCodec documentation for information about the allowed codecs.
+void RecordingConfig::setVideoCodec(VideoCodec codec) {
+    videoCodec = codec;
+}
+
+VideoCodecPreset RecordingConfig::getVideoCodecPreset() const {
+    return videoCodecPreset;
+}
+
+/// Sets if the video encoder must be tuned for low latency or for a smaller output.
+/// Refer to the VideoCodecPreset documentation for information about the allowed presets.
+void RecordingConfig::setVideoCodecPreset(VideoCodecPreset preset) {
+    videoCodecPreset = preset;
+}
+
+EncoderThreading RecordingConfig::getVideoEncoderThreading() const {
+    return videoEncoderThreading;
+}
+
+/// Sets how the video encoder threads split the work.
+/// Refer to the EncoderThreading documentation for information about the allowed modes.
+void RecordingConfig::setVideoEncoderThreading(EncoderThreading threading) {
+    videoEncoderThreading = threading;
+}
+
+int RecordingConfig::getVideoEncoderThreads() const {
+    return videoEncoderThreads;
+}
+
+/// Sets how many threads the video encoder uses, or 0 to let the encoder choose.
+/// Refer to the class documentation for information about the encoder threading.
+void RecordingConfig::setVideoEncoderThreads(int threads) {
+    videoEncoderThreads = threads;
+}
+
+RateControlMode RecordingConfig::getVideoRateControl() const {
+    return videoRateControl;
+}
+
+/// Sets the rate control mode of the video encoder. Lossless codecs ignore it.
+/// Refer to the RateControlMode documentation for information about the allowed modes.
+void RecordingConfig::setVideoRateControl(RateControlMode mode) {
+    videoRateControl = mode;
+}
+
+int64_t RecordingConfig::getVideoBitRate() const {
+    return videoBitRate;
+}
+
+/// Sets the target video bit rate, in bits per second, or 0 to derive it from the codec and the output format.
+/// Refer to the class documentation for information about the rate control settings.
+void RecordingConfig::setVideoBitRate(int64_t bitRate) {
+    videoBitRate = bitRate;
+}
+
+int64_t RecordingConfig::getVideoMaxBitRate() const {
+    return videoMaxBitRate;
+}
+
+/// Sets the max video bit rate of the capped quality mode, in bits per second, or 0 to use twice the target one.
+/// Refer to the class documentation for information about the rate control settings.
+void RecordingConfig::setVideoMaxBitRate(int64_t bitRate) {
+    videoMaxBitRate = bitRate;
+}
+
+int RecordingConfig::getVideoQuality() const {
+    return videoQuality;
+}
+
+/// Sets the quality kept by the quality modes, on the encoder scale (CRF or QP), or -1 to use the codec default.
+/// Refer to the class documentation for information about the rate control settings.
+void RecordingConfig::setVideoQuality(int quality) {
+    videoQuality = quality;
+}
+
+int RecordingConfig::getVideoRateBufferDuration() const {
+    return videoRateBufferDuration;
+}
+
+/// Sets the duration of the rate control buffer, in milliseconds, or 0 to use a 1 second buffer.
+/// Refer to the class documentation for information about the rate control settings.
+void RecordingConfig::setVideoRateBufferDuration(int milliseconds) {
+    videoRateBufferDuration = milliseconds;
+}
+
+int64_t RecordingConfig::getAudioBitRate() const {
+    return audioBitRate;
+}
+
+/// Sets the audio bit rate, in bits per second, or 0 to derive it from the audio channels.
+/// Refer to the class documentation for information about the audio settings.
+void RecordingConfig::setAudioBitRate(int64_t bitRate) {
+    audioBitRate = bitRate;
+}
+
+bool RecordingConfig::isCursorRegionOfInterest() const {
+    return cursorRegionOfInterest;
+}
+
+/// Sets if the area around the cursor must be encoded at a higher quality.
+/// Refer to the class documentation for information about the regions of interest.
+void RecordingConfig::setCursorRegionOfInterest(bool enabled) {
+    cursorRegionOfInterest = enabled;
+}
+
+const std::vector<std::tuple<int, int, int, int>> &RecordingConfig::getRegionsOfInterest() const {
+    return regionsOfInterest;
+}
+
+/// Adds a region of the recorded area which must be encoded at a higher quality.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::addRegionOfInterest(std::tuple<int, int, int, int> region) {
+    regionsOfInterest.push_back(region);
+}
+
+/// Removes all the regions of interest
+void RecordingConfig::resetRegionsOfInterest() {
+    regionsOfInterest.clear();
+}
+
+ScalingAlgorithm RecordingConfig::getVideoScalingAlgorithm() const {
+    return videoScalingAlgorithm;
+}
+
+/// Sets the algorithm used to scale the captured video.
+/// Refer to the ScalingAlgorithm documentation for information about the allowed algorithms.
+void RecordingConfig::setVideoScalingAlgorithm(ScalingAlgorithm algorithm) {
+    videoScalingAlgorithm = algorithm;
+}
+
+int RecordingConfig::getExecutorWorkers() const {
+    return executorWorkers;
+}
+
+/// Sets the number of worker threads processing the captured audio and video.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setExecutorWorkers(int workers) {
+    executorWorkers = workers;
+}
+
+bool RecordingConfig::isAdaptiveQuality() const {
+    return adaptiveQuality;
+}
+
+/// Sets if the video quality must adapt to the processing load.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setAdaptiveQuality(bool enabled) {
+    adaptiveQuality = enabled;
+}
+
+uint64_t RecordingConfig::getSpillMemoryBudget() const {
+    return spillMemoryBudget;
+}
+
+/// Sets how many bytes of captured video can be queued in memory, before spilling to disk.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setSpillMemoryBudget(uint64_t bytes) {
+    spillMemoryBudget = bytes;
+}
+
+std::string RecordingConfig::getSpillDirectory() const {
+    if (spillDirectory.empty())
+        return std::filesystem::temp_directory_path().string();
+    return spillDirectory;
+}
+
+/// Sets the directory of the spill file.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setSpillDirectory(const std::string &directory) {
+    spillDirectory = directory;
+}
+
+bool RecordingConfig::isDeferredEncoding() const {
+    return deferredEncoding;
+}
+
+/// Sets if the captured audio and video must be encoded after the recording is stopped.
+/// Refer to the class documentation for information about the allowed formats.
+void RecordingConfig::setDeferredEncoding(bool enabled) {
+    deferredEncoding = enabled;
+}
+
+int RecordingConfig::getVideoEncodingChunkFrames() const {
+    return videoEncodingChunkFrames;
+}
+
+/// Sets the length of the video chunks encoded in parallel in deferred encoding mode, or 0 to use a single encoder.
+/// Refer to the class documentation for information about the chunked encoding.
+void RecordingConfig::setVideoEncodingChunkFrames(int frames) {
+    videoEncodingChunkFrames = frames;
+}
+
 inline int make_even(int n) {
     return n - n % 2;
 }
@@ -7,6 +7,17 @@
 #include <queue>
 #include <string>
 #include <thread>
+#include <vector>
+#include "process_chain/encoder_ring.h"
+#include "process_chain/source_queue.h"
+#include "process_chain/swscale_filter_ring.h"
+#include "video_codec.h"
+
+/// Additional video output of the recording, at a different resolution
+struct VideoRendition {
+    double scalingFactor; // Of the recorded region, as the output resolution one
+    int64_t bitRate;      // If not positive, a default based on the codec and the rendition resolution is used
+};
 
 class RecordingConfig {
     // The deviceAddresses select the input video and audio device to use for recording.
@@ -41,6 +52,91 @@ class RecordingConfig {
     // Selects the framerate to use for recording.
     int framerate = 30;
 
+    // Selects the additional renditions of the video, e.g. a low resolution preview along with the full resolution
+    // recording. Each rendition is saved in its own output file, next to the main one, with the same codec and audio.
+    // The video is captured once for all the outputs.
+    std::vector<VideoRendition> videoRenditions;
+
+    // Selects how many captured video frames can wait to be encoded, and what to do when the encoder falls behind
+    // and the queue is full.
+    uint64_t videoQueueCapacity = 32;
+    SourceQueueOverflowPolicy videoQueueOverflowPolicy = OVERFLOW_DROP_NON_REFERENCE;
+
+    // Allow the user to choose if each video processing step (scale, crop, encode, mux) must run on its own thread.
+    // It increases the sustainable framerate on multi-core machines, at the cost of some more latency and memory.
+    bool pipelinedProcessing = false;
+
+    // Selects in how many horizontal slices the captured video frames are split, to convert their pixel format on
+    // multiple threads. Slicing is used only if the frames are not resized.
+    int videoConversionSlices = 1;
+
+    // Selects the video codec, and if its encoder must be tuned for low latency or for a smaller output. The output
+    // container depends on the codec.
+    VideoCodec videoCodec = VIDEO_CODEC_H264;
+    VideoCodecPreset videoCodecPreset = VIDEO_PRESET_LOW_LATENCY;
+
+    // Selects how the video encoder threads split the work, and how many threads are used (if 0, the encoder chooses).
+    // Slice threading adds no latency, while frame threading has a higher throughput at the cost of a frame of
+    // latency for each thread. The automatic threading follows the codec preset. The encoder must support the
+    // selected threading: encoders managing their own threads (e.g. libx265, libvpx) only accept the automatic
+    // threading, which leaves the choice to them, or a single thread.
+    EncoderThreading videoEncoderThreading = ENCODER_THREADING_AUTO;
+    int videoEncoderThreads = 0;
+
+    // Selects how the video encoder spends its bits. The bit rate is the target of the average and constant bit rate
+    // modes, the max bit rate caps the capped quality mode, and the quality (CRF or QP, lower is better) is kept by
+    // the quality modes. If not positive (negative for the quality), defaults based on the codec, the output
+    // resolution and the framerate are used. The rate buffer duration, in milliseconds, sets the VBV buffer size of
+    // the constant bit rate and capped quality modes: shorter buffers hold the bit rate over shorter intervals.
+    // If not positive, a 1 second buffer is used.
+    RateControlMode videoRateControl = RATE_CONTROL_AVERAGE;
+    int64_t videoBitRate = 0;
+    int64_t videoMaxBitRate = 0;
+    int videoQuality = -1;
+    int videoRateBufferDuration = 1000;
+
+    // Selects the audio bit rate. If not positive, a default based on the audio channels is used.
+    int64_t audioBitRate = 0;
+
+    // Selects the regions of the video encoded at a higher quality: the area around the cursor, if enabled and if the
+    // video device reports it, and the passed rectangles, in the format tuple(x,y,width,height) from the recorded
+    // region top left. In the bit rate modes, the bits spent on the regions are taken from the rest of the video.
+    // Codecs without regions of interest support (AV1, VP9 with the archival preset and the lossless ones) ignore them.
+    bool cursorRegionOfInterest = false;
+    std::vector<std::tuple<int, int, int, int>> regionsOfInterest;
+
+    // Selects the algorithm used to scale the captured video to the output resolution. When the video is not
+    // resized, the cheapest exact conversion is used instead.
+    ScalingAlgorithm videoScalingAlgorithm = SCALING_BICUBIC;
+
+    // Selects how many worker threads process the captured audio and video. If not positive, a worker for each
+    // hardware thread is used.
+    int executorWorkers = 0;
+
+    // Allow the user to choose if the video quality must be lowered while the processing can't keep up with the
+    // capture (faster scaling, then lower bit rate, then lower frame rate), and raised back when it can.
+    bool adaptiveQuality = false;
+
+    // Selects how many bytes of raw captured video can wait in memory for processing. When the processing falls
+    // behind and the budget is exceeded, captured video is spilled to a memory-mapped file in the spill directory
+    // and processed later, instead of being dropped. If 0, nothing is spilled.
+    uint64_t spillMemoryBudget = 0;
+
+    // Directory of the spill file. If empty, the system temporary directory is used.
+    std::string spillDirectory;
+
+    // Allow the user to choose if the captured audio and video must only be spooled to the spill directory while
+    // recording, and encoded after the recording is stopped. It keeps the capture CPU usage at a minimum, at the cost
+    // of disk space and of a delay before the output file is complete.
+    bool deferredEncoding = false;
+
+    // Selects the length, in frames, of the video chunks encoded in parallel in deferred encoding mode, each one by
+    // its own encoder. Chunks should last a multiple of the codec key frames interval. It speeds up the slow encoder
+    // presets on many-core machines, at the cost of a chunk of frames held in memory for each executor worker. The
+    // chunks held in memory are limited to 4 GiB: fewer chunks are encoded in parallel if they are longer or larger,
+    // and a single chunk can't exceed that. If 0, the video is encoded by a single encoder.
+    int videoEncodingChunkFrames = 0;
+
     // Allow the user to choose if the internal control thread must be used. This allows for easy usage in standalone
     // terminal applications.
     // It must be disabled for custom thread management (e.g. gui applications).
@@ -79,6 +175,106 @@ public:
 
     void setFramerate(int framerate);
 
+    [[nodiscard]] const std::vector<VideoRendition> &getVideoRenditions() const;
+
+    void addVideoRendition(double scalingFactor, int64_t bitRate);
+
+    void resetVideoRenditions();
+
+    [[nodiscard]] uint64_t getVideoQueueCapacity() const;
+
+    void setVideoQueueCapacity(uint64_t capacity);
+
+    [[nodiscard]] SourceQueueOverflowPolicy getVideoQueueOverflowPolicy() const;
+
+    void setVideoQueueOverflowPolicy(SourceQueueOverflowPolicy policy);
+
+    [[nodiscard]] bool isPipelinedProcessing() const;
+
+    void setPipelinedProcessing(bool enabled);
+
+    [[nodiscard]] int getVideoConversionSlices() const;
+
+    void setVideoConversionSlices(int slices);
+
+    [[nodiscard]] VideoCodec getVideoCodec() const;
+
+    void setVideoCodec(VideoCodec codec);
+
+    [[nodiscard]] VideoCodecPreset getVideoCodecPreset() const;
+
+    void setVideoCodecPreset(VideoCodecPreset preset);
+
+    [[nodiscard]] EncoderThreading getVideoEncoderThreading() const;
+
+    void setVideoEncoderThreading(EncoderThreading threading);
+
+    [[nodiscard]] int getVideoEncoderThreads() const;
+
+    void setVideoEncoderThreads(int threads);
+
+    [[nodiscard]] RateControlMode getVideoRateControl() const;
+
+    void setVideoRateControl(RateControlMode mode);
+
+    [[nodiscard]] int64_t getVideoBitRate() const;
+
+    void setVideoBitRate(int64_t bitRate);
+
+    [[nodiscard]] int64_t getVideoMaxBitRate() const;
+
+    void setVideoMaxBitRate(int64_t bitRate);
+
+    [[nodiscard]] int getVideoQuality() const;
+
+    void setVideoQuality(int quality);
+
+    [[nodiscard]] int getVideoRateBufferDuration() const;
+
+    void setVideoRateBufferDuration(int milliseconds);
+
+    [[nodiscard]] int64_t getAudioBitRate() const;
+
+    void setAudioBitRate(int64_t bitRate);
+
+    [[nodiscard]] bool isCursorRegionOfInterest() const;
+
+    void setCursorRegionOfInterest(bool enabled);
+
+    [[nodiscard]] const std::vector<std::tuple<int, int, int, int>> &getRegionsOfInterest() const;
+
+    void addRegionOfInterest(std::tuple<int, int, int, int> region);
+
+    void resetRegionsOfInterest();
+
+    [[nodiscard]] ScalingAlgorithm getVideoScalingAlgorithm() const;
+
+    void setVideoScalingAlgorithm(ScalingAlgorithm algorithm);
+
+    [[nodiscard]] int getExecutorWorkers() const;
+
+    void setExecutorWorkers(int workers);
+
+    [[nodiscard]] bool isAdaptiveQuality() const;
+
+    void setAdaptiveQuality(bool enabled);
+
+    [[nodiscard]] uint64_t getSpillMemoryBudget() const;
+
+    void setSpillMemoryBudget(uint64_t bytes);
+
+    [[nodiscard]] std::string getSpillDirectory() const;
+
+    void setSpillDirectory(const std::string &directory);
+
+    [[nodiscard]] bool isDeferredEncoding() const;
+
+    void setDeferredEncoding(bool enabled);
+
+    [[nodiscard]] int getVideoEncodingChunkFrames() const;
+
+    void setVideoEncodingChunkFrames(int frames);
+
     [[nodiscard]] bool isUseControlThread() const;
 
     void setUseControlThread(bool enabled);
@@ -9,34 +9,24 @@
 
 #include "device_context.h"
 #include "error.h"
+#include "process_chain/bgra_to_yuv_filter_ring.h"
+#include "process_chain/chunked_encoder_ring.h"
 #include "process_chain/decoder_ring.h"
 #include "process_chain/encoder_ring.h"
 #include "process_chain/muxer_ring.h"
 #include "process_chain/process_chain.h"
+#include "process_chain/roi_filter_ring.h"
 #include "process_chain/swresample_filter_ring.h"
 #include "process_chain/swscale_filter_ring.h"
-#include "process_chain/vfcrop_filter_ring.h"
 
 using namespace std::chrono;
 
-/// Handles a captured packed, enqueueing it in the transcoder packets queue.
-/// It is used as callback for the PacketCapturer objects.
-void on_packet_capture(std::unique_ptr<AVPacket, FFMpegObjectsDeleter> packet,
-                       int64_t relativePts,
-                       ProcessChain& transcodeChain,
-                       std::mutex& queueMutex,
-                       std::condition_variable& processChainCV) {
-  {
-    std::lock_guard<std::mutex> lk(queueMutex);
-    transcodeChain.enqueueSourcePacket(std::move(packet), relativePts);
-  }
-  processChainCV.notify_all();
-}
-
 /// Starts the packet capture loop.
 /// It temporarily stops if the recording process is paused.
 /// The loop exits when the recording proces is stopped.
-void RecordingServiceImpl::start_capture_loop(PacketCapturer& capturer) {
+/// A capture error stops the recording: the error is stored, and rethrown by
+/// stop_recording (or wait_encoding, in deferred encoding mode).
+void RecordingServiceImpl::start_capture_loop(Capturer& capturer) {
   while (true) {
     {
       std::unique_lock<std::mutex> lock(recordingStatusMutex);
@@ -46,49 +36,28 @@ void RecordingServiceImpl::start_capture_loop(PacketCapturer& capturer) {
         break;
     }
 
-    capturer.capture_next();
-    capturer.sleep();
-  }
-}
-
-/// Processes all the captured packets in the a/v transcoder packets queue.
-/// It temporarily stops if the queue is empty but the recording process is
-/// still active (e.g. paused). The loop exits when the queue is empty and the
-/// recording process is stopped.
-void RecordingServiceImpl::start_transcode_process(
-    ProcessChain& transcodeChain,
-    std::mutex& queueMutex,
-    std::condition_variable& queueCV) {
-  bool mustStop = false;
-  while (true) {
-    // Check if the recording process has been stopped
-    {
-      std::lock_guard<std::mutex> lk(recordingStatusMutex);
-      mustStop = recordingStatus == STOP;
-    }
-
-    // Process the next packet until the queue is empty.
-    // If the queue is empty, wait for new packets but check every 100ms if the
-    // recording has been stopped.
-    {
-      std::unique_lock<std::mutex> lock(queueMutex);
-      queueCV.wait_for(lock, 100ms, [&transcodeChain] {
-        return !transcodeChain.isSourceQueueEmpty();
-      });
-
-      if (transcodeChain.isSourceQueueEmpty() && mustStop)
-        break;
-
-      if (transcodeChain.isSourceQueueEmpty())
-        continue;
+    try {
+      capturer.capture_next();
+      capturer.wait_next_capture();
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(recordingStatusMutex);
+        if (!captureError)
+          captureError = std::current_exception();
+        recordingStatus = STOP;
+      }
+      // Stop the other capture loop too
+      captureCV.notify_all();
+      break;
     }
-
-    transcodeChain.processNext();
   }
 }
 
 /// Starts the recording process.
-/// It writes the output file header and starts all the needed sub processes.
+/// It writes the output file header (and the renditions ones) and starts all
+/// the needed sub processes.
+/// Captured packets are processed by the transcode chains on the shared
+/// executor.
 void RecordingServiceImpl::start_recording() {
   int ret = avformat_write_header(outputMuxer->getContext(), nullptr);
   if (ret < 0) {
@@ -97,6 +66,16 @@ void RecordingServiceImpl::start_recording() {
         fmt::format("error writing the output file header ({})",
                     Error::unpackAVError(ret))));
   }
+  for (auto& renditionOutput : renditionOutputs) {
+    ret = avformat_write_header(renditionOutput.outputMuxer->getContext(),
+                                nullptr);
+    if (ret < 0) {
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, {},
+          fmt::format("error writing the rendition file header ({})",
+                      Error::unpackAVError(ret))));
+    }
+  }
 
   recordingStatus = RECORDING;
   startTimestamp =
@@ -110,25 +89,13 @@ void RecordingServiceImpl::start_recording() {
   mainDeviceCaptureThread =
       std::thread([this]() { start_capture_loop(*mainDeviceCapturer); });
 
-  capturedVideoPacketsProcessThread = std::thread([this]() {
-    start_transcode_process(*videoTranscodeChain, videoProcessChainQueueMutex,
-                            videoProcessChainCV);
-  });
-
   // ---------------
   // Audio recording
   // ---------------
 
-  if (!isAudioDisabled) {
-    if (mainDevice != auxDevice) {
-      auxDeviceCaptureThread =
-          std::thread([this]() { start_capture_loop(*auxDeviceCapturer); });
-    }
-
-    capturedAudioPacketsProcessThread = std::thread([this]() {
-      start_transcode_process(*audioTranscodeChain, audioProcessChainQueueMutex,
-                              audioProcessChainCV);
-    });
+  if (!isAudioDisabled && mainDevice != auxDevice) {
+    auxDeviceCaptureThread =
+        std::thread([this]() { start_capture_loop(*auxDeviceCapturer); });
   }
 }
 
@@ -141,7 +108,8 @@ void RecordingServiceImpl::pause_recording() {
 
   {
     std::lock_guard<std::mutex> lk(recordingStatusMutex);
-    recordingStatus = PAUSE;
+    if (recordingStatus != STOP)
+      recordingStatus = PAUSE;
   }
   captureCV.notify_all();
 }
@@ -160,22 +128,65 @@ void RecordingServiceImpl::resume_recording() {
 
   {
     std::lock_guard<std::mutex> lk(recordingStatusMutex);
-    recordingStatus = RECORDING;
+    if (recordingStatus != STOP)
+      recordingStatus = RECORDING;
   }
   captureCV.notify_all();
 }
 
+/// Waits for the chains to process the end of stream, then writes the output
+/// file trailer, and the renditions ones
+void RecordingServiceImpl::finish_output() {
+  videoTranscodeChain->waitEnded();
+  if (!isAudioDisabled) {
+    audioTranscodeChain->waitEnded();
+  }
+
+  muxerRing->flush();
+
+  int ret = av_write_trailer(outputMuxer->getContext());
+  if (ret < 0) {
+    throw std::runtime_error(Error::build_error_message(
+        __FUNCTION__, {},
+        fmt::format("error writing the output file trailer ({})",
+                    Error::unpackAVError(ret))));
+  }
+
+  for (auto& renditionOutput : renditionOutputs) {
+    renditionOutput.muxerRing->flush();
+
+    ret = av_write_trailer(renditionOutput.outputMuxer->getContext());
+    if (ret < 0) {
+      throw std::runtime_error(Error::build_error_message(
+          __FUNCTION__, {},
+          fmt::format("error writing the rendition file trailer ({})",
+                      Error::unpackAVError(ret))));
+    }
+  }
+  isEncodingFinished = true;
+}
+
 /// Stops the recording process
-/// Waits for the sub-processes to end. Remaining captured packets are flushed.
-/// Finally, it writes the output file trailer.
+/// Waits for the capture loops to end, then pushes the end of stream through
+/// the chains: it returns as soon as the remaining captured packets have been
+/// processed and flushed. Finally, it writes the output file trailer.
+/// In deferred encoding mode, the spooled packets are processed on a
+/// background thread instead, and it returns immediately: use wait_encoding
+/// or get_encoding_progress to follow the encoding.
+/// If a capture loop failed, the recording is already in the STOP status: the
+/// packets captured so far are still written, then the capture error is
+/// rethrown.
 void RecordingServiceImpl::stop_recording() {
-  if (recordingStatus == IDLE || recordingStatus == STOP)
-    return;
-
   {
     std::lock_guard<std::mutex> lock(recordingStatusMutex);
+    if (recordingStatus == IDLE || isStopped)
+      return;
+
     recordingStatus = STOP;
+    isStopped = true;
   }
+  // Wake up the capture loops, if paused
+  captureCV.notify_all();
 
   stopTimestamp =
       duration_cast<microseconds>(system_clock::now().time_since_epoch())
@@ -187,32 +198,52 @@ void RecordingServiceImpl::stop_recording() {
   if (auxDeviceCaptureThread.joinable())
     auxDeviceCaptureThread.join();
 
-  if (capturedVideoPacketsProcessThread.joinable())
-    capturedVideoPacketsProcessThread.join();
+  // No more packets will be captured
+  videoTranscodeChain->enqueueEndOfStream();
+  if (!isAudioDisabled) {
+    audioTranscodeChain->enqueueEndOfStream();
+  }
 
-  if (capturedAudioPacketsProcessThread.joinable())
-    capturedAudioPacketsProcessThread.join();
+  if (!isDeferredEncoding) {
+    finish_output();
+    if (captureError)
+      std::rethrow_exception(captureError);
+    return;
+  }
 
-  videoTranscodeChain->flush();
+  videoTranscodeChain->releaseProcessing();
   if (!isAudioDisabled) {
-    audioTranscodeChain->flush();
+    audioTranscodeChain->releaseProcessing();
   }
+  encodingThread = std::thread([this]() {
+    try {
+      finish_output();
+    } catch (...) {
+      encodingError = std::current_exception();
+    }
+  });
+}
 
-  int ret = av_write_trailer(outputMuxer->getContext());
-  if (ret < 0) {
-    throw std::runtime_error(Error::build_error_message(
-        __FUNCTION__, {},
-        fmt::format("error writing the output file trailer ({})",
-                    Error::unpackAVError(ret))));
-  }
+/// Waits for the deferred encoding to complete. Errors raised while encoding
+/// are rethrown, then the ones which stopped the capture.
+void RecordingServiceImpl::wait_encoding() {
+  if (encodingThread.joinable())
+    encodingThread.join();
+  if (encodingError)
+    std::rethrow_exception(encodingError);
+  if (isDeferredEncoding && captureError)
+    std::rethrow_exception(captureError);
 }
 
 /// Initializes all the structures needed for the recording process
 RecordingServiceImpl::RecordingServiceImpl(const RecordingConfig& config) {
   recordingStatus = IDLE;
+  isStopped = false;
   startTimestamp = 0;
   pauseTimestamp = 0;
   stopTimestamp = 0;
+  isDeferredEncoding = config.isDeferredEncoding();
+  isEncodingFinished = false;
 
   // Initialize the LibAV devices
   avdevice_register_all();
@@ -225,6 +256,11 @@ RecordingServiceImpl::RecordingServiceImpl(const RecordingConfig& config) {
       unpackDeviceAddress(config.getAudioAddress());
   isAudioDisabled = audioDeviceID.empty();
 
+  // Grab just the capture region, if the video device supports it
+  bool isCaptureRegionGrabbed =
+      is_capture_region_grabbed(videoDeviceID, config);
+  videoURL = get_device_video_url(videoDeviceID, videoURL, config);
+
   // -----------
   // A/V Devices
   // -----------
@@ -235,7 +271,17 @@ RecordingServiceImpl::RecordingServiceImpl(const RecordingConfig& config) {
   // device can hold the audio stream, if not disabled. AVFoundation also embed
   // the audio stream in the same device: in this case the main and the aux
   // devices are the same.
-  if (videoDeviceID == audioDeviceID) {
+  // Native video devices are opened as frame grabbers instead: in this case
+  // there is no main device.
+  if (FrameGrabber::is_native_device(videoDeviceID)) {
+    mainGrabber = FrameGrabber::init_grabber(
+        videoDeviceID, videoURL, get_device_options(videoDeviceID, config));
+    if (!isAudioDisabled) {
+      auxDevice = DeviceContext::init_demuxer(
+          audioDeviceID, "", audioURL,
+          get_device_options(audioDeviceID, config));
+    }
+  } else if (videoDeviceID == audioDeviceID) {
     mainDevice =
         DeviceContext::init_demuxer(videoDeviceID, videoURL, audioURL,
                                     get_device_options(videoDeviceID, config));
@@ -254,142 +300,346 @@ RecordingServiceImpl::RecordingServiceImpl(const RecordingConfig& config) {
   // A/V Process Chains
   // ------------------
 
+  // Init the executor shared by the chains
+  executor = std::make_shared<TaskExecutor>(config.getExecutorWorkers());
+
+  // Init the frames and packets pool shared by the rings
+  framePool = std::make_shared<FramePool>();
+
   // Init muxer
-  outputMuxer =
-      DeviceContext::init_muxer(config.getOutputPath(), isAudioDisabled);
+  std::string outputPath = config.getOutputPath();
+  outputMuxer = DeviceContext::init_muxer(outputPath, isAudioDisabled);
 
   // Init common rings
-  auto muxerRing = std::make_shared<MuxerChainRing>(outputMuxer);
+  muxerRing = std::make_shared<MuxerChainRing>(outputMuxer, framePool,
+                                               MUXER_STREAM_QUEUE_CAPACITY);
 
   // Init video rings
-  auto videoDecoderRing =
-      std::make_shared<DecoderChainRing>(mainDevice->getVideoStream());
-
-  auto [encoderOutputWidth, encoderOutputHeight, scalerOutputWidth,
-        scalerOutputHeight, cropOriginX, cropOriginY] =
-      get_output_image_parameters(videoDecoderRing->getDecoderContext()->width,
-                                  videoDecoderRing->getDecoderContext()->height,
-                                  config);
-
-  EncoderConfig videoEncoderConfig = {
-      .codecID = AV_CODEC_ID_H264,
-      .codecType = AVMEDIA_TYPE_VIDEO,
-      .encoderOptions = {{"profile", "main"},
-                         {"preset", "ultrafast"},
-                         {"x264-params",
-                          "keyint=60:min-keyint=60:scenecut=0:force-cfr=1"},
-                         {"tune", "zerolatency"}},
-      .bitRate = OUTPUT_VIDEO_BIT_RATE,
-      .height = encoderOutputHeight,
-      .width = encoderOutputWidth,
-      .pixelFormat = OUTPUT_VIDEO_PIXEL_FMT,
-      .frameRate = av_guess_frame_rate(mainDevice->getContext(),
-                                       mainDevice->getVideoStream(), nullptr)
-                       .num};
-  auto videoEncoderRing = std::make_shared<EncoderChainRing>(
-      mainDevice->getVideoStream(), outputMuxer->getVideoStream(),
-      videoEncoderConfig);
-
-  std::vector<std::shared_ptr<FilterChainRing>> videoFilterRings;
-
-  SWScaleConfig swScaleConfig = {
-      .inputWidth = videoDecoderRing->getDecoderContext()->width,
-      .inputHeight = videoDecoderRing->getDecoderContext()->height,
-      .inputPixelFormat = videoDecoderRing->getDecoderContext()->pix_fmt,
-      .outputWidth = scalerOutputWidth,
-      .outputHeight = scalerOutputHeight,
-      .outputPixelFormat = videoEncoderRing->getEncoderContext()->pix_fmt,
+  // Frames grabbed by native grabbers are already raw: no decoder is needed.
+  // Raw video packets are wrapped as frames by the decoder ring, without
+  // decoding them.
+  std::shared_ptr<DecoderChainRing> videoDecoderRing;
+  int inputWidth, inputHeight, inputFrameRate;
+  AVPixelFormat inputPixelFormat;
+  AVRational inputTimeBase, inputAspectRatio;
+  if (mainGrabber) {
+    inputWidth = mainGrabber->getWidth();
+    inputHeight = mainGrabber->getHeight();
+    inputPixelFormat = mainGrabber->getPixelFormat();
+    inputTimeBase = {1, AV_TIME_BASE};
+    inputAspectRatio = {1, 1};
+    inputFrameRate = config.getFramerate();
+  } else {
+    videoDecoderRing =
+        std::make_shared<DecoderChainRing>(mainDevice->getVideoStream(),
+                                           framePool);
+    inputWidth = videoDecoderRing->getDecoderContext()->width;
+    inputHeight = videoDecoderRing->getDecoderContext()->height;
+    inputPixelFormat = videoDecoderRing->getDecoderContext()->pix_fmt;
+    inputTimeBase = mainDevice->getVideoStream()->time_base;
+    inputAspectRatio = mainDevice->getVideoStream()->sample_aspect_ratio;
+    inputFrameRate = av_guess_frame_rate(mainDevice->getContext(),
+                                         mainDevice->getVideoStream(), nullptr)
+                         .num;
+  }
+
+  auto [encoderOutputWidth, encoderOutputHeight, cropX, cropY, cropWidth,
+        cropHeight] = get_output_image_parameters(inputWidth, inputHeight,
+                                                  isCaptureRegionGrabbed,
+                                                  config);
+
+  VideoCodecProfile videoCodecProfile = get_video_codec_profile(
+      config.getVideoCodec(), config.getVideoCodecPreset());
+  int videoQuality = config.getVideoQuality() >= 0
+                         ? config.getVideoQuality()
+                         : get_default_video_quality(config.getVideoCodec());
+  int videoRateBufferDuration = config.getVideoRateBufferDuration() > 0
+                                    ? config.getVideoRateBufferDuration()
+                                    : DEFAULT_VIDEO_RATE_BUFFER_DURATION;
+
+  // The regions of interest are attached to the frames only if the encoder
+  // honors them, possibly with some more encoder options
+  std::map<std::string, std::string> videoEncoderOptions =
+      videoCodecProfile.encoderOptions;
+  auto videoROIOptions = get_video_codec_roi_options(
+      config.getVideoCodec(), config.getVideoCodecPreset());
+  bool hasRegionsOfInterest =
+      videoROIOptions && (config.isCursorRegionOfInterest() ||
+                          !config.getRegionsOfInterest().empty());
+  if (hasRegionsOfInterest) {
+    for (const auto& [name, value] : *videoROIOptions) {
+      videoEncoderOptions[name] = value;
+    }
+  }
+
+  // Inits the encoder ring of a video output.
+  // Rate control: the unset parameters are derived from the codec and the
+  // output format, while lossless codecs do not use any.
+  // In deferred encoding mode, the encoding can be split in chunks encoded in
+  // parallel.
+  auto makeVideoEncoderRing = [&](AVStream* outputStream, int width,
+                                  int height, int64_t bitRate,
+                                  int64_t maxBitRate)
+      -> std::shared_ptr<EncoderChainRing> {
+    RateControlMode rateControl = config.getVideoRateControl();
+    if (bitRate <= 0) {
+      bitRate = get_default_video_bit_rate(config.getVideoCodec(), width,
+                                           height, inputFrameRate);
+    }
+    if (maxBitRate <= 0) {
+      maxBitRate = 2 * bitRate;
+    }
+    if (videoCodecProfile.isLossless) {
+      rateControl = RATE_CONTROL_AVERAGE;
+      bitRate = 0;
+      maxBitRate = 0;
+    }
+    int64_t bufferSize =
+        (rateControl == RATE_CONTROL_CONSTANT ? bitRate : maxBitRate) *
+        videoRateBufferDuration / 1000;
+
+    EncoderConfig encoderConfig = {
+        .codecID = videoCodecProfile.codecID,
+        .encoderName = videoCodecProfile.encoderName,
+        .codecType = AVMEDIA_TYPE_VIDEO,
+        .encoderOptions = videoEncoderOptions,
+        .bitRate = bitRate,
+        .rateControl = rateControl,
+        .quality = videoQuality,
+        .maxBitRate = maxBitRate,
+        .bufferSize = bufferSize,
+        .threading = config.getVideoEncoderThreading(),
+        .threadCount = config.getVideoEncoderThreads(),
+        .isLowLatency =
+            config.getVideoCodecPreset() == VIDEO_PRESET_LOW_LATENCY,
+        .height = height,
+        .width = width,
+        .pixelFormat = OUTPUT_VIDEO_PIXEL_FMT,
+        .frameRate = inputFrameRate,
+        .sampleAspectRatio = inputAspectRatio};
+    std::shared_ptr<EncoderChainRing> encoderRing;
+    if (isDeferredEncoding && config.getVideoEncodingChunkFrames() > 0) {
+      encoderRing = std::make_shared<ChunkedEncoderRing>(
+          inputTimeBase, outputStream, encoderConfig, framePool, executor,
+          config.getVideoEncodingChunkFrames());
+    } else {
+      encoderRing = std::make_shared<EncoderChainRing>(
+          inputTimeBase, outputStream, encoderConfig, framePool);
+    }
+    if (videoCodecProfile.codecTag) {
+      outputStream->codecpar->codec_tag = videoCodecProfile.codecTag;
+    }
+    return encoderRing;
   };
-  auto swScaleFilterRing = std::make_shared<SWScaleFilterRing>(swScaleConfig);
-  videoFilterRings.push_back(swScaleFilterRing);
-
-  if (config.getCaptureRegion()) {
-    VFCropConfig vfCropConfig = {
-        .inputWidth = scalerOutputWidth,
-        .inputHeight = scalerOutputHeight,
-        .inputPixelFormat = videoEncoderRing->getEncoderContext()->pix_fmt,
-        .inputTimeBase = mainDevice->getVideoStream()->time_base,
-        .inputAspectRatio = mainDevice->getVideoStream()->sample_aspect_ratio,
-        .originX = cropOriginX,
-        .originY = cropOriginY,
-        .outputWidth = encoderOutputWidth,
-        .outputHeight = encoderOutputHeight,
-        .outputPixelFormat = videoEncoderRing->getEncoderContext()->pix_fmt,
-    };
-    auto vfCropFilterRing = std::make_shared<VFCropFilterRing>(vfCropConfig);
-    videoFilterRings.push_back(vfCropFilterRing);
+
+  // Inits the rings converting and scaling the captured frames for an
+  // encoder, followed by the one marking the regions of interest, if any.
+  // If enabled, BGRA captures converted to the same or the halved size skip
+  // swscale.
+  SWScaleConfig inputScaleConfig = {
+      .inputWidth = inputWidth,
+      .inputHeight = inputHeight,
+      .inputPixelFormat = inputPixelFormat,
+      .cropX = cropX,
+      .cropY = cropY,
+      .cropWidth = cropWidth,
+      .cropHeight = cropHeight,
+      .sliceCount = config.getVideoConversionSlices(),
+      .scalingAlgorithm = config.getVideoScalingAlgorithm(),
+  };
+  auto makeVideoFilterRings =
+      [&](const std::shared_ptr<EncoderChainRing>& encoderRing) {
+    std::vector<std::shared_ptr<FilterChainRing>> filterRings;
+
+    SWScaleConfig swScaleConfig = inputScaleConfig;
+    swScaleConfig.outputWidth = encoderRing->getEncoderContext()->width;
+    swScaleConfig.outputHeight = encoderRing->getEncoderContext()->height;
+    swScaleConfig.outputPixelFormat = encoderRing->getEncoderContext()->pix_fmt;
+    if (BGRAToYUVFilterRing::is_supported(swScaleConfig)) {
+      filterRings.push_back(
+          std::make_shared<BGRAToYUVFilterRing>(swScaleConfig, framePool));
+    } else {
+      filterRings.push_back(std::make_shared<SWScaleFilterRing>(
+          swScaleConfig, executor, framePool));
+    }
+
+    if (hasRegionsOfInterest) {
+      RegionOfInterestConfig roiConfig = {
+          .cropX = swScaleConfig.cropX,
+          .cropY = swScaleConfig.cropY,
+          .cropWidth = swScaleConfig.cropWidth,
+          .cropHeight = swScaleConfig.cropHeight,
+          .outputWidth = swScaleConfig.outputWidth,
+          .outputHeight = swScaleConfig.outputHeight,
+          .cursorRegionSize = config.isCursorRegionOfInterest()
+                                  ? CURSOR_REGION_OF_INTEREST_SIZE
+                                  : 0,
+          .regions = config.getRegionsOfInterest(),
+          .qualityOffset = REGION_OF_INTEREST_QUALITY_OFFSET};
+      filterRings.push_back(std::make_shared<RegionOfInterestFilterRing>(
+          roiConfig, framePool));
+    }
+    return filterRings;
+  };
+
+  videoEncoderRing = makeVideoEncoderRing(
+      outputMuxer->getVideoStream(), encoderOutputWidth, encoderOutputHeight,
+      config.getVideoBitRate(), config.getVideoMaxBitRate());
+  auto videoFilterRings = makeVideoFilterRings(videoEncoderRing);
+  std::vector<ProcessBranch> videoBranches = {
+      {videoFilterRings, videoEncoderRing, muxerRing}};
+
+  // Each rendition has its own output file, filter rings and encoder, fed
+  // with the same captured frames
+  for (const auto& rendition : config.getVideoRenditions()) {
+    auto [renditionWidth, renditionHeight, renditionPath] =
+        get_rendition_output_parameters(cropWidth, cropHeight, rendition,
+                                        outputPath);
+    auto renditionMuxer =
+        DeviceContext::init_muxer(renditionPath, isAudioDisabled);
+    auto renditionMuxerRing = std::make_shared<MuxerChainRing>(
+        renditionMuxer, framePool, MUXER_STREAM_QUEUE_CAPACITY);
+    renditionOutputs.push_back({renditionMuxer, renditionMuxerRing});
+
+    auto renditionEncoderRing = makeVideoEncoderRing(
+        renditionMuxer->getVideoStream(), renditionWidth, renditionHeight,
+        rendition.bitRate, 0);
+    videoBranches.push_back({makeVideoFilterRings(renditionEncoderRing),
+                             renditionEncoderRing, renditionMuxerRing});
   }
 
   // Init video transcode process chain
   this->videoTranscodeChain = std::make_unique<ProcessChain>(
-      videoDecoderRing, videoFilterRings, videoEncoderRing, muxerRing);
+      executor, framePool, videoDecoderRing, videoBranches,
+      config.getVideoQueueCapacity(), config.getVideoQueueOverflowPolicy(),
+      config.isPipelinedProcessing());
+
+  // In deferred encoding mode, there is no processing load to adapt to
+  if (config.isAdaptiveQuality() && !isDeferredEncoding) {
+    auto swScaleFilterRing =
+        std::dynamic_pointer_cast<SWScaleFilterRing>(videoFilterRings.front());
+    videoQualityController = std::make_shared<QualityController>(
+        swScaleFilterRing, videoEncoderRing, inputFrameRate);
+    videoTranscodeChain->setQualityController(videoQualityController);
+  }
+
+  // In deferred encoding mode, all the sources are spooled: no memory budget
+  if (isDeferredEncoding || config.getSpillMemoryBudget() > 0) {
+    auto videoSpillBuffer =
+        std::make_shared<SpillBuffer>(config.getSpillDirectory(), framePool);
+    videoTranscodeChain->setSpillBuffer(
+        videoSpillBuffer,
+        isDeferredEncoding ? 0 : config.getSpillMemoryBudget());
+  }
+  if (isDeferredEncoding) {
+    videoTranscodeChain->holdProcessing();
+  }
 
   if (!isAudioDisabled) {
     // Init audio rings
     auto audioDecoderRing =
-        std::make_shared<DecoderChainRing>(auxDevice->getAudioStream());
+        std::make_shared<DecoderChainRing>(auxDevice->getAudioStream(),
+                                           framePool);
 
     int channels = auxDevice->getAudioStream()->codecpar->channels;
     EncoderConfig audioEncoderConfig = {
         .codecID = AV_CODEC_ID_AAC,
         .codecType = AVMEDIA_TYPE_AUDIO,
-        .bitRate = OUTPUT_AUDIO_BIT_RATE,
+        .bitRate = config.getAudioBitRate() > 0
+                       ? config.getAudioBitRate()
+                       : OUTPUT_AUDIO_BIT_RATE_PER_CHANNEL * channels,
         .channels = channels,
         .channelLayout = av_get_default_channel_layout(channels),
         .sampleRate = auxDevice->getAudioStream()->codecpar->sample_rate,
         .sampleFormat = OUTPUT_AUDIO_SAMPLE_FMT,
         .strictStdCompliance = FF_COMPLIANCE_NORMAL};
-    auto audioEncoderRing = std::make_shared<EncoderChainRing>(
-        auxDevice->getAudioStream(), outputMuxer->getAudioStream(),
-        audioEncoderConfig);
-
-    SWResampleConfig swResampleConfig = {
-        .inputChannels = audioDecoderRing->getDecoderContext()->channels,
-        .inputChannelLayout = av_get_default_channel_layout(channels),
-        .inputSampleFormat = audioDecoderRing->getDecoderContext()->sample_fmt,
-        .inputSampleRate = audioDecoderRing->getDecoderContext()->sample_rate,
-        .inputFrameSize = audioDecoderRing->getDecoderContext()->frame_size,
-        .inputTimeBase = auxDevice->getAudioStream()->time_base,
-        .outputChannels = audioEncoderRing->getEncoderContext()->channels,
-        .outputChannelLayout = av_get_default_channel_layout(channels),
-        .outputSampleFormat = audioEncoderRing->getEncoderContext()->sample_fmt,
-        .outputSampleRate = audioEncoderRing->getEncoderContext()->sample_rate,
-        .outputFrameSize = audioEncoderRing->getEncoderContext()->frame_size,
-        .outputTimeBase = audioEncoderRing->getEncoderContext()->time_base,
+
+    // Inits the resample and encode rings of an audio output
+    auto makeAudioBranch = [&](AVStream* outputStream,
+                               std::shared_ptr<MuxerChainRing> outputRing) {
+      auto audioEncoderRing = std::make_shared<EncoderChainRing>(
+          auxDevice->getAudioStream()->time_base, outputStream,
+          audioEncoderConfig, framePool);
+
+      SWResampleConfig swResampleConfig = {
+          .inputChannels = audioDecoderRing->getDecoderContext()->channels,
+          .inputChannelLayout = av_get_default_channel_layout(channels),
+          .inputSampleFormat =
+              audioDecoderRing->getDecoderContext()->sample_fmt,
+          .inputSampleRate = audioDecoderRing->getDecoderContext()->sample_rate,
+          .inputFrameSize = audioDecoderRing->getDecoderContext()->frame_size,
+          .inputTimeBase = auxDevice->getAudioStream()->time_base,
+          .outputChannels = audioEncoderRing->getEncoderContext()->channels,
+          .outputChannelLayout = av_get_default_channel_layout(channels),
+          .outputSampleFormat =
+              audioEncoderRing->getEncoderContext()->sample_fmt,
+          .outputSampleRate =
+              audioEncoderRing->getEncoderContext()->sample_rate,
+          .outputFrameSize = audioEncoderRing->getEncoderContext()->frame_size,
+          .outputTimeBase = audioEncoderRing->getEncoderContext()->time_base,
+      };
+      auto swResampleFilterRing =
+          std::make_shared<SWResampleFilterRing>(swResampleConfig, framePool);
+      return ProcessBranch{{swResampleFilterRing}, audioEncoderRing,
+                           std::move(outputRing)};
     };
-    auto swResampleFilterRing =
-        std::make_shared<SWResampleFilterRing>(swResampleConfig);
-    std::vector<std::shared_ptr<FilterChainRing>> audioFilterRings = {
-        swResampleFilterRing};
+
+    // The renditions get the same audio, encoded for each output
+    std::vector<ProcessBranch> audioBranches = {
+        makeAudioBranch(outputMuxer->getAudioStream(), muxerRing)};
+    for (auto& renditionOutput : renditionOutputs) {
+      audioBranches.push_back(
+          makeAudioBranch(renditionOutput.outputMuxer->getAudioStream(),
+                          renditionOutput.muxerRing));
+    }
 
     // Init audio transcode process chain
     this->audioTranscodeChain = std::make_unique<ProcessChain>(
-        audioDecoderRing, audioFilterRings, audioEncoderRing, muxerRing);
+        executor, framePool, audioDecoderRing, audioBranches,
+        AUDIO_QUEUE_CAPACITY, OVERFLOW_BLOCK, false);
+
+    if (isDeferredEncoding) {
+      auto audioSpillBuffer =
+          std::make_shared<SpillBuffer>(config.getSpillDirectory(), framePool);
+      audioTranscodeChain->setSpillBuffer(audioSpillBuffer, 0);
+      audioTranscodeChain->holdProcessing();
+    }
   }
 
-  // Init packet capturers
+  // Init packet capturers.
+  // Captured packets and frames are enqueued in the transcoder queues.
   auto onVideoPacketCaptureCallback =
-      [this](std::unique_ptr<AVPacket, FFMpegObjectsDeleter> videoPacket,
-             int64_t relativePts) {
-        return on_packet_capture(
-            std::move(videoPacket), relativePts, *videoTranscodeChain,
-            videoProcessChainQueueMutex, videoProcessChainCV);
+      [this](PooledPacket videoPacket, int64_t relativePts) {
+        videoTranscodeChain->enqueueSourcePacket(std::move(videoPacket),
+                                                 relativePts);
       };
 
   auto onAudioPacketCaptureCallback =
-      [this](std::unique_ptr<AVPacket, FFMpegObjectsDeleter> audioPacket,
-             int64_t relativePts) {
-        return on_packet_capture(
-            std::move(audioPacket), relativePts, *audioTranscodeChain,
-            audioProcessChainQueueMutex, audioProcessChainCV);
+      [this](PooledPacket audioPacket, int64_t relativePts) {
+        audioTranscodeChain->enqueueSourcePacket(std::move(audioPacket),
+                                                 relativePts);
       };
 
-  mainDeviceCapturer = std::make_unique<PacketCapturer>(
-      mainDevice, onVideoPacketCaptureCallback, onAudioPacketCaptureCallback);
+  auto onVideoFrameCaptureCallback =
+      [this](std::unique_ptr<AVFrame, FFMpegObjectsDeleter> videoFrame,
+             FrameDamage damage, int64_t relativePts) {
+        videoTranscodeChain->enqueueSourceFrame(
+            std::move(videoFrame), std::move(damage), relativePts);
+      };
+
+  if (mainGrabber) {
+    mainDeviceCapturer = std::make_unique<FrameCapturer>(
+        mainGrabber, config.getFramerate(), onVideoFrameCaptureCallback);
+  } else {
+    mainDeviceCapturer = std::make_unique<PacketCapturer>(
+        mainDevice, framePool, onVideoPacketCaptureCallback,
+        onAudioPacketCaptureCallback);
+  }
 
   if (mainDevice != auxDevice && !isAudioDisabled) {
     auxDeviceCapturer = std::make_unique<PacketCapturer>(
-        auxDevice, onVideoPacketCaptureCallback, onAudioPacketCaptureCallback);
+        auxDevice, framePool, onVideoPacketCaptureCallback,
+        onAudioPacketCaptureCallback);
   }
 
   // Init control thread
@@ -407,7 +657,11 @@ RecordingServiceImpl::RecordingServiceImpl(const RecordingConfig& config) {
           resume_recording();
           std::cout << "Resumed" << std::endl;
         } else if (c == 's') {
-          stop_recording();
+          try {
+            stop_recording();
+          } catch (...) {
+            controlError = std::current_exception();
+          }
           std::cout << "Stopped" << std::endl;
           break;
         }
@@ -418,9 +672,14 @@ RecordingServiceImpl::RecordingServiceImpl(const RecordingConfig& config) {
 
 /// Wait for the control thread to return.
 /// Must be only used when useControlThread is enabled.
+/// In deferred encoding mode, it also waits for the encoding to complete.
+/// Errors raised while stopping the recording are rethrown.
 void RecordingServiceImpl::wait_recording() {
   if (useControlThread)
     controlThread.join();
+  if (controlError)
+    std::rethrow_exception(controlError);
+  wait_encoding();
 }
 
 /// Returns information about the currently active recording
@@ -437,5 +696,55 @@ RecordingStats RecordingServiceImpl::get_recording_stats() {
                mainDeviceCapturer->get_pause_duration();
   }
 
-  return {.status = recordingStatus, .recordingDuration = duration / 1000000};
+  SourceQueueStats audioQueueStats = {};
+  if (audioTranscodeChain)
+    audioQueueStats = audioTranscodeChain->getSourceQueueStats();
+
+  QualityControllerStats videoQualityStats = {};
+  if (videoQualityController)
+    videoQualityStats = videoQualityController->get_stats();
+
+  return {.status = recordingStatus,
+          .recordingDuration = duration / 1000000,
+          .videoCaptureStats = mainDeviceCapturer->get_scheduler_stats(),
+          .videoQueueStats = videoTranscodeChain->getSourceQueueStats(),
+          .audioQueueStats = audioQueueStats,
+          .executorStats = executor->get_stats(),
+          .muxerStats = muxerRing->get_stats(),
+          .framePoolStats = framePool->get_stats(),
+          .videoQualityStats = videoQualityStats,
+          .videoSpillStats = videoTranscodeChain->getSpillStats(),
+          .videoEncoderStats = videoEncoderRing->get_stats()};
+}
+
+/// Returns the progress of the encoding.
+/// In deferred encoding mode, it is the fraction of the spooled audio and
+/// video which has been read back for encoding.
+EncodingProgress RecordingServiceImpl::get_encoding_progress() {
+  SpillBufferStats videoSpillStats = videoTranscodeChain->getSpillStats();
+  SpillBufferStats audioSpillStats = {};
+  if (audioTranscodeChain)
+    audioSpillStats = audioTranscodeChain->getSpillStats();
+
+  uint64_t spooledBytes =
+      videoSpillStats.spilledBytes + audioSpillStats.spilledBytes;
+  uint64_t pendingBytes =
+      videoSpillStats.pendingBytes + audioSpillStats.pendingBytes;
+  bool isFinished = isEncodingFinished;
+
+  double progress = isFinished ? 1 : 0;
+  if (!isFinished && spooledBytes > 0)
+    progress = (double)(spooledBytes - pendingBytes) / (double)spooledBytes;
+
+  return {.isDeferred = isDeferredEncoding,
+          .isFinished = isFinished,
+          .spooledBytes = spooledBytes,
+          .encodedBytes = spooledBytes - pendingBytes,
+          .progress = progress};
+}
+
+/// Waits for the deferred encoding, if still running
+RecordingServiceImpl::~RecordingServiceImpl() {
+  if (encodingThread.joinable())
+    encodingThread.join();
 }
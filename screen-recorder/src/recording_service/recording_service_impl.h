@@ -7,11 +7,15 @@
 #include <queue>
 #include <string>
 #include <thread>
+#include <atomic>
 #include <condition_variable>
 #include "recording_config.h"
 #include "device_context.h"
+#include "frame_capturer/frame_capturer.h"
+#include "frame_capturer/frame_grabber.h"
 #include "packet_capturer/packet_capturer.h"
 #include "process_chain/process_chain.h"
+#include "task_executor.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -26,8 +30,15 @@ extern "C" {
 // Settings
 const AVSampleFormat OUTPUT_AUDIO_SAMPLE_FMT = AV_SAMPLE_FMT_FLTP;
 const AVPixelFormat OUTPUT_VIDEO_PIXEL_FMT = AV_PIX_FMT_YUV420P;
-const int64_t OUTPUT_VIDEO_BIT_RATE = 2000000;
-const int64_t OUTPUT_AUDIO_BIT_RATE = 96000;
+const int64_t OUTPUT_AUDIO_BIT_RATE_PER_CHANNEL = 48000;
+const int DEFAULT_VIDEO_RATE_BUFFER_DURATION = 1000;
+const int CURSOR_REGION_OF_INTEREST_SIZE = 256;
+const AVRational REGION_OF_INTEREST_QUALITY_OFFSET = {-1, 5};
+const uint64_t AUDIO_QUEUE_CAPACITY = 256;
+const size_t MUXER_STREAM_QUEUE_CAPACITY = 64;
+// Captured frames held by the video chain besides its queue: the frames in the first pipeline stage, the one being
+// processed and the one repeated by the grabber
+const uint64_t X11SHM_CHAIN_HELD_FRAMES = PIPELINE_STAGE_CAPACITY + 3;
 
 enum RecordingStatus {
     IDLE, RECORDING, PAUSE, STOP
@@ -36,6 +47,23 @@ enum RecordingStatus {
 struct RecordingStats {
     RecordingStatus status;
     int64_t recordingDuration; // seconds
+    CaptureSchedulerStats videoCaptureStats;
+    SourceQueueStats videoQueueStats;
+    SourceQueueStats audioQueueStats;
+    std::vector<TaskExecutorWorkerStats> executorStats;
+    MuxerStats muxerStats;
+    FramePoolStats framePoolStats;
+    QualityControllerStats videoQualityStats;
+    SpillBufferStats videoSpillStats;
+    EncoderStats videoEncoderStats;
+};
+
+struct EncodingProgress {
+    bool isDeferred;       // The encoding runs after the recording is stopped
+    bool isFinished;       // The output file has been completely written
+    uint64_t spooledBytes; // Bytes of captured audio and video spooled to disk
+    uint64_t encodedBytes; // Spooled bytes already read back for encoding
+    double progress;       // Fraction of the spooled bytes already read back, from 0 to 1
 };
 
 class RecordingServiceImpl {
@@ -50,11 +78,9 @@ class RecordingServiceImpl {
 
     std::condition_variable captureCV;
     std::mutex recordingStatusMutex;
-
-    std::mutex videoProcessChainQueueMutex;
-    std::condition_variable videoProcessChainCV;
-    std::mutex audioProcessChainQueueMutex;
-    std::condition_variable audioProcessChainCV;
+    // Error which stopped a capture loop, rethrown once the recording is stopped
+    std::exception_ptr captureError;
+    bool isStopped;
 
     // -------
     // Threads
@@ -62,11 +88,23 @@ class RecordingServiceImpl {
 
     std::thread mainDeviceCaptureThread;
     std::thread auxDeviceCaptureThread;
-    std::thread capturedVideoPacketsProcessThread;
-    std::thread capturedAudioPacketsProcessThread;
+
+    // Runs the transcode chains work
+    std::shared_ptr<TaskExecutor> executor;
+
+    // Recycles the frames and packets of the transcode chains
+    std::shared_ptr<FramePool> framePool;
 
     bool useControlThread;
     std::thread controlThread;
+    // Error raised while stopping the recording from the control thread
+    std::exception_ptr controlError;
+
+    // Encodes the spooled audio and video after the recording is stopped, in deferred encoding mode
+    bool isDeferredEncoding;
+    std::thread encodingThread;
+    std::exception_ptr encodingError;
+    std::atomic<bool> isEncodingFinished;
 
     // ------
     // Input
@@ -78,6 +116,9 @@ class RecordingServiceImpl {
     std::shared_ptr<DeviceContext> mainDevice;
     std::shared_ptr<DeviceContext> auxDevice;
 
+    // Native video grabber, used in place of the main device when available
+    std::shared_ptr<FrameGrabber> mainGrabber;
+
     // ------
     // Output
     // ------
@@ -85,12 +126,22 @@ class RecordingServiceImpl {
     // Output context
     std::shared_ptr<DeviceContext> outputMuxer;
 
+    // Interleaves and writes the packets of both the chains
+    std::shared_ptr<MuxerChainRing> muxerRing;
+
+    // Outputs of the video renditions, each one with its own muxer. Both the chains feed them too.
+    struct RenditionOutput {
+        std::shared_ptr<DeviceContext> outputMuxer;
+        std::shared_ptr<MuxerChainRing> muxerRing;
+    };
+    std::vector<RenditionOutput> renditionOutputs;
+
     // ----------------
     // Packet Capturers
     // ----------------
 
-    std::unique_ptr<PacketCapturer> mainDeviceCapturer;
-    std::unique_ptr<PacketCapturer> auxDeviceCapturer;
+    std::unique_ptr<Capturer> mainDeviceCapturer;
+    std::unique_ptr<Capturer> auxDeviceCapturer;
 
     // ---------------
     // Transcode Chain
@@ -99,6 +150,12 @@ class RecordingServiceImpl {
     std::unique_ptr<ProcessChain> videoTranscodeChain;
     std::unique_ptr<ProcessChain> audioTranscodeChain;
 
+    // Encoder of the main video output
+    std::shared_ptr<EncoderChainRing> videoEncoderRing;
+
+    // Adapts the video quality to the video chain load, if enabled
+    std::shared_ptr<QualityController> videoQualityController;
+
     // recording_utils.cpp
     static std::map<std::string, std::string> get_device_options(
         const std::string &deviceID,
@@ -107,15 +164,31 @@ class RecordingServiceImpl {
     static std::tuple<std::string, std::string> unpackDeviceAddress(
         const std::string &deviceAddress);
 
+    static bool is_capture_region_grabbed(
+        const std::string &deviceID,
+        const RecordingConfig &config);
+
+    static std::string get_device_video_url(
+        const std::string &deviceID,
+        const std::string &url,
+        const RecordingConfig &config);
+
     static std::tuple<int, int, int, int, int, int> get_output_image_parameters(
         int deviceInputWidth,
         int deviceInputHeight,
+        bool isCaptureRegionGrabbed,
         const RecordingConfig &config);
 
+    static std::tuple<int, int, std::string> get_rendition_output_parameters(
+        int cropWidth,
+        int cropHeight,
+        const VideoRendition &rendition,
+        const std::string &outputPath);
+
     // recording_service.cpp
-    void start_capture_loop(PacketCapturer &capturer);
+    void start_capture_loop(Capturer &capturer);
 
-    void start_transcode_process(ProcessChain &transcodeChain, std::mutex& queueMutex, std::condition_variable& queueCV);
+    void finish_output();
 
 public:
     explicit RecordingServiceImpl(const RecordingConfig &config);
@@ -130,9 +203,13 @@ public:
 
     void wait_recording();
 
+    void wait_encoding();
+
     RecordingStats get_recording_stats();
 
-    ~RecordingServiceImpl() = default;
+    EncodingProgress get_encoding_progress();
+
+    ~RecordingServiceImpl();
 };
 
 #endif  // PDS_SCREEN_RECORDING_RECORDINGSERVICE_H
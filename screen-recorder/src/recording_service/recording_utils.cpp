@@ -1,6 +1,12 @@
 #include <fmt/core.h>
+#include <algorithm>
+#include <filesystem>
 #include "recording_service_impl.h"
 
+inline int make_even(int n) {
+    return n - n % 2;
+}
+
 /// Returns the default options associated to an input device.
 std::map<std::string, std::string> RecordingServiceImpl::get_device_options(
         const std::string &deviceID,
@@ -12,7 +18,23 @@ std::map<std::string, std::string> RecordingServiceImpl::get_device_options(
     }
 
     if (deviceID == "x11grab") {
-        return {{"framerate", std::to_string(config.getFramerate())}};
+        std::map<std::string, std::string> options = {{"framerate", std::to_string(config.getFramerate())}};
+        if (is_capture_region_grabbed(deviceID, config)) {
+            auto[x, y, width, height] = config.getCaptureRegion().value();
+            options["video_size"] = fmt::format("{}x{}", make_even(width), make_even(height));
+        }
+        return options;
+    }
+
+    if (deviceID == "x11shm") {
+        // Each frame waiting in the video queue, or held by the chain, keeps a shared memory segment
+        std::map<std::string, std::string> options = {
+                {"segments", std::to_string(config.getVideoQueueCapacity() + X11SHM_CHAIN_HELD_FRAMES)}};
+        if (is_capture_region_grabbed(deviceID, config)) {
+            auto[x, y, width, height] = config.getCaptureRegion().value();
+            options["video_size"] = fmt::format("{}x{}", make_even(width), make_even(height));
+        }
+        return options;
     }
 
     if (deviceID == "pulse") {
@@ -34,49 +56,92 @@ std::tuple<std::string, std::string> RecordingServiceImpl::unpackDeviceAddress(
     return std::make_tuple(deviceID, url);
 }
 
-inline int make_even(int n) {
-    return n - n % 2;
+/// Returns true if the video device can grab just the capture region, instead of the whole screen.
+/// In this case, the region is not cropped from the captured image.
+bool RecordingServiceImpl::is_capture_region_grabbed(
+        const std::string &deviceID,
+        const RecordingConfig &config) {
+    return config.getCaptureRegion().has_value() && (deviceID == "x11grab" || deviceID == "x11shm");
+}
+
+/// Returns the url of the video device.
+/// If the device grabs just the capture region, the grab origin is moved to the capture region one.
+/// The accepted X11 url format is: "{display}+{x},{y}"
+std::string RecordingServiceImpl::get_device_video_url(
+        const std::string &deviceID,
+        const std::string &url,
+        const RecordingConfig &config) {
+    if (!is_capture_region_grabbed(deviceID, config)) {
+        return url;
+    }
+
+    auto[x, y, width, height] = config.getCaptureRegion().value();
+
+    size_t delimiterIndex = url.find('+');
+    std::string display = url.substr(0, delimiterIndex);
+    int originX = 0;
+    int originY = 0;
+    if (delimiterIndex != std::string::npos) {
+        sscanf(url.c_str() + delimiterIndex + 1, "%d,%d", &originX, &originY);
+    }
+
+    return fmt::format("{}+{},{}", display, originX + x, originY + y);
 }
 
 /// Calculates the parameters of the output image.
 /// Returns:
 /// - encoderOutputWidth, encoderOutputHeight: the real output image resolution
-/// - scalerOutputWidth, scalerOutputHeight: the intermediate image resolution
-/// (same as the encoder resolution for fullscreen recording)
-/// - cropOriginX, cropOriginY: origin of the image (0 for fullscreen recording)
+/// - cropX, cropY, cropWidth, cropHeight: the input area which is scaled to the output image, in input pixels
+/// (the whole input image for fullscreen recording)
+/// If the capture region is grabbed by the device, the device input image is already the capture region: it is only
+/// scaled, without cropping it.
 std::tuple<int, int, int, int, int, int>
 RecordingServiceImpl::get_output_image_parameters(
         int deviceInputWidth,
         int deviceInputHeight,
+        bool isCaptureRegionGrabbed,
         const RecordingConfig &config) {
-    int encoderOutputWidth = deviceInputWidth;
-    int encoderOutputHeight = deviceInputHeight;
-    int scalerOutputWidth = encoderOutputWidth;
-    int scalerOutputHeight = encoderOutputHeight;
-    int cropOriginX = 0;
-    int cropOriginY = 0;
+    int cropX = 0;
+    int cropY = 0;
+    int cropWidth = deviceInputWidth;
+    int cropHeight = deviceInputHeight;
 
-    double scalingFactor = 1;
+    if (config.getCaptureRegion().has_value() && !isCaptureRegionGrabbed) {
+        auto[x, y, width, height] = config.getCaptureRegion().value();
+
+        // The origin is kept even, so that it is aligned to the chroma samples of subsampled input formats
+        cropX = std::clamp(make_even(x), 0, make_even(deviceInputWidth));
+        cropY = std::clamp(make_even(y), 0, make_even(deviceInputHeight));
+        cropWidth = std::min(make_even(width), deviceInputWidth - cropX);
+        cropHeight = std::min(make_even(height), deviceInputHeight - cropY);
+    }
+
+    int encoderOutputWidth = cropWidth;
+    int encoderOutputHeight = cropHeight;
 
     if (config.getOutputResolution().has_value()) {
         auto[width, height, factor] = config.getOutputResolution().value();
-        scalingFactor = factor;
 
-        encoderOutputWidth = make_even((int) (encoderOutputWidth * scalingFactor));
-        encoderOutputHeight = make_even((int) (encoderOutputHeight * scalingFactor));
-        scalerOutputWidth = encoderOutputWidth;
-        scalerOutputHeight = encoderOutputHeight;
+        encoderOutputWidth = make_even((int) (cropWidth * factor));
+        encoderOutputHeight = make_even((int) (cropHeight * factor));
     }
 
-    if (config.getCaptureRegion().has_value()) {
-        auto[x, y, width, height] = config.getCaptureRegion().value();
+    return {encoderOutputWidth, encoderOutputHeight, cropX, cropY, cropWidth, cropHeight};
+}
 
-        encoderOutputWidth = make_even((int) (width * scalingFactor));
-        encoderOutputHeight = make_even((int) (height * scalingFactor));
-        cropOriginX = make_even((int) (x * scalingFactor));
-        cropOriginY = make_even((int) (y * scalingFactor));
-    }
+/// Returns the output size and the output file path of a video rendition.
+/// The size is the recorded region one, scaled by the rendition factor. The output file is named as the main one,
+/// with the rendition size as suffix.
+std::tuple<int, int, std::string> RecordingServiceImpl::get_rendition_output_parameters(
+        int cropWidth,
+        int cropHeight,
+        const VideoRendition &rendition,
+        const std::string &outputPath) {
+    int width = std::max(make_even((int) (cropWidth * rendition.scalingFactor)), 2);
+    int height = std::max(make_even((int) (cropHeight * rendition.scalingFactor)), 2);
+
+    std::filesystem::path path(outputPath);
+    path.replace_filename(fmt::format("{}_{}x{}{}", path.stem().string(), width, height, path.extension().string()));
 
-    return {encoderOutputWidth, encoderOutputHeight, scalerOutputWidth,
-            scalerOutputHeight, cropOriginX, cropOriginY};
+    return {width, height, path.string()};
 }
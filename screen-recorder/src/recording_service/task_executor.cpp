@@ -0,0 +1,146 @@
+#include "task_executor.h"
+
+using namespace std::chrono;
+
+// Executor and worker index of the current thread, if it is an executor worker
+static thread_local const TaskExecutor *currentExecutor = nullptr;
+static thread_local int currentWorkerIndex = -1;
+
+/// Starts the workers.
+/// If the passed worker count is not positive, a worker for each hardware thread is started.
+TaskExecutor::TaskExecutor(int workerCount)
+        : queuedTasks(0), nextWorker(0), mustStop(false), startTime(steady_clock::now()) {
+    if (workerCount <= 0)
+        workerCount = (int) std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (int i = 0; i < workerCount; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->thread = std::thread([this, i]() { run_worker(i); });
+    }
+}
+
+/// Returns the index of the worker running on the current thread, or -1 if the thread doesn't belong to the executor
+int TaskExecutor::get_current_worker() const {
+    return currentExecutor == this ? currentWorkerIndex : -1;
+}
+
+/// Takes the next task for the passed worker: the newest task of its own deque, otherwise the oldest task of another
+/// worker deque.
+/// A negative worker index means that the task is taken by a thread outside the executor.
+bool TaskExecutor::pop_task(int workerIndex, std::function<void()> &task) {
+    if (workerIndex >= 0) {
+        Worker &worker = *workers[workerIndex];
+        std::lock_guard<std::mutex> lock(worker.tasksMutex);
+        if (!worker.tasks.empty()) {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            queuedTasks--;
+            return true;
+        }
+    }
+
+    int firstVictim = workerIndex >= 0 ? workerIndex + 1 : 0;
+    for (int i = 0; i < workers.size(); i++) {
+        int victimIndex = (firstVictim + i) % (int) workers.size();
+        if (victimIndex == workerIndex)
+            continue;
+
+        Worker &victim = *workers[victimIndex];
+        std::lock_guard<std::mutex> lock(victim.tasksMutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queuedTasks--;
+            if (workerIndex >= 0)
+                workers[workerIndex]->stolenTasks++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Runs a task, accounting its duration to the passed worker.
+/// Tasks must handle their own errors: exceptions are discarded, so that a failing task doesn't stop the worker.
+void TaskExecutor::run_task(int workerIndex, std::function<void()> &task) {
+    auto start = steady_clock::now();
+    try {
+        task();
+    } catch (...) {
+    }
+    task = nullptr;
+
+    if (workerIndex >= 0) {
+        workers[workerIndex]->busyTime += duration_cast<microseconds>(steady_clock::now() - start).count();
+        workers[workerIndex]->executedTasks++;
+    }
+}
+
+/// Runs the tasks until the executor is stopped
+void TaskExecutor::run_worker(int workerIndex) {
+    currentExecutor = this;
+    currentWorkerIndex = workerIndex;
+
+    std::function<void()> task;
+    while (true) {
+        if (pop_task(workerIndex, task)) {
+            run_task(workerIndex, task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCV.wait(lock, [this] { return mustStop || queuedTasks > 0; });
+        if (mustStop && queuedTasks == 0)
+            break;
+    }
+}
+
+/// Enqueues a task
+void TaskExecutor::submit(std::function<void()> task) {
+    int workerIndex = get_current_worker();
+    if (workerIndex < 0)
+        workerIndex = (int) (nextWorker++ % workers.size());
+
+    Worker &worker = *workers[workerIndex];
+    {
+        std::lock_guard<std::mutex> lock(worker.tasksMutex);
+        worker.tasks.push_back(std::move(task));
+        queuedTasks++;
+    }
+
+    // Lock the sleep mutex, so that the notification is not lost by a worker which is going to sleep
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    sleepCV.notify_one();
+}
+
+std::vector<TaskExecutorWorkerStats> TaskExecutor::get_stats() const {
+    auto lifetime = duration_cast<microseconds>(steady_clock::now() - startTime).count();
+
+    std::vector<TaskExecutorWorkerStats> stats;
+    stats.reserve(workers.size());
+    for (const auto &worker: workers) {
+        int64_t busyTime = worker->busyTime;
+        stats.push_back({.executedTasks = worker->executedTasks,
+                         .stolenTasks = worker->stolenTasks,
+                         .busyTime = busyTime,
+                         .utilization = lifetime > 0 ? std::min((double) busyTime / (double) lifetime, 1.0) : 0});
+    }
+    return stats;
+}
+
+/// Stops the workers, after the queued tasks have been executed
+TaskExecutor::~TaskExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        mustStop = true;
+    }
+    sleepCV.notify_all();
+
+    for (auto &worker: workers) {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+}
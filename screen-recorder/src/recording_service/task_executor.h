@@ -0,0 +1,73 @@
+#ifndef PDS_SCREEN_RECORDING_TASK_EXECUTOR_H
+#define PDS_SCREEN_RECORDING_TASK_EXECUTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct TaskExecutorWorkerStats {
+    uint64_t executedTasks; // Tasks executed by the worker, including the stolen ones
+    uint64_t stolenTasks;   // Tasks taken from the queue of another worker
+    int64_t busyTime;       // microseconds
+    double utilization;     // Busy time over the executor lifetime, from 0 to 1
+};
+
+/// Pool of worker threads shared by all the processing work of a recording (transcode chains, pipeline stages, frame
+/// slices and muxing).
+/// Each worker has its own tasks deque: tasks submitted by a worker are pushed to its own deque, while tasks
+/// submitted by other threads are distributed round-robin. Idle workers steal the oldest tasks from the other
+/// workers deques.
+/// Tasks must not block waiting for arbitrary tasks: a waiting task could hold the only worker able to run them.
+/// Threads waiting for a pipeline stage run the stage tasks themselves (see PipelineStage).
+class TaskExecutor {
+    struct Worker {
+        std::deque<std::function<void()>> tasks;
+        std::mutex tasksMutex;
+
+        std::thread thread;
+
+        std::atomic<uint64_t> executedTasks = 0;
+        std::atomic<uint64_t> stolenTasks = 0;
+        std::atomic<int64_t> busyTime = 0;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // Tasks queued and not yet taken by a worker
+    std::atomic<uint64_t> queuedTasks;
+    // Next worker receiving a task submitted by a thread outside the executor
+    std::atomic<uint64_t> nextWorker;
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCV;
+    bool mustStop;
+
+    std::chrono::steady_clock::time_point startTime;
+
+    int get_current_worker() const;
+
+    bool pop_task(int workerIndex, std::function<void()> &task);
+
+    void run_task(int workerIndex, std::function<void()> &task);
+
+    void run_worker(int workerIndex);
+
+public:
+    explicit TaskExecutor(int workerCount);
+
+    void submit(std::function<void()> task);
+
+    [[nodiscard]] int get_worker_count() const { return (int) workers.size(); };
+
+    [[nodiscard]] std::vector<TaskExecutorWorkerStats> get_stats() const;
+
+    ~TaskExecutor();
+};
+
+#endif //PDS_SCREEN_RECORDING_TASK_EXECUTOR_H
@@ -0,0 +1,173 @@
+#include "video_codec.h"
+#include <algorithm>
+#include <fmt/core.h>
+#include "error.h"
+
+// Key frames interval of the low latency presets, in frames
+const int LOW_LATENCY_KEYINT = 60;
+// Bits per pixel of the default H.264 bit rate, enough for text and UI content
+const double DEFAULT_H264_BITS_PER_PIXEL = 0.06;
+// Lower bound of the default bit rate, for small capture regions
+const int64_t MIN_DEFAULT_VIDEO_BIT_RATE = 500000;
+
+/// Returns the encoder and container settings of the passed codec and preset.
+/// H.264 and H.265 are muxed in MP4, the other codecs in Matroska, which holds all of them along with the AAC audio.
+/// H.265 streams are tagged as 'hvc1', so that they are played by all the players.
+VideoCodecProfile get_video_codec_profile(VideoCodec codec, VideoCodecPreset preset) {
+    bool isLowLatency = preset == VIDEO_PRESET_LOW_LATENCY;
+    std::string keyint = std::to_string(LOW_LATENCY_KEYINT);
+
+    switch (codec) {
+        case VIDEO_CODEC_H264:
+            if (isLowLatency)
+                return {"libx264", AV_CODEC_ID_H264,
+                        {{"profile", "main"},
+                         {"preset", "ultrafast"},
+                         {"x264-params", fmt::format("keyint={0}:min-keyint={0}:scenecut=0:force-cfr=1", keyint)},
+                         {"tune", "zerolatency"}},
+                        false, 0, "mp4"};
+            return {"libx264", AV_CODEC_ID_H264,
+                    {{"profile", "high"},
+                     {"preset", "slow"},
+                     {"x264-params", "force-cfr=1"}},
+                    false, 0, "mp4"};
+        case VIDEO_CODEC_H265:
+            if (isLowLatency)
+                return {"libx265", AV_CODEC_ID_HEVC,
+                        {{"preset", "ultrafast"},
+                         {"tune", "zerolatency"},
+                         {"x265-params",
+                          fmt::format("keyint={0}:min-keyint={0}:scenecut=0:log-level=error", keyint)}},
+                        false, MKTAG('h', 'v', 'c', '1'), "mp4"};
+            return {"libx265", AV_CODEC_ID_HEVC,
+                    {{"preset", "slow"},
+                     {"x265-params", "log-level=error"}},
+                    false, MKTAG('h', 'v', 'c', '1'), "mp4"};
+        case VIDEO_CODEC_VP9:
+            if (isLowLatency)
+                return {"libvpx-vp9", AV_CODEC_ID_VP9,
+                        {{"deadline", "realtime"},
+                         {"cpu-used", "8"},
+                         {"row-mt", "1"},
+                         {"lag-in-frames", "0"}},
+                        false, 0, "mkv"};
+            return {"libvpx-vp9", AV_CODEC_ID_VP9,
+                    {{"deadline", "good"},
+                     {"cpu-used", "2"},
+                     {"row-mt", "1"}},
+                    false, 0, "mkv"};
+        case VIDEO_CODEC_AV1_SVT:
+            if (isLowLatency)
+                return {"libsvtav1", AV_CODEC_ID_AV1,
+                        {{"preset", "8"},
+                         {"la_depth", "0"}},
+                        false, 0, "mkv"};
+            return {"libsvtav1", AV_CODEC_ID_AV1,
+                    {{"preset", "4"}},
+                    false, 0, "mkv"};
+        case VIDEO_CODEC_AV1_AOM:
+            if (isLowLatency)
+                return {"libaom-av1", AV_CODEC_ID_AV1,
+                        {{"usage", "realtime"},
+                         {"cpu-used", "8"},
+                         {"row-mt", "1"},
+                         {"lag-in-frames", "0"}},
+                        false, 0, "mkv"};
+            return {"libaom-av1", AV_CODEC_ID_AV1,
+                    {{"cpu-used", "4"},
+                     {"row-mt", "1"}},
+                    false, 0, "mkv"};
+        case VIDEO_CODEC_FFV1:
+            // The range coder and the large context model compress better, but are slower
+            if (isLowLatency)
+                return {"ffv1", AV_CODEC_ID_FFV1,
+                        {{"level", "3"},
+                         {"coder", "rice"},
+                         {"context", "0"},
+                         {"slices", "16"}},
+                        true, 0, "mkv"};
+            return {"ffv1", AV_CODEC_ID_FFV1,
+                    {{"level", "3"},
+                     {"coder", "range_def"},
+                     {"context", "1"},
+                     {"slices", "16"},
+                     {"slicecrc", "1"}},
+                    true, 0, "mkv"};
+        case VIDEO_CODEC_UTVIDEO:
+            return {"utvideo", AV_CODEC_ID_UTVIDEO,
+                    {{"pred", isLowLatency ? "left" : "median"}},
+                    true, 0, "mkv"};
+        default:
+            throw std::runtime_error(
+                    Error::build_error_message(__FUNCTION__, {}, fmt::format("unknown video codec {}", (int) codec)));
+    }
+}
+
+/// Returns the default average bit rate of the passed codec and output format, in bits per second.
+/// It is proportional to the pixels rate, scaled down for the codecs which compress better than H.264 at the same
+/// quality. Lossless codecs do not use a bit rate, so 0 is returned.
+int64_t get_default_video_bit_rate(VideoCodec codec, int width, int height, int frameRate) {
+    double efficiency;
+    switch (codec) {
+        case VIDEO_CODEC_H264:
+            efficiency = 1.0;
+            break;
+        case VIDEO_CODEC_H265:
+            efficiency = 0.6;
+            break;
+        case VIDEO_CODEC_VP9:
+            efficiency = 0.65;
+            break;
+        case VIDEO_CODEC_AV1_SVT:
+        case VIDEO_CODEC_AV1_AOM:
+            efficiency = 0.5;
+            break;
+        default:
+            return 0;
+    }
+
+    auto bitRate = (int64_t) (DEFAULT_H264_BITS_PER_PIXEL * efficiency * width * height * frameRate);
+    return std::max(bitRate, MIN_DEFAULT_VIDEO_BIT_RATE);
+}
+
+/// Returns the default quality (CRF or QP, lower is better) of the constant quality rate control of the passed codec.
+/// The values are the encoders defaults, which give about the same visual quality.
+int get_default_video_quality(VideoCodec codec) {
+    switch (codec) {
+        case VIDEO_CODEC_H264:
+            return 23;
+        case VIDEO_CODEC_H265:
+            return 28;
+        case VIDEO_CODEC_VP9:
+            return 33;
+        case VIDEO_CODEC_AV1_SVT:
+            return 35;
+        case VIDEO_CODEC_AV1_AOM:
+            return 32;
+        default:
+            return 0;
+    }
+}
+
+/// Returns the encoder options needed to honor the regions of interest frame side data, overriding the ones of the
+/// codec preset, or nothing if the codec encoder ignores it with the passed preset.
+/// libx264 and libx265 apply the regions through the adaptive quantization, which the ultrafast preset disables:
+/// libx265 only takes it from its x265-params. libvpx only applies them in realtime mode with cpu-used 5 or more,
+/// as in the low latency preset, and with its adaptive quantization disabled.
+std::optional<std::map<std::string, std::string>> get_video_codec_roi_options(VideoCodec codec,
+                                                                              VideoCodecPreset preset) {
+    switch (codec) {
+        case VIDEO_CODEC_H264:
+            return std::map<std::string, std::string>{{"aq-mode", "1"}};
+        case VIDEO_CODEC_H265: {
+            std::string x265Params = get_video_codec_profile(codec, preset).encoderOptions["x265-params"];
+            return std::map<std::string, std::string>{{"x265-params", x265Params + ":aq-mode=1"}};
+        }
+        case VIDEO_CODEC_VP9:
+            if (preset != VIDEO_PRESET_LOW_LATENCY)
+                return std::nullopt;
+            return std::map<std::string, std::string>{{"aq-mode", "0"}};
+        default:
+            return std::nullopt;
+    }
+}
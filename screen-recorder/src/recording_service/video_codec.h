@@ -0,0 +1,47 @@
+#ifndef PDS_SCREEN_RECORDING_VIDEO_CODEC_H
+#define PDS_SCREEN_RECORDING_VIDEO_CODEC_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+}
+
+enum VideoCodec {
+    VIDEO_CODEC_H264,      // libx264
+    VIDEO_CODEC_H265,      // libx265
+    VIDEO_CODEC_VP9,       // libvpx-vp9
+    VIDEO_CODEC_AV1_SVT,   // libsvtav1
+    VIDEO_CODEC_AV1_AOM,   // libaom-av1
+    VIDEO_CODEC_FFV1,      // Lossless
+    VIDEO_CODEC_UTVIDEO    // Lossless
+};
+
+enum VideoCodecPreset {
+    VIDEO_PRESET_LOW_LATENCY, // Cheapest encoding, to keep up with the capture on any machine
+    VIDEO_PRESET_ARCHIVAL     // Smaller output, at the cost of more CPU
+};
+
+/// Encoder and container settings of a video codec preset
+struct VideoCodecProfile {
+    std::string encoderName;
+    AVCodecID codecID;
+    std::map<std::string, std::string> encoderOptions;
+    bool isLossless;              // The bit rate is not used
+    uint32_t codecTag;            // Tag of the output stream, if the container default one must be overridden
+    std::string containerExtension;
+};
+
+VideoCodecProfile get_video_codec_profile(VideoCodec codec, VideoCodecPreset preset);
+
+int64_t get_default_video_bit_rate(VideoCodec codec, int width, int height, int frameRate);
+
+int get_default_video_quality(VideoCodec codec);
+
+std::optional<std::map<std::string, std::string>> get_video_codec_roi_options(VideoCodec codec,
+                                                                              VideoCodecPreset preset);
+
+#endif //PDS_SCREEN_RECORDING_VIDEO_CODEC_H